@@ -0,0 +1,235 @@
+#include "buffer_pool.h"
+#include "mirror_memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/** Size classes are 64K and then 4 steps between powers of 2, at most 25% larger than asked */
+#define POOL_CLASS_MIN_SHIFT	16
+#define POOL_CLASS_STEPS		4
+#define POOL_CLASS_NUM			((64 - POOL_CLASS_MIN_SHIFT) * POOL_CLASS_STEPS + 1)
+
+typedef struct _SPoolBlock
+{
+	char *addr;
+	/* Sizes of mirror mapping, headsize is 0 for a plain block */
+	size_t headsize;
+	size_t datasize;
+	struct _SPoolBlock *next;
+}SPoolBlock;
+
+typedef struct _SBuffPool
+{
+	pthread_mutex_t lock;
+	SPoolBlock *classes[POOL_CLASS_NUM];
+	/* Bytes of blocks kept */
+	size_t cached;
+	size_t maxbytes;
+	bool mlock;
+}SBuffPool;
+
+static SBuffPool g_pool = { PTHREAD_MUTEX_INITIALIZER };
+
+/** Index of the size class of size, and the size of the class */
+static unsigned int PoolClass(size_t size, size_t *pclasssize)
+{
+	unsigned int shift = POOL_CLASS_MIN_SHIFT;
+	if(size <= ((size_t)1 << shift))
+	{
+		*pclasssize = (size_t)1 << shift;
+		return 0;
+	}
+	while(((size_t)1 << (shift + 1)) < size)
+	{
+		shift++;
+	}
+	size_t step = ((size_t)1 << shift) / POOL_CLASS_STEPS;
+	size_t steps = (size - ((size_t)1 << shift) + step - 1) / step;
+	*pclasssize = ((size_t)1 << shift) + steps * step;
+	return (shift - POOL_CLASS_MIN_SHIFT) * POOL_CLASS_STEPS + steps;
+}
+
+/** Fault in the pages now, not when the writer touches them */
+static void PrefaultPoolBuff(char *addr, size_t len)
+{
+#ifdef MADV_POPULATE_WRITE
+	if(0 == madvise(addr, len, MADV_POPULATE_WRITE))
+	{
+		return;
+	}
+#endif
+	size_t page = MirrorAlignSize(1);
+	for(size_t i = 0; i < len; i += page)
+	{
+		((volatile char *)addr)[i] = 0;
+	}
+}
+
+static void LockPoolBuff(char *addr, size_t len)
+{
+	if(g_pool.mlock && mlock(addr, len) < 0)
+	{
+		fprintf(stderr, "mlock %zu bytes failed:%s\n", len, strerror(errno));
+	}
+}
+
+/** Take a block of the class, a mirror one must have the same sizes */
+static char *TakePoolBlock(unsigned int index, size_t headsize, size_t datasize)
+{
+	char *addr = NULL;
+	pthread_mutex_lock(&g_pool.lock);
+	SPoolBlock **link = &g_pool.classes[index];
+	for(; *link; link = &(*link)->next)
+	{
+		SPoolBlock *block = *link;
+		if(block->headsize == headsize && (!headsize || block->datasize == datasize))
+		{
+			*link = block->next;
+			g_pool.cached -= block->headsize + block->datasize;
+			addr = block->addr;
+			free(block);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_pool.lock);
+	return addr;
+}
+
+/** Keep the block if there is room, return false if it should be unmapped */
+static bool PutPoolBlock(unsigned int index, char *addr, size_t headsize, size_t datasize)
+{
+	bool kept = false;
+	pthread_mutex_lock(&g_pool.lock);
+	if(g_pool.cached + headsize + datasize <= g_pool.maxbytes)
+	{
+		SPoolBlock *block = (SPoolBlock *)malloc(sizeof(SPoolBlock));
+		if(block)
+		{
+			block->addr = addr;
+			block->headsize = headsize;
+			block->datasize = datasize;
+			block->next = g_pool.classes[index];
+			g_pool.classes[index] = block;
+			g_pool.cached += headsize + datasize;
+			kept = true;
+		}
+	}
+	pthread_mutex_unlock(&g_pool.lock);
+	return kept;
+}
+
+void SetBuffPool(size_t maxbytes, bool lock)
+{
+	pthread_mutex_lock(&g_pool.lock);
+	g_pool.maxbytes = maxbytes;
+	g_pool.mlock = lock;
+	pthread_mutex_unlock(&g_pool.lock);
+	if(!maxbytes)
+	{
+		ClearBuffPool();
+	}
+}
+
+void ClearBuffPool(void)
+{
+	SPoolBlock *blocks = NULL;
+	pthread_mutex_lock(&g_pool.lock);
+	for(unsigned int i = 0; i < POOL_CLASS_NUM; i++)
+	{
+		while(g_pool.classes[i])
+		{
+			SPoolBlock *block = g_pool.classes[i];
+			g_pool.classes[i] = block->next;
+			block->next = blocks;
+			blocks = block;
+		}
+	}
+	g_pool.cached = 0;
+	pthread_mutex_unlock(&g_pool.lock);
+
+	while(blocks)
+	{
+		SPoolBlock *next = blocks->next;
+		if(blocks->headsize)
+		{
+			DeleteMirrorMapping(blocks->addr, blocks->headsize, blocks->datasize);
+		}
+		else
+		{
+			munmap(blocks->addr, blocks->datasize);
+		}
+		free(blocks);
+		blocks = next;
+	}
+}
+
+char *AllocPoolBuff(size_t size)
+{
+	size_t classsize;
+	unsigned int index = PoolClass(size, &classsize);
+	char *addr = TakePoolBlock(index, 0, classsize);
+	if(addr)
+	{
+		return addr;
+	}
+
+	addr = (char *)mmap(NULL, classsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(MAP_FAILED == addr)
+	{
+		fprintf(stderr, "pool map %zu bytes failed:%s\n", classsize, strerror(errno));
+		return NULL;
+	}
+	LockPoolBuff(addr, classsize);
+	return addr;
+}
+
+void FreePoolBuff(char *pbuf, size_t size)
+{
+	size_t classsize;
+	if(!pbuf)
+	{
+		return;
+	}
+	unsigned int index = PoolClass(size, &classsize);
+	if(!PutPoolBlock(index, pbuf, 0, classsize))
+	{
+		munmap(pbuf, classsize);
+	}
+}
+
+char *AllocPoolMirror(size_t headsize, size_t datasize)
+{
+	size_t classsize;
+	unsigned int index = PoolClass(headsize + datasize, &classsize);
+	char *addr = TakePoolBlock(index, headsize, datasize);
+	if(addr)
+	{
+		return addr;
+	}
+
+	addr = CreateMirrorMemory(headsize, datasize);
+	if(addr)
+	{
+		/** The second view shares the pages of the first one */
+		PrefaultPoolBuff(addr, headsize + datasize);
+		LockPoolBuff(addr, headsize + datasize * 2);
+	}
+	return addr;
+}
+
+void FreePoolMirror(char *pbuf, size_t headsize, size_t datasize)
+{
+	size_t classsize;
+	if(!pbuf)
+	{
+		return;
+	}
+	unsigned int index = PoolClass(headsize + datasize, &classsize);
+	if(!PutPoolBlock(index, pbuf, headsize, datasize))
+	{
+		DeleteMirrorMapping(pbuf, headsize, datasize);
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+#include <stdio.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Blocks of stream buffers and sort are kept by size class after free, a stream
+ *  restarted reuses memory already faulted in instead of waiting for zeroed pages */
+
+/* Keep up to maxbytes of free blocks, 0 to disable. Blocks are locked in memory if lock */
+void SetBuffPool(size_t maxbytes, bool lock);
+/* Free all blocks kept */
+void ClearBuffPool(void);
+
+/* Page aligned and faulted in block of at least size, the content is undefined */
+char *AllocPoolBuff(size_t size);
+void FreePoolBuff(char *pbuf, size_t size);
+
+/* Mirror mapping like CreateMirrorMemory(), only reused by the same sizes */
+char *AllocPoolMirror(size_t headsize, size_t datasize);
+void FreePoolMirror(char *pbuf, size_t headsize, size_t datasize);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
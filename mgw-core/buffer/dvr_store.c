@@ -0,0 +1,530 @@
+#include "dvr_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define _printd(fmt, ...)	printf ("[%s][%d]"fmt"\n", (char *)strrchr(__FILE__, '\\')?(strrchr(__FILE__, '/') + 1):__FILE__, __LINE__, ##__VA_ARGS__)
+
+/** Frames and bytes at least copied out of the stream buffer by one read */
+#define DVR_BATCH_FRAMES	64
+#define DVR_BATCH_BYTES		(2*1024*1024)
+#define DVR_WAIT_MS			100
+#define DVR_GOP_INDEX_DEF	1024
+#define DVR_FRAME_ALIGN(len)	(((len) + 7) & ~7U)
+
+/** Record of a frame in segment, followed by the frame */
+typedef struct _SDvrFrameHead
+{
+	unsigned int len;
+	int frametype;
+	int priority;
+	unsigned int reserved;
+	unsigned long long timestamp;
+}SDvrFrameHead;
+
+typedef struct _SDvrSegment
+{
+	unsigned int seq;
+	char *pdata;
+	unsigned int size;
+	/* Bytes of frames published, readers never read beyond it */
+	volatile unsigned int used;
+	/* No more frame is appended, readers go on with the next segment */
+	volatile bool closed;
+	/* Out of the store, protected by the lock of store */
+	bool dropped;
+	/* One of store while in it, and one of each reader in it */
+	volatile long refs;
+	struct _SDvrSegment *next;
+}SDvrSegment;
+
+typedef struct _SDvrGop
+{
+	unsigned long long timestamp;
+	SDvrSegment *seg;
+	unsigned int offset;
+}SDvrGop;
+
+struct _DvrStore
+{
+	char name[64];
+	char dir[192];
+	unsigned int segsize;
+	unsigned int maxsegs;
+	/* Reader of the stream buffer, only used by the thread */
+	BuffContext *reader;
+	pthread_t thread;
+	volatile bool stop;
+	volatile long refs;
+
+	/* Protects the segments and the GOP index */
+	pthread_mutex_t lock;
+	SDvrSegment *first;
+	SDvrSegment *last;
+	unsigned int segcount;
+	unsigned int seqnext;
+	SDvrGop *gops;
+	unsigned int gopcount;
+	unsigned int gopcap;
+
+	struct _DvrStore *next;
+};
+
+struct _DvrReader
+{
+	DvrStore *store;
+	SDvrSegment *seg;
+	unsigned int offset;
+};
+
+static pthread_mutex_t g_dvr_lock = PTHREAD_MUTEX_INITIALIZER;
+static DvrStore *g_dvr_stores = NULL;
+
+static void SegmentPath(DvrStore *store, unsigned int seq, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s-%u.dvr", store->dir, store->name, seq);
+}
+
+static SDvrSegment *CreateDvrSegment(DvrStore *store)
+{
+	char path[320];
+	SDvrSegment *seg = (SDvrSegment *)calloc(1, sizeof(SDvrSegment));
+	if(!seg)
+	{
+		return NULL;
+	}
+	seg->seq = store->seqnext++;
+	seg->size = store->segsize;
+	seg->refs = 1;
+	SegmentPath(store, seg->seq, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, seg->size) < 0)
+	{
+		_printd("create dvr segment %s failed:%s", path, strerror(errno));
+		goto error;
+	}
+	seg->pdata = (char *)mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == seg->pdata)
+	{
+		_printd("map dvr segment %s failed:%s", path, strerror(errno));
+		goto error;
+	}
+	/** The mapping keeps the file */
+	close(fd);
+	return seg;
+
+error:
+	if(fd >= 0)
+	{
+		close(fd);
+		unlink(path);
+	}
+	free(seg);
+	return NULL;
+}
+
+static void ReleaseDvrSegment(SDvrSegment *seg)
+{
+	if(seg && 0 == __sync_sub_and_fetch(&seg->refs, 1))
+	{
+		munmap(seg->pdata, seg->size);
+		free(seg);
+	}
+}
+
+/** Drop the oldest segment and its GOPs with the lock held, readers in it may read it to the end */
+static void DropDvrSegment(DvrStore *store)
+{
+	char path[320];
+	SDvrSegment *seg = store->first;
+	unsigned int n = 0;
+
+	while(n < store->gopcount && store->gops[n].seg == seg)
+	{
+		n++;
+	}
+	memmove(store->gops, store->gops + n, (store->gopcount - n) * sizeof(SDvrGop));
+	store->gopcount -= n;
+
+	store->first = seg->next;
+	if(store->last == seg)
+	{
+		store->last = NULL;
+	}
+	store->segcount--;
+	seg->dropped = true;
+	SegmentPath(store, seg->seq, path, sizeof(path));
+	unlink(path);
+	ReleaseDvrSegment(seg);
+}
+
+static void PushDvrGop(DvrStore *store, unsigned long long timestamp, SDvrSegment *seg, unsigned int offset)
+{
+	if(store->gopcount == store->gopcap)
+	{
+		unsigned int cap = store->gopcap ? store->gopcap * 2 : DVR_GOP_INDEX_DEF;
+		SDvrGop *gops = (SDvrGop *)realloc(store->gops, cap * sizeof(SDvrGop));
+		if(!gops)
+		{
+			return;
+		}
+		store->gops = gops;
+		store->gopcap = cap;
+	}
+	store->gops[store->gopcount].timestamp = timestamp;
+	store->gops[store->gopcount].seg = seg;
+	store->gops[store->gopcount].offset = offset;
+	store->gopcount++;
+}
+
+static void AppendDvrFrame(DvrStore *store, SGetFrameInfo *pinfo)
+{
+	unsigned int len = pinfo->faddr[0].len;
+	unsigned int need = DVR_FRAME_ALIGN(sizeof(SDvrFrameHead) + len);
+	bool keyframe = FRAME_I == pinfo->frametype || FRAME_IDR == pinfo->frametype;
+	SDvrSegment *seg = store->last;
+
+	if(need > store->segsize)
+	{
+		_printd("(%s) frame of %u bytes is larger than dvr segment", store->name, len);
+		return;
+	}
+	/** Nothing is stored before the first key frame */
+	if(!seg && !keyframe)
+	{
+		return;
+	}
+	if(!seg || seg->used + need > seg->size)
+	{
+		SDvrSegment *pnew = CreateDvrSegment(store);
+		if(!pnew)
+		{
+			return;
+		}
+		pthread_mutex_lock(&store->lock);
+		if(seg)
+		{
+			seg->next = pnew;
+			__atomic_store_n(&seg->closed, true, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			store->first = pnew;
+		}
+		store->last = pnew;
+		store->segcount++;
+		while(store->segcount > store->maxsegs)
+		{
+			DropDvrSegment(store);
+		}
+		pthread_mutex_unlock(&store->lock);
+		seg = pnew;
+	}
+
+	unsigned int offset = seg->used;
+	SDvrFrameHead *head = (SDvrFrameHead *)(seg->pdata + offset);
+	head->len = len;
+	head->frametype = pinfo->frametype;
+	head->priority = pinfo->priority;
+	head->reserved = 0;
+	head->timestamp = pinfo->timestamp;
+	memcpy(head + 1, pinfo->faddr[0].pframe, len);
+	/** Publish the frame, pair with the readers */
+	__atomic_store_n(&seg->used, offset + need, __ATOMIC_RELEASE);
+
+	if(keyframe)
+	{
+		pthread_mutex_lock(&store->lock);
+		PushDvrGop(store, pinfo->timestamp, seg, offset);
+		pthread_mutex_unlock(&store->lock);
+	}
+}
+
+/** Copy frames out of the stream buffer, no frame is pinned while waiting for disk */
+static void *DvrStoreThread(void *arg)
+{
+	DvrStore *store = (DvrStore *)arg;
+	SGetFrameInfo infos[DVR_BATCH_FRAMES];
+	uint8_t *buf = NULL;
+	unsigned int bufsize = 0;
+
+	while(!store->stop)
+	{
+		/** A frame is less than half of the stream buffer, the batch takes the biggest one,
+		 *  and grows after the reader moves to a resized buffer */
+		unsigned int need = ((SmemoryHead *)store->reader->position.pstuHead)->datasize / 2;
+		if(need < DVR_BATCH_BYTES)
+		{
+			need = DVR_BATCH_BYTES;
+		}
+		if(need > bufsize)
+		{
+			uint8_t *pnew = (uint8_t *)realloc(buf, need);
+			if(!pnew)
+			{
+				_printd("(%s) alloc dvr batch of %u bytes failed", store->name, need);
+				break;
+			}
+			buf = pnew;
+			bufsize = need;
+		}
+
+		infos[0].timestamp = 0;
+		int count = GetFramesFromBuff(store->reader, infos, DVR_BATCH_FRAMES, bufsize, buf);
+		if(FRAME_CONSUME_SLOW == count)
+		{
+			continue;
+		}
+		if(count <= 0)
+		{
+			WaitFrameFromBuff(store->reader, DVR_WAIT_MS);
+			continue;
+		}
+		for(int i = 0; i < count; i++)
+		{
+			AppendDvrFrame(store, &infos[i]);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+DvrStore *CreateDvrStore(BuffContext *writer, const char *dir, unsigned int segsize, unsigned int maxsegs)
+{
+	if(!writer || !dir || segsize <= sizeof(SDvrFrameHead) || !maxsegs)
+	{
+		_printd("Invalid parameter");
+		return NULL;
+	}
+	if(mkdir(dir, 0755) < 0 && EEXIST != errno)
+	{
+		_printd("create dvr directory %s failed:%s", dir, strerror(errno));
+		return NULL;
+	}
+
+	DvrStore *store = (DvrStore *)calloc(1, sizeof(DvrStore));
+	if(!store)
+	{
+		return NULL;
+	}
+	snprintf(store->name, sizeof(store->name), "%s", writer->Name);
+	snprintf(store->dir, sizeof(store->dir), "%s", dir);
+	store->segsize = segsize;
+	store->maxsegs = maxsegs;
+	store->refs = 1;
+	pthread_mutex_init(&store->lock, NULL);
+
+	/** Read all frames, not by time and no frame is shed */
+	SmemoryHead *phead = (SmemoryHead *)writer->position.pstuHead;
+	store->reader = CreateStreamBuff(phead->datasize, writer->Name, "dvr", phead->uiMaxValidFrames,
+							writer->type | writer->flags, IO_MODE_READ, 0, NULL);
+	if(!store->reader)
+	{
+		_printd("(%s) create dvr reader failed", store->name);
+		goto error;
+	}
+	if(pthread_create(&store->thread, NULL, DvrStoreThread, store) != 0)
+	{
+		_printd("(%s) create dvr thread failed", store->name);
+		goto error;
+	}
+
+	pthread_mutex_lock(&g_dvr_lock);
+	store->next = g_dvr_stores;
+	g_dvr_stores = store;
+	pthread_mutex_unlock(&g_dvr_lock);
+	return store;
+
+error:
+	if(store->reader)
+	{
+		DeleteStreamBuff(store->reader);
+	}
+	pthread_mutex_destroy(&store->lock);
+	free(store);
+	return NULL;
+}
+
+void ReleaseDvrStore(DvrStore *store)
+{
+	if(!store || __sync_sub_and_fetch(&store->refs, 1) > 0)
+	{
+		return;
+	}
+	while(store->first)
+	{
+		DropDvrSegment(store);
+	}
+	free(store->gops);
+	pthread_mutex_destroy(&store->lock);
+	free(store);
+}
+
+void DeleteDvrStore(DvrStore *store)
+{
+	if(!store)
+	{
+		return;
+	}
+	pthread_mutex_lock(&g_dvr_lock);
+	DvrStore **pp = &g_dvr_stores;
+	while(*pp && *pp != store)
+	{
+		pp = &(*pp)->next;
+	}
+	if(*pp)
+	{
+		*pp = store->next;
+	}
+	pthread_mutex_unlock(&g_dvr_lock);
+
+	store->stop = true;
+	CancelWaitFrameFromBuff(store->reader);
+	pthread_join(store->thread, NULL);
+	DeleteStreamBuff(store->reader);
+	store->reader = NULL;
+	ReleaseDvrStore(store);
+}
+
+DvrStore *FindDvrStore(const char *name)
+{
+	DvrStore *store = NULL;
+	if(!name)
+	{
+		return NULL;
+	}
+	pthread_mutex_lock(&g_dvr_lock);
+	for(store = g_dvr_stores; store; store = store->next)
+	{
+		if(0 == strcmp(store->name, name))
+		{
+			__sync_add_and_fetch(&store->refs, 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_dvr_lock);
+	return store;
+}
+
+DvrReader *CreateDvrReader(DvrStore *store)
+{
+	if(!store)
+	{
+		return NULL;
+	}
+	DvrReader *reader = (DvrReader *)calloc(1, sizeof(DvrReader));
+	if(!reader)
+	{
+		return NULL;
+	}
+	__sync_add_and_fetch(&store->refs, 1);
+	reader->store = store;
+	return reader;
+}
+
+void DeleteDvrReader(DvrReader *reader)
+{
+	if(!reader)
+	{
+		return;
+	}
+	ReleaseDvrSegment(reader->seg);
+	ReleaseDvrStore(reader->store);
+	free(reader);
+}
+
+int64_t SeekDvrReader(DvrReader *reader, int64_t timestamp)
+{
+	if(!reader)
+	{
+		return -1;
+	}
+	DvrStore *store = reader->store;
+	int64_t found = -1;
+
+	pthread_mutex_lock(&store->lock);
+	if(store->gopcount > 0)
+	{
+		/** First GOP later than timestamp, the one before it is the GOP sought */
+		unsigned int lo = 0, hi = store->gopcount;
+		while(lo != hi)
+		{
+			unsigned int mid = lo + (hi - lo) / 2;
+			if(store->gops[mid].timestamp <= (unsigned long long)timestamp)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		SDvrGop *gop = &store->gops[lo > 0 ? lo - 1 : 0];
+		__sync_add_and_fetch(&gop->seg->refs, 1);
+		ReleaseDvrSegment(reader->seg);
+		reader->seg = gop->seg;
+		reader->offset = gop->offset;
+		found = gop->timestamp;
+	}
+	pthread_mutex_unlock(&store->lock);
+	return found;
+}
+
+int GetOneFrameFromDvr(DvrReader *reader, SGetFrameInfo *pinfo)
+{
+	if(!reader || !pinfo)
+	{
+		return -1;
+	}
+	SDvrSegment *seg = reader->seg;
+	if(!seg)
+	{
+		return -1;
+	}
+
+	while(reader->offset >= __atomic_load_n(&seg->used, __ATOMIC_ACQUIRE))
+	{
+		if(!__atomic_load_n(&seg->closed, __ATOMIC_ACQUIRE))
+		{
+			return 0;
+		}
+		/** Frames of a closed segment are all published before it is closed */
+		if(reader->offset < __atomic_load_n(&seg->used, __ATOMIC_ACQUIRE))
+		{
+			break;
+		}
+		pthread_mutex_lock(&reader->store->lock);
+		SDvrSegment *next = seg->dropped ? NULL : seg->next;
+		if(next)
+		{
+			__sync_add_and_fetch(&next->refs, 1);
+		}
+		pthread_mutex_unlock(&reader->store->lock);
+		if(!next)
+		{
+			return -1;
+		}
+		ReleaseDvrSegment(seg);
+		reader->seg = seg = next;
+		reader->offset = 0;
+	}
+
+	SDvrFrameHead *head = (SDvrFrameHead *)(seg->pdata + reader->offset);
+	pinfo->addrnum = 1;
+	pinfo->faddr[0].pframe = (char *)(head + 1);
+	pinfo->faddr[0].len = head->len;
+	pinfo->maxframelen = head->len;
+	pinfo->timestamp = head->timestamp;
+	pinfo->frametype = (frame_t)head->frametype;
+	pinfo->priority = head->priority;
+	pinfo->slot = -1;
+	reader->offset += DVR_FRAME_ALIGN(sizeof(SDvrFrameHead) + head->len);
+	return head->len;
+}
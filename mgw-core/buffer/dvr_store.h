@@ -0,0 +1,35 @@
+#ifndef __DVR_STORE_H__
+#define __DVR_STORE_H__
+#include "stream_buff.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Disk tier of a stream buffer. A thread reads all frames of the stream like a reader and
+ *  appends them to memory mapped segment files "dir/name-seq.dvr", so the writer never waits
+ *  for disk. Each GOP is indexed by timestamp, the oldest segment is dropped over maxsegs */
+typedef struct _DvrStore DvrStore;
+typedef struct _DvrReader DvrReader;
+
+/* Store the stream of writer, stores are registered by name for the readers of the same process */
+DvrStore *CreateDvrStore(BuffContext *writer, const char *dir, unsigned int segsize, unsigned int maxsegs);
+void DeleteDvrStore(DvrStore *store);
+
+/* Find the store of name and take a reference, NULL if not found */
+DvrStore *FindDvrStore(const char *name);
+void ReleaseDvrStore(DvrStore *store);
+
+DvrReader *CreateDvrReader(DvrStore *store);
+void DeleteDvrReader(DvrReader *reader);
+/* Move to the last key frame not later than timestamp, or the oldest one if all are later.
+ * Return the timestamp of the key frame, -1 if nothing is stored */
+int64_t SeekDvrReader(DvrReader *reader, int64_t timestamp);
+/* No copy, the frame is valid until the next read. Return the length, 0 if all frames stored
+ * are read and -1 if the frames to read have been dropped, seek again then */
+int GetOneFrameFromDvr(DvrReader *reader, SGetFrameInfo *pinfo);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
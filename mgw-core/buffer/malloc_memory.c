@@ -1,78 +1,237 @@
 #include "stream_buff.h"
-#include "list_function.h"
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "malloc_memory.h"
+#include "mirror_memory.h"
+#include "buffer_pool.h"
 
-SC_node *g_memory_head = NULL;
-int g_memory_nu = 0;
+/** Registry of heap buffers by name, attach and detach are O(1).
+ *  The buckets are protected by striped locks, a buffer is freed
+ *  when the last handle is detached */
+#define MEMORY_REGISTRY_BUCKETS		1024
+#define MEMORY_REGISTRY_LOCKS		64
 
-char *CreateMallocMemory(int *Fd, const char *name, int size, int frames, io_mode_t mode, void *priv_data)
+typedef struct _SMemoryEntry
 {
-	if(g_memory_head)
+	char name[64];
+	char *pbuff;
+	/* Count of handles attached */
+	int refs;
+	/* Replaced by a new buffer of the same name, only detached by pointer */
+	int retired;
+	struct _SMemoryEntry *next;
+}SMemoryEntry;
+
+static SMemoryEntry *g_memory_buckets[MEMORY_REGISTRY_BUCKETS];
+static pthread_mutex_t g_memory_locks[MEMORY_REGISTRY_LOCKS] = {
+	[0 ... MEMORY_REGISTRY_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/** FNV-1a */
+static unsigned int HashMemoryName(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	while(*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash % MEMORY_REGISTRY_BUCKETS;
+}
+
+static inline pthread_mutex_t *MemoryBucketLock(unsigned int bucket)
+{
+	return &g_memory_locks[bucket % MEMORY_REGISTRY_LOCKS];
+}
+
+/** Must hold the lock of bucket, '*pprev' is set to the link pointing to the entry.
+ *  The entry of 'pbuff' is found if it is not NULL, else the one not retired */
+static SMemoryEntry *FindMemoryEntry(unsigned int bucket, const char *name, char *pbuff, SMemoryEntry ***pprev)
+{
+	SMemoryEntry **link = &g_memory_buckets[bucket];
+	for(; *link; link = &(*link)->next)
 	{
-		char *pbuff = NULL;
-		SC_node *p = list_de(g_memory_head, &pbuff, (char *)name);
-		if(p)
+		if(pbuff ? (*link)->pbuff != pbuff : (*link)->retired)
 		{
-			SmemoryHead *h = (SmemoryHead *)pbuff;
-			if(IO_MODE_WRITE == mode && h->ucWriterCount > 0)
+			continue;
+		}
+		if(0 == strncmp((*link)->name, name, sizeof((*link)->name)))
+		{
+			if(pprev)
 			{
-				fprintf(stderr, "the buff has a writer");
-				return NULL;
+				*pprev = link;
 			}
-			return pbuff;
+			return *link;
 		}
 	}
+	return NULL;
+}
+
+/** Mirror mapped data region, the size of data is rounded up to page */
+static char *CreateMirrorBuff(int size, int frames, void *priv_data, int flags)
+{
+	unsigned int uiHeadSize = MirrorAlignSize(sizeof(SmemoryHead) + sizeof(SmemoryFrame) * frames);
+	unsigned int uiDataSize = MirrorAlignSize(size);
+	char *pbuf = AllocPoolMirror(uiHeadSize, uiDataSize);
+	if(!pbuf)
+	{
+		return NULL;
+	}
+	/** Memory of the pool is not zeroed, the data region is never read before written */
+	memset(pbuf, 0, sizeof(SmemoryHead));
+	if(flags & MEM_FLAG_HUGEPAGE)
+	{
+		AdviseHugePage(pbuf, uiHeadSize + uiDataSize * 2);
+	}
+
+	InitMemoryParam(pbuf, frames, uiDataSize, priv_data);
+	SmemoryHead *h = (SmemoryHead *)pbuf;
+	h->ucMirror = 1;
+	h->uiDataOffset = uiHeadSize;
+	return pbuf;
+}
+
+static void FreeMallocBuff(char *pbuf)
+{
+	SmemoryHead *h = (SmemoryHead *)pbuf;
+	if(h->ucMirror)
+	{
+		FreePoolMirror(pbuf, h->uiDataOffset, h->datasize);
+	}
+	else
+	{
+		FreePoolBuff(pbuf, sizeof(SmemoryHead) + sizeof(SmemoryFrame) * h->uiMaxValidFrames + h->datasize);
+	}
+}
+
+static char *AllocMallocBuff(const char *name, int size, int frames, void *priv_data, int flags)
+{
 	char *pbuf = NULL;
 
 	unsigned int uiHeadSize = sizeof(SmemoryHead);
 	unsigned int uiFrameSize = sizeof(SmemoryFrame) * frames;
 	unsigned int uiSize = size + uiHeadSize + uiFrameSize;
-	pbuf = (char *)calloc(1, uiSize);
+	if(flags & MEM_FLAG_MIRROR)
+	{
+		pbuf = CreateMirrorBuff(size, frames, priv_data, flags);
+		if(!pbuf)
+		{
+			fprintf(stderr, "the buff %s mirror failed, fall back to heap memory\n", name);
+		}
+	}
 	if(!pbuf)
 	{
-		return NULL;
+		pbuf = AllocPoolBuff(uiSize);
+		if(!pbuf)
+		{
+			return NULL;
+		}
+		memset(pbuf, 0, sizeof(SmemoryHead));
+		InitMemoryParam(pbuf, frames, size, priv_data);
 	}
+	return pbuf;
+}
 
-	InitMemoryParam(pbuf, frames, size, priv_data);
-	*Fd = 0;
-	if(!g_memory_head)
+char *CreateMallocMemory(int *Fd, const char *name, int size, int frames, io_mode_t mode, void *priv_data, int flags)
+{
+	unsigned int bucket = HashMemoryName(name);
+	pthread_mutex_t *lock = MemoryBucketLock(bucket);
+	char *pbuf = NULL;
+
+	pthread_mutex_lock(lock);
+	SMemoryEntry *entry = FindMemoryEntry(bucket, name, NULL, NULL);
+	if(entry)
 	{
-		g_memory_head = list_init();
-		g_memory_nu = 1;
+		SmemoryHead *h = (SmemoryHead *)entry->pbuff;
+		if(IO_MODE_WRITE == mode && h->ucWriterCount > 0)
+		{
+			pthread_mutex_unlock(lock);
+			fprintf(stderr, "the buff has a writer");
+			return NULL;
+		}
+		entry->refs++;
+		pbuf = entry->pbuff;
+		pthread_mutex_unlock(lock);
+		*Fd = 0;
+		return pbuf;
 	}
 
-	if(!list_en(g_memory_head, pbuf, (char*)name))
+	entry = (SMemoryEntry *)calloc(1, sizeof(SMemoryEntry));
+	pbuf = entry ? AllocMallocBuff(name, size, frames, priv_data, flags) : NULL;
+	if(!pbuf)
 	{
-		free(pbuf);
+		pthread_mutex_unlock(lock);
+		free(entry);
 		return NULL;
 	}
-	g_memory_nu++;
-	//SmemoryHead *pstuHead = (SmemoryHead *)pbuf;
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->pbuff = pbuf;
+	entry->refs = 1;
+	entry->next = g_memory_buckets[bucket];
+	g_memory_buckets[bucket] = entry;
+	pthread_mutex_unlock(lock);
+
+	*Fd = 0;
 	return pbuf;
 }
 
-int DeleteMallocMemory(const char *name)
+int RenameMallocMemory(const char *name, char *pbuff, const char *newname)
 {
-	if(g_memory_head)
+	unsigned int bucket = HashMemoryName(name);
+	unsigned int newbucket = HashMemoryName(newname);
+	SMemoryEntry **link = NULL;
+
+	pthread_mutex_lock(MemoryBucketLock(bucket));
+	SMemoryEntry *entry = FindMemoryEntry(bucket, name, pbuff, &link);
+	if(entry)
 	{
-		char *pbuff = NULL;
-		SC_node *p = list_de(g_memory_head, &pbuff, (char*)name);
-		if(p)
-		{
-			free(pbuff);
-			list_free(g_memory_head, (char*)name);
-		}
-		g_memory_nu--;
-		if(1 == g_memory_nu)
-		{
-			g_memory_nu = 0;
-			free(g_memory_head);
-			g_memory_head = NULL;
-		}
+		*link = entry->next;
+	}
+	pthread_mutex_unlock(MemoryBucketLock(bucket));
+	if(!entry)
+	{
+		fprintf(stderr, "the buff %s is not registered\n", name);
+		return -1;
 	}
 
+	/** The one of newname is retired and the entry takes its place at once */
+	pthread_mutex_lock(MemoryBucketLock(newbucket));
+	SMemoryEntry *old = FindMemoryEntry(newbucket, newname, NULL, NULL);
+	if(old)
+	{
+		old->retired = 1;
+	}
+	snprintf(entry->name, sizeof(entry->name), "%s", newname);
+	entry->next = g_memory_buckets[newbucket];
+	g_memory_buckets[newbucket] = entry;
+	pthread_mutex_unlock(MemoryBucketLock(newbucket));
 	return 0;
 }
 
+int DeleteMallocMemory(const char *name, char *pbuff)
+{
+	unsigned int bucket = HashMemoryName(name);
+	pthread_mutex_t *lock = MemoryBucketLock(bucket);
+	SMemoryEntry **link = NULL;
+
+	pthread_mutex_lock(lock);
+	SMemoryEntry *entry = FindMemoryEntry(bucket, name, pbuff, &link);
+	if(!entry)
+	{
+		pthread_mutex_unlock(lock);
+		fprintf(stderr, "the buff %s is not registered\n", name);
+		return -1;
+	}
+	if(--entry->refs > 0)
+	{
+		pthread_mutex_unlock(lock);
+		return 0;
+	}
+	*link = entry->next;
+	pthread_mutex_unlock(lock);
 
+	FreeMallocBuff(entry->pbuff);
+	free(entry);
+	return 0;
+}
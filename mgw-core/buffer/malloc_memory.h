@@ -6,8 +6,13 @@
 extern "C"{
 #endif
 
-char *CreateMallocMemory(int *Fd, const char *name, int size, int frames, io_mode_t mode, void *priv_data);
-int DeleteMallocMemory(const char *name);
+/* Attach a handle of the buffer by name, the first one creates it */
+char *CreateMallocMemory(int *Fd, const char *name, int size, int frames, io_mode_t mode, void *priv_data, int flags);
+/* Move the buffer to newname in place of the one there, the handles attached
+ * to that one detach later */
+int RenameMallocMemory(const char *name, char *pbuff, const char *newname);
+/* Detach a handle of the buffer, the last one frees the buffer */
+int DeleteMallocMemory(const char *name, char *pbuff);
 
 #ifdef __cplusplus
 }
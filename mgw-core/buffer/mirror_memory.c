@@ -0,0 +1,83 @@
+#include "mirror_memory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+size_t MirrorAlignSize(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+char *CreateMirrorMapping(int fd, size_t headsize, size_t datasize)
+{
+	size_t total = headsize + datasize * 2;
+	/** Reserve the address space first, then replace it by the two views */
+	char *base = (char *)mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == base)
+	{
+		fprintf(stderr, "mirror reserve %zu bytes failed:%s\n", total, strerror(errno));
+		return NULL;
+	}
+
+	if(MAP_FAILED == mmap(base, headsize + datasize, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_FIXED, fd, 0) ||
+		MAP_FAILED == mmap(base + headsize + datasize, datasize, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_FIXED, fd, headsize))
+	{
+		fprintf(stderr, "mirror map failed:%s\n", strerror(errno));
+		munmap(base, total);
+		return NULL;
+	}
+	return base;
+}
+
+void DeleteMirrorMapping(char *addr, size_t headsize, size_t datasize)
+{
+	if(addr)
+	{
+		munmap(addr, headsize + datasize * 2);
+	}
+}
+
+void AdviseHugePage(char *addr, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+	if(madvise(addr, len, MADV_HUGEPAGE) < 0)
+	{
+		fprintf(stderr, "madvise huge page failed:%s\n", strerror(errno));
+	}
+#endif
+}
+
+char *CreateMirrorMemory(size_t headsize, size_t datasize)
+{
+#ifdef SYS_memfd_create
+	int fd = syscall(SYS_memfd_create, "mgw-stream-buff", MFD_CLOEXEC);
+	if(fd < 0)
+	{
+		fprintf(stderr, "memfd_create failed:%s\n", strerror(errno));
+		return NULL;
+	}
+	if(ftruncate(fd, headsize + datasize) < 0)
+	{
+		fprintf(stderr, "memfd truncate %zu bytes failed:%s\n", headsize + datasize, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/** The mappings keep the memory alive */
+	char *base = CreateMirrorMapping(fd, headsize, datasize);
+	close(fd);
+	return base;
+#else
+	return NULL;
+#endif
+}
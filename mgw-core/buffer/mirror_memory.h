@@ -0,0 +1,27 @@
+#ifndef __MIRROR_MEMORY_H__
+#define __MIRROR_MEMORY_H__
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Round up to the size of page, both views of the mirror must be page aligned */
+size_t MirrorAlignSize(size_t size);
+
+/** Map [0, headsize + datasize) of fd and map [headsize, headsize + datasize) again
+ *  right after it, so data written near the end of data region can be read through
+ *  the second view continuously. headsize and datasize must be page aligned */
+char *CreateMirrorMapping(int fd, size_t headsize, size_t datasize);
+void DeleteMirrorMapping(char *addr, size_t headsize, size_t datasize);
+
+/** Ask for transparent huge pages, it is only an advice */
+void AdviseHugePage(char *addr, size_t len);
+
+/** Anonymous mirror mapping by memfd, NULL if not supported */
+char *CreateMirrorMemory(size_t headsize, size_t datasize);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,9 +1,11 @@
 #include "ring-buffer.h"
 #include "stream_buff.h"
 #include "stream_sort.h"
+#include "dvr_store.h"
 
 #include "util/dstr.h"
 #include "util/threading.h"
+#include "util/platform.h"
 #include "util/base.h"
 #include "util/tlog.h"
 
@@ -13,15 +15,62 @@
 #define RING_BUFFER_CAP_DEF         30
 /** Set ring buffer max frame size for getting */
 #define RING_BUFFER_MAX_FRAMESIZE   500*1024
+/** Buffered duration when sized by bitrate */
+#define RING_BUFFER_DURATION_DEF    3000
+#define RING_BUFFER_SIZE_MIN        1*1024*1024
+#define RING_BUFFER_SIZE_MAX        64*1024*1024
+#define RING_BUFFER_CAP_MAX         8192
+/** Auto size holds at least this many of the largest frame, a frame of half the buffer is rejected */
+#define RING_BUFFER_FRAME_ROOM      4
+/** Period to measure the bitrate written */
+#define RING_BUFFER_MEASURE_SEC     10
+/** DVR keeps 64 segments of 64M Bytes by default, hours of a few Mbps stream */
+#define RING_BUFFER_DVR_PATH_DEF    "/tmp/mgw-dvr"
+#define RING_BUFFER_DVR_SEG_MB_DEF  64
+#define RING_BUFFER_DVR_SEGS_DEF    64
 
 struct ring_buffer {
-	bool            sort;
-	volatile long   refs;
-	BuffContext     *bc;
-	mgw_data_t      *settings;
-	void            *sort_list;
-
-	pthread_mutex_t write_mutex;
+    bool            sort;
+    /** Video of the source is h264, by vencoderID of the meta */
+    bool            avc;
+    volatile long   refs;
+    BuffContext     *bc;
+    mgw_data_t      *settings;
+    void            *sort_list;
+    /** The frame pinned by zero copy read */
+    SGetFrameInfo   ref_info;
+    /** Descriptors of batch read */
+    SGetFrameInfo   *batch_info;
+    int             batch_cap;
+    /** Reader starts preroll_ms before the newest frame, until the first read */
+    uint32_t        preroll_ms;
+    bool            preroll;
+    /** DVR of the writer, and the reader of DVR while seeking earlier than the ring buffer */
+    DvrStore        *dvr;
+    DvrReader       *dvr_reader;
+    int64_t         dvr_ts;
+
+    /** Size by bitrate, resized when the bitrate measured drifts */
+    bool            auto_size;
+    uint32_t        buffer_ms;
+    size_t          mem_size;
+    int             capacity;
+    size_t          max_frame;
+    uint64_t        measure_ts;
+    uint64_t        measure_bytes;
+    uint32_t        measure_frames;
+    /** The new buffer is created by resize_thread, the writer swaps it in between two packets
+     *  and the thread deletes the old one, so neither is done on the write path */
+    pthread_t       resize_thread;
+    bool            resizing;
+    volatile bool   resize_done;
+    bool            resize_swapped;
+    os_event_t      *resize_event;
+    BuffContext     *resize_bc;
+    size_t          resize_mem_size;
+    int             resize_capacity;
+
+    pthread_mutex_t write_mutex;
 };
 
 mgw_data_t *mgw_rb_get_default(void)
@@ -30,16 +79,193 @@ mgw_data_t *mgw_rb_get_default(void)
 
     mgw_data_set_default_bool(setting, "sort", true);
     mgw_data_set_default_bool(setting, "heap_mem", false);
+    /** Map data region twice, so frames never wrap */
+    mgw_data_set_default_bool(setting, "mirror", true);
+    /** Back the data region by transparent huge pages */
+    mgw_data_set_default_bool(setting, "huge_pages", false);
     mgw_data_set_default_bool(setting, "read_by_time", true);
     mgw_data_set_default_int(setting, "mem_size", RING_BUFFER_SIZE_DEF);
     mgw_data_set_default_int(setting, "capacity", RING_BUFFER_CAP_DEF);
+    /** Size mem_size and capacity by "meta" of source if they are not set */
+    mgw_data_set_default_bool(setting, "auto_size", true);
+    mgw_data_set_default_int(setting, "buffer_ms", RING_BUFFER_DURATION_DEF);
+    /** Lag policy of reader in ms to drop non reference frames, skip GOP and jump to the
+     *  newest key frame, 0 to disable the step. All are off, an output opts in by its "buffer" */
+    mgw_data_set_default_int(setting, "lag_drop_ms", 0);
+    mgw_data_set_default_int(setting, "lag_skip_gop_ms", 0);
+    mgw_data_set_default_int(setting, "lag_jump_ms", 0);
+    /** Reader starts from the key frame preroll_ms before the newest frame, 0 from the newest key frame */
+    mgw_data_set_default_int(setting, "preroll_ms", 0);
+    /** Writer spills the stream to disk, readers can seek back beyond the ring buffer */
+    mgw_data_set_default_bool(setting, "dvr", false);
+    mgw_data_set_default_string(setting, "dvr_path", RING_BUFFER_DVR_PATH_DEF);
+    mgw_data_set_default_int(setting, "dvr_segment_mb", RING_BUFFER_DVR_SEG_MB_DEF);
+    mgw_data_set_default_int(setting, "dvr_max_segments", RING_BUFFER_DVR_SEGS_DEF);
 
     return setting;
 }
 
+/** Bitrate of meta is kbps in config and bps from ffmpeg, less than 'kbps_max' is kbps */
+static inline uint64_t rb_meta_bitrate(mgw_data_t *meta, const char *name, uint64_t kbps_max)
+{
+    uint64_t rate = mgw_data_get_int(meta, name);
+    return rate < kbps_max ? rate * 1000 : rate;
+}
+
+/** Bytes and frames to hold buffer_ms of the stream, bytes are doubled for key frames */
+static void rb_calc_size(struct ring_buffer *rb, uint64_t bps, double fps,
+        size_t *mem_size, int *capacity)
+{
+    uint64_t size = bps / 8 * rb->buffer_ms / 1000 * 2;
+    uint64_t frames = (uint64_t)(fps * rb->buffer_ms / 1000) + 1;
+
+    if (size < (uint64_t)rb->max_frame * RING_BUFFER_FRAME_ROOM)
+        size = (uint64_t)rb->max_frame * RING_BUFFER_FRAME_ROOM;
+    /** Frames the sort takes are less than half of SORT_SIZE_DEF, the ring takes them too */
+    if (rb->sort && size < SORT_SIZE_DEF)
+        size = SORT_SIZE_DEF;
+    if (size < RING_BUFFER_SIZE_MIN)
+        size = RING_BUFFER_SIZE_MIN;
+    else if (size > RING_BUFFER_SIZE_MAX)
+        size = RING_BUFFER_SIZE_MAX;
+    if (frames < RING_BUFFER_CAP_DEF)
+        frames = RING_BUFFER_CAP_DEF;
+    else if (frames > RING_BUFFER_CAP_MAX)
+        frames = RING_BUFFER_CAP_MAX;
+
+    *mem_size = size;
+    *capacity = frames;
+}
+
+/** Return false if the meta has no bitrate */
+static bool rb_calc_size_by_meta(struct ring_buffer *rb, mgw_data_t *meta,
+        size_t *mem_size, int *capacity)
+{
+    uint64_t vbps = rb_meta_bitrate(meta, "vbps", 100000);
+    uint64_t abps = rb_meta_bitrate(meta, "abps", 8000);
+    double fps = mgw_data_get_double(meta, "fps");
+    uint32_t samplerate = mgw_data_get_int(meta, "samplerate");
+
+    if (!vbps && !abps)
+        return false;
+    /** An aac frame has 1024 samples */
+    fps += samplerate ? samplerate / 1024.0 : (abps ? 50 : 0);
+    rb_calc_size(rb, vbps + abps, fps, mem_size, capacity);
+    return true;
+}
+
+static bool rb_meta_is_avc(mgw_data_t *meta)
+{
+    const char *vencoder = mgw_data_get_string(meta, "vencoderID");
+    return vencoder && 0 == strcmp(vencoder, mgw_get_vcodec_id(ENCID_H264));
+}
+
+/** Creating a buffer maps and clears megabytes and deleting one unmaps them, both are kept off the write path */
+static void *rb_resize_thread(void *data)
+{
+    struct ring_buffer *rb = data;
+    os_set_thread_name("rb-resize");
+    rb->resize_bc = PrepareResizeStreamBuff(rb->bc, rb->resize_mem_size, rb->resize_capacity);
+    __atomic_store_n(&rb->resize_done, true, __ATOMIC_RELEASE);
+    if (!rb->resize_bc)
+        return NULL;
+
+    /** Swapped by the writer or given up by destroy, resize_bc is the old buffer or the new one */
+    os_event_wait(rb->resize_event);
+    DeleteStreamBuff(rb->resize_bc);
+    return NULL;
+}
+
+static void rb_join_resize(struct ring_buffer *rb)
+{
+    if (!rb->resizing)
+        return;
+    if (!rb->resize_swapped)
+        os_event_signal(rb->resize_event);
+    pthread_join(rb->resize_thread, NULL);
+    os_event_destroy(rb->resize_event);
+    rb->resize_event = NULL;
+    rb->resizing = false;
+}
+
+/** Swap in the buffer created by resize_thread once it is done, with write_mutex held */
+static void rb_commit_resize(struct ring_buffer *rb)
+{
+    if (!rb->resizing || rb->resize_swapped || !os_atomic_load_bool(&rb->resize_done))
+        return;
+
+    if (rb->resize_bc && 0 == CommitResizeStreamBuff(rb->bc, rb->resize_bc)) {
+        rb->mem_size = rb->resize_mem_size;
+        rb->capacity = rb->resize_capacity;
+    }
+    rb->resize_swapped = true;
+    os_event_signal(rb->resize_event);
+}
+
+/** Resize if the buffer holds much less or much more than buffer_ms, with write_mutex held */
+static void rb_fit_size(struct ring_buffer *rb, size_t mem_size, int capacity)
+{
+    if (rb->resizing && !rb->resize_swapped)
+        return;
+    if (mem_size <= rb->mem_size && mem_size * 4 > rb->mem_size &&
+        capacity <= rb->capacity && capacity * 4 > rb->capacity)
+        return;
+
+    blog(MGW_LOG_INFO, "ring buffer %s resize from %zu bytes %d frames to %zu bytes %d frames",
+            rb->bc->Name, rb->mem_size, rb->capacity, mem_size, capacity);
+    /** The last one has deleted the old buffer or is about to */
+    rb_join_resize(rb);
+    rb->resize_mem_size = mem_size;
+    rb->resize_capacity = capacity;
+    rb->resize_bc = NULL;
+    rb->resize_done = false;
+    rb->resize_swapped = false;
+    if (0 != os_event_init(&rb->resize_event, OS_EVENT_TYPE_MANUAL))
+        return;
+    if (0 == pthread_create(&rb->resize_thread, NULL, rb_resize_thread, rb)) {
+        rb->resizing = true;
+    } else {
+        blog(MGW_LOG_ERROR, "ring buffer %s create resize thread failed", rb->bc->Name);
+        os_event_destroy(rb->resize_event);
+        rb->resize_event = NULL;
+    }
+}
+
+static void rb_measure_bitrate(struct ring_buffer *rb, size_t size)
+{
+    uint64_t now = os_gettime_ns();
+    rb->measure_bytes += size;
+    rb->measure_frames++;
+    /** Grow at once for a frame the buffer can't take, not at the next measure */
+    if (size > rb->max_frame) {
+        rb->max_frame = size;
+        if (size * 2 >= rb->mem_size && rb->mem_size < RING_BUFFER_SIZE_MAX)
+            rb_fit_size(rb, size * RING_BUFFER_FRAME_ROOM < RING_BUFFER_SIZE_MAX ?
+                    size * RING_BUFFER_FRAME_ROOM : RING_BUFFER_SIZE_MAX, rb->capacity);
+    }
+    if (!rb->measure_ts) {
+        rb->measure_ts = now;
+        return;
+    }
+
+    uint64_t elapsed = now - rb->measure_ts;
+    if (elapsed < RING_BUFFER_MEASURE_SEC * 1000000000ULL)
+        return;
+
+    size_t mem_size;
+    int capacity;
+    rb_calc_size(rb, rb->measure_bytes * 8 * 1000000000ULL / elapsed,
+            rb->measure_frames * 1e9 / elapsed, &mem_size, &capacity);
+    rb_fit_size(rb, mem_size, capacity);
+
+    rb->measure_ts = now;
+    rb->measure_bytes = 0;
+    rb->measure_frames = 0;
+}
+
 static int datacallback(void *puser, sc_sortframe *oframe)
 {
-	return PutOneFrameToBuff((BuffContext *)puser, (uint8_t*)oframe->frame, \
+    return PutOneFrameToBuff((BuffContext *)puser, (uint8_t*)oframe->frame, \
             oframe->frame_len, oframe->timestamp, oframe->frametype, oframe->priority);
 }
 
@@ -47,11 +273,12 @@ void *mgw_rb_create(mgw_data_t *settings, void *source)
 {
     struct ring_buffer *rb = bzalloc(sizeof(struct ring_buffer));
     rb->settings = mgw_data_newref(settings);
+    rb->ref_info.slot = -1;
 
     if (!settings)
         rb->settings = mgw_rb_get_default();
 
-	pthread_mutex_init(&rb->write_mutex, NULL);
+    pthread_mutex_init(&rb->write_mutex, NULL);
 
     io_mode_t io;
     const char *io_m = mgw_data_get_string(rb->settings, "io_mode");
@@ -65,27 +292,63 @@ void *mgw_rb_create(mgw_data_t *settings, void *source)
     size_t max_delay = mgw_data_get_int(rb->settings, "max_delay");
     const char *stream_name = mgw_data_get_string(rb->settings, "stream_name");
     const char *user_id = mgw_data_get_string(rb->settings, "user_id");
+    rb->mem_size = mgw_data_get_int(rb->settings, "mem_size");
+    rb->capacity = mgw_data_get_int(rb->settings, "capacity");
+    rb->buffer_ms = mgw_data_get_int(rb->settings, "buffer_ms");
+    /** Size explicitly set is kept */
+    rb->auto_size = IO_MODE_WRITE == io && rb->buffer_ms > 0 &&
+            mgw_data_get_bool(rb->settings, "auto_size") &&
+            !mgw_data_has_user_value(rb->settings, "mem_size") &&
+            !mgw_data_has_user_value(rb->settings, "capacity");
+    mgw_data_t *meta = mgw_data_get_obj(rb->settings, "meta");
+    if (meta) {
+        rb->avc = rb_meta_is_avc(meta);
+        if (rb->auto_size)
+            rb_calc_size_by_meta(rb, meta, &rb->mem_size, &rb->capacity);
+        mgw_data_release(meta);
+    }
+    int mem_type = mgw_data_get_bool(rb->settings, "heap_mem") ? MEM_DYNAMIC : MEM_SHARED;
+    if (mgw_data_get_bool(rb->settings, "mirror"))
+        mem_type |= MEM_FLAG_MIRROR;
+    if (mgw_data_get_bool(rb->settings, "huge_pages"))
+        mem_type |= MEM_FLAG_HUGEPAGE;
 
-    rb->bc = CreateStreamBuff(mgw_data_get_int(rb->settings, "mem_size"),
+    rb->bc = CreateStreamBuff(rb->mem_size,
                             stream_name,user_id,
-                            mgw_data_get_int(rb->settings, "capacity"),
-                            mgw_data_get_bool(rb->settings, "heap_mem"),
+                            rb->capacity,
+                            mem_type,
                             io,
                             mgw_data_get_bool(rb->settings, "read_by_time"),
                             (void *)source);
     if (!rb->bc)
         goto error;
 
+    if (IO_MODE_READ == io) {
+        SBuffLagPolicy lag = {};
+        lag.uiDropNonRefMs = mgw_data_get_int(rb->settings, "lag_drop_ms");
+        lag.uiSkipGopMs = mgw_data_get_int(rb->settings, "lag_skip_gop_ms");
+        lag.uiJumpNewestMs = mgw_data_get_int(rb->settings, "lag_jump_ms");
+        SetBuffLagPolicy(rb->bc, &lag);
+        rb->preroll_ms = mgw_data_get_int(rb->settings, "preroll_ms");
+        rb->preroll = rb->preroll_ms > 0;
+    }
+
+    if (IO_MODE_WRITE == io && mgw_data_get_bool(rb->settings, "dvr")) {
+        rb->dvr = CreateDvrStore(rb->bc, mgw_data_get_string(rb->settings, "dvr_path"),
+                (uint32_t)mgw_data_get_int(rb->settings, "dvr_segment_mb") << 20,
+                mgw_data_get_int(rb->settings, "dvr_max_segments"));
+        if (!rb->dvr)
+            blog(MGW_LOG_WARNING, "ring buffer %s create dvr failed", stream_name);
+    }
+
     /* as source writer, create the sort list if enable sort */
     if (IO_MODE_WRITE == io && rb->sort) {
         RegisterSortInfo info = {};
         info.Datacallback = datacallback;
         info.puser = rb->bc;
         info.uiSize = SORT_SIZE_DEF;
-        if (min_delay > 0)
-            info.uiSortTime = min_delay;
-        else
-            info.uiSortTime = SORT_TIME_DEF;
+        /** Sort window adapts to the disorder seen, min_delay is its floor */
+        info.uiSortTime = min_delay;
 
         if (max_delay > 0)
             info.uiMaxSortTime = max_delay;
@@ -94,8 +357,8 @@ void *mgw_rb_create(mgw_data_t *settings, void *source)
         dstr_copy(&info.userid, user_id);
 
         rb->sort_list = pCreateStreamSort(&info);
-		dstr_free(&info.name);
-		dstr_free(&info.userid);
+        dstr_free(&info.name);
+        dstr_free(&info.userid);
 
         if (!rb->sort_list)
             goto error;
@@ -109,22 +372,30 @@ error:
 
 void mgw_rb_destroy(void *data)
 {
-	struct ring_buffer *rb = data;
+    struct ring_buffer *rb = data;
 
-	if (!rb)
-		return;
+    if (!rb)
+        return;
 
-	if (rb->settings)
-		mgw_data_release(rb->settings);
+    if (rb->settings)
+        mgw_data_release(rb->settings);
 
-	if (!!rb->sort_list)
-		DelectStreamSort(rb->sort_list);
+    rb_join_resize(rb);
 
-	if (rb->bc)
-		DeleteStreamBuff(rb->bc);
+    if (!!rb->sort_list)
+        DelectStreamSort(rb->sort_list);
 
-	pthread_mutex_destroy(&rb->write_mutex);
-	bfree(rb);
+    DeleteDvrStore(rb->dvr);
+    DeleteDvrReader(rb->dvr_reader);
+
+    if (rb->bc) {
+        ReleaseOneFrameToBuff(rb->bc, &rb->ref_info);
+        DeleteStreamBuff(rb->bc);
+    }
+    bfree(rb->batch_info);
+
+    pthread_mutex_destroy(&rb->write_mutex);
+    bfree(rb);
 }
 
 void mgw_rb_addref(void *data)
@@ -149,51 +420,317 @@ size_t mgw_rb_write_packet(void *data, struct encoder_packet *packet)
         return -1;
 
     frame_t frame_type;
+    /** Non reference frames of h264 are marked FRAME_B, lagging readers drop them first */
     if (ENCODER_VIDEO == packet->type)
-        frame_type = packet->keyframe ? FRAME_I : FRAME_P;
+        frame_type = packet->keyframe ? FRAME_I :
+                (rb->avc && mgw_avc_disposable(packet->data, packet->size) ? FRAME_B : FRAME_P);
     else if (ENCODER_AUDIO == packet->type)
         frame_type = FRAME_AAC;
 
-	pthread_mutex_lock(&rb->write_mutex);
+    pthread_mutex_lock(&rb->write_mutex);
+    rb_commit_resize(rb);
     if (rb->sort) {
         sc_sortframe iframe = {};
-		iframe.frametype = frame_type;
-		iframe.frame_len = packet->size;
-		iframe.timestamp = packet->pts;
-		iframe.frame = (char *)packet->data;
+        iframe.frametype = frame_type;
+        iframe.frame_len = packet->size;
+        iframe.timestamp = packet->pts;
+        iframe.frame = (char *)packet->data;
         iframe.priority = packet->priority;
-		write_size = PutFrameStreamSort(&rb->sort_list, &iframe);
+        write_size = PutFrameStreamSort(&rb->sort_list, &iframe);
     } else {
         write_size = PutOneFrameToBuff(rb->bc, packet->data, \
                 packet->size, packet->pts, frame_type, packet->priority);
     }
-	pthread_mutex_unlock(&rb->write_mutex);
+    if (rb->auto_size)
+        rb_measure_bitrate(rb, packet->size);
+    pthread_mutex_unlock(&rb->write_mutex);
     return write_size;
 }
 
+/** Seek back by preroll_ms before the first read, the newest key frame is read if nothing to seek */
+static inline void rb_preroll(struct ring_buffer *rb)
+{
+    if (rb->preroll && SeekStreamBuff(rb->bc,
+            -(int64_t)rb->preroll_ms * 1000, SEEK_END, true) >= 0)
+        rb->preroll = false;
+}
+
+static inline void rb_packet_set_type(struct encoder_packet *packet,
+        frame_t frame_type)
+{
+    if (FRAME_AAC == frame_type)
+        packet->type = ENCODER_AUDIO;
+    else
+        packet->type = ENCODER_VIDEO;
+
+    if (frame_type == FRAME_I || frame_type == FRAME_IDR)
+        packet->keyframe = true;
+    else
+        packet->keyframe = false;
+}
+
+/** Read from DVR until it catches up, then go on with the ring buffer from the next frame */
+static int rb_read_dvr(struct ring_buffer *rb, struct encoder_packet *packet,
+        size_t max_size, bool copy)
+{
+    SGetFrameInfo info;
+    int read_size = GetOneFrameFromDvr(rb->dvr_reader, &info);
+    if (read_size <= 0) {
+        /** The frames to read are dropped from DVR, start from the oldest key frame of ring */
+        if (read_size < 0)
+            SeekStreamBuff(rb->bc, 0, SEEK_SET, true);
+        else
+            SeekStreamBuff(rb->bc, rb->dvr_ts + 1, SEEK_SET, false);
+        DeleteDvrReader(rb->dvr_reader);
+        rb->dvr_reader = NULL;
+        packet->size = 0;
+        return 0;
+    }
+
+    rb->dvr_ts = info.timestamp;
+    if (copy) {
+        if (!packet->data || (size_t)read_size > max_size) {
+            packet->size = 0;
+            return 0;
+        }
+        memcpy(packet->data, info.faddr[0].pframe, read_size);
+    } else {
+        packet->data = (uint8_t *)info.faddr[0].pframe;
+    }
+    packet->pts = info.timestamp;
+    packet->priority = info.priority;
+    rb_packet_set_type(packet, info.frametype);
+    packet->size = read_size;
+    return read_size;
+}
+
 int mgw_rb_read_packet(void *data, struct encoder_packet *packet)
 {
-	struct ring_buffer *rb = data;
+    struct ring_buffer *rb = data;
     int read_size = 0;
     if (!data || !packet)
         return FRAME_CONSUME_PERR;
 
     if (IO_MODE_WRITE == rb->bc->mode)
         return FRAME_CONSUME_PERR;
+    if (rb->dvr_reader)
+        return rb_read_dvr(rb, packet, RING_BUFFER_MAX_FRAMESIZE, true);
+
     frame_t frame_type = FRAME_UNKNOWN;
+    rb_preroll(rb);
     read_size = GetOneFrameFromBuff(rb->bc, &packet->data, RING_BUFFER_MAX_FRAMESIZE,
-            						&packet->pts, &frame_type, &packet->priority);
+                                    &packet->pts, &frame_type, &packet->priority);
+    if (read_size > 0)
+        rb->preroll = false;
 
-    if (FRAME_AAC == frame_type)
-        packet->type = ENCODER_AUDIO;
-    else
-        packet->type = ENCODER_VIDEO;
+    rb_packet_set_type(packet, frame_type);
+    packet->size = read_size;
+    return read_size;
+}
 
-    if (frame_type == FRAME_I || frame_type == FRAME_IDR)
-        packet->keyframe = true;
-	else
-		packet->keyframe = false;
+int mgw_rb_read_packet_ref(void *data, struct encoder_packet *packet)
+{
+    struct ring_buffer *rb = data;
+    SGetFrameInfo *info = NULL;
+    int read_size = 0;
+    if (!data || !packet)
+        return FRAME_CONSUME_PERR;
+
+    if (IO_MODE_WRITE == rb->bc->mode)
+        return FRAME_CONSUME_PERR;
+
+    info = &rb->ref_info;
+    ReleaseOneFrameToBuff(rb->bc, info);
+    if (rb->dvr_reader)
+        return rb_read_dvr(rb, packet, 0, false);
+    info->timestamp = packet->pts;
+    rb_preroll(rb);
+    read_size = GetOneFrameRefFromBuff(rb->bc, info);
+    if (read_size <= 0) {
+        packet->pts = info->timestamp;
+        packet->size = 0;
+        return read_size;
+    }
+    rb->preroll = false;
+
+    if (1 == info->addrnum) {
+        packet->data = (uint8_t *)info->faddr[0].pframe;
+    } else {
+        /** Wrapped at the end of buffer, copy to the scratch of caller */
+        if (!packet->data || read_size > RING_BUFFER_MAX_FRAMESIZE) {
+            ReleaseOneFrameToBuff(rb->bc, info);
+            return 0;
+        }
+        memcpy(packet->data, info->faddr[0].pframe, info->faddr[0].len);
+        memcpy(packet->data + info->faddr[0].len,
+                info->faddr[1].pframe, info->faddr[1].len);
+        /** Covered while copying, the copy may be torn */
+        if (ReleaseOneFrameToBuff(rb->bc, info) < 0) {
+            packet->size = 0;
+            return FRAME_CONSUME_SLOW;
+        }
+    }
 
+    packet->pts = info->timestamp;
+    packet->priority = info->priority;
+    rb_packet_set_type(packet, info->frametype);
     packet->size = read_size;
     return read_size;
-}
\ No newline at end of file
+}
+
+int mgw_rb_read_packets(void *data, struct encoder_packet *packets,
+        int max_packets, uint8_t *buf, size_t max_bytes, bool copy)
+{
+    struct ring_buffer *rb = data;
+    size_t scratch = 0;
+    int count = 0;
+    if (!data || !packets || max_packets <= 0 || !buf || !max_bytes)
+        return FRAME_CONSUME_PERR;
+
+    if (IO_MODE_WRITE == rb->bc->mode)
+        return FRAME_CONSUME_PERR;
+
+    if (rb->batch_cap < max_packets) {
+        rb->batch_info = brealloc(rb->batch_info, max_packets * sizeof(SGetFrameInfo));
+        rb->batch_cap = max_packets;
+    }
+    ReleaseOneFrameToBuff(rb->bc, &rb->ref_info);
+    if (rb->dvr_reader) {
+        packets[0].data = buf;
+        return rb_read_dvr(rb, &packets[0], max_bytes, copy) > 0 ? 1 : 0;
+    }
+    rb->batch_info[0].timestamp = packets[0].pts;
+    rb_preroll(rb);
+    count = GetFramesFromBuff(rb->bc, rb->batch_info, max_packets,
+            max_bytes > UINT32_MAX ? UINT32_MAX : max_bytes, copy ? buf : NULL);
+    if (count <= 0) {
+        packets[0].pts = rb->batch_info[0].timestamp;
+        packets[0].size = 0;
+        return count;
+    }
+    rb->preroll = false;
+
+    for (int i = 0; i < count; i++) {
+        SGetFrameInfo *info = &rb->batch_info[i];
+        struct encoder_packet *packet = &packets[i];
+        size_t size = info->faddr[0].len;
+        packet->data = (uint8_t *)info->faddr[0].pframe;
+        if (2 == info->addrnum) {
+            /** Wrapped at the end of buffer, the batch is no more than max_bytes */
+            size += info->faddr[1].len;
+            packet->data = buf + scratch;
+            memcpy(packet->data, info->faddr[0].pframe, info->faddr[0].len);
+            memcpy(packet->data + info->faddr[0].len,
+                    info->faddr[1].pframe, info->faddr[1].len);
+            scratch += size;
+        }
+        packet->pts = info->timestamp;
+        packet->priority = info->priority;
+        rb_packet_set_type(packet, info->frametype);
+        packet->size = size;
+    }
+    return count;
+}
+
+int mgw_rb_read_commit(void *data)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc)
+        return FRAME_CONSUME_PERR;
+
+    int ret = ReleaseOneFrameToBuff(rb->bc, &rb->ref_info);
+    if (ReleaseFramesToBuff(rb->bc) < 0 || ret < 0)
+        return FRAME_CONSUME_SLOW;
+    return 0;
+}
+
+int64_t mgw_rb_seek(void *data, int64_t pts, bool from_newest)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc || IO_MODE_WRITE == rb->bc->mode)
+        return FRAME_CONSUME_PERR;
+
+    /** Packets pinned are of the old position */
+    mgw_rb_read_commit(rb);
+    rb->preroll = false;
+    DeleteDvrReader(rb->dvr_reader);
+    rb->dvr_reader = NULL;
+    if (from_newest) {
+        /** An exact seek to the end gives the pts of the newest packet */
+        int64_t newest = SeekStreamBuff(rb->bc, 0, SEEK_END, false);
+        if (newest < 0)
+            return newest;
+        pts = newest > pts ? newest - pts : 0;
+    }
+
+    int64_t found = SeekStreamBuff(rb->bc, pts, SEEK_SET, true);
+    if (found >= 0 && found <= pts)
+        return found;
+
+    /** Earlier than the ring buffer holds, read from the DVR of stream if any */
+    DvrStore *store = FindDvrStore(rb->bc->Name);
+    DvrReader *reader = CreateDvrReader(store);
+    ReleaseDvrStore(store);
+    int64_t dvr_ts = SeekDvrReader(reader, pts);
+    if (dvr_ts >= 0 && (found < 0 || dvr_ts < found)) {
+        rb->dvr_reader = reader;
+        rb->dvr_ts = dvr_ts - 1;
+        return dvr_ts;
+    }
+    DeleteDvrReader(reader);
+    return found;
+}
+
+void mgw_rb_update_meta(void *data, mgw_data_t *meta)
+{
+    struct ring_buffer *rb = data;
+    size_t mem_size;
+    int capacity;
+    if (!rb || !meta)
+        return;
+
+    pthread_mutex_lock(&rb->write_mutex);
+    rb->avc = rb_meta_is_avc(meta);
+    if (rb->auto_size && rb_calc_size_by_meta(rb, meta, &mem_size, &capacity))
+        rb_fit_size(rb, mem_size, capacity);
+    pthread_mutex_unlock(&rb->write_mutex);
+}
+
+int mgw_rb_wait_packet(void *data, uint32_t timeout_ms)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc || IO_MODE_WRITE == rb->bc->mode)
+        return FRAME_CONSUME_PERR;
+
+    return WaitFrameFromBuff(rb->bc, timeout_ms);
+}
+
+void mgw_rb_cancel_wait(void *data)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc || IO_MODE_WRITE == rb->bc->mode)
+        return;
+
+    CancelWaitFrameFromBuff(rb->bc);
+}
+
+int mgw_rb_arm_notify(void *data, int fd)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc || IO_MODE_WRITE == rb->bc->mode)
+        return FRAME_CONSUME_PERR;
+
+    /** Behind the ring buffer, the DVR has packets to read */
+    if (rb->dvr_reader)
+        return 0;
+    return ArmFrameNotify(rb->bc, fd);
+}
+
+void mgw_rb_disarm_notify(void *data)
+{
+    struct ring_buffer *rb = data;
+    if (!rb || !rb->bc || IO_MODE_WRITE == rb->bc->mode)
+        return;
+
+    DisarmFrameNotify(rb->bc);
+}
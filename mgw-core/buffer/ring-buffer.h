@@ -16,7 +16,44 @@ void mgw_rb_release(void *data);
 mgw_data_t *mgw_rb_get_default(void);
 
 size_t mgw_rb_write_packet(void *data, struct encoder_packet *packet);
+/**< Writer only, size the buffer to hold "buffer_ms" by "vbps", "abps" and
+ *   "fps" of meta if "auto_size", readers move to the new buffer by themselves.
+ *   Non reference frames are marked only if "vencoderID" of meta is h264 */
+void mgw_rb_update_meta(void *data, mgw_data_t *meta);
 int mgw_rb_read_packet(void *data, struct encoder_packet *packet);
+/**< Zero copy read, packet->data points into the ring buffer and the frame
+ *   is pinned until mgw_rb_read_commit() or the next read. A pin does not
+ *   hold the writer, a reader whose pinned frame is covered meanwhile jumps
+ *   to a key frame, so commit before blocking on anything, and before the
+ *   next read to learn whether the packet was covered. packet->data must
+ *   point to a scratch buffer before reading, it is used when the frame wraps
+ *   at the end of a ring buffer which is not mirrored */
+int mgw_rb_read_packet_ref(void *data, struct encoder_packet *packet);
+/**< Read the packets available up to max_packets packets and max_bytes bytes
+ *   at once, return the count. Copied one after another into buf of max_bytes
+ *   if copy, otherwise zero copy and pinned like mgw_rb_read_packet_ref(), buf
+ *   is then the scratch of a frame wrapping at the end of the ring buffer */
+int mgw_rb_read_packets(void *data, struct encoder_packet *packets,
+        int max_packets, uint8_t *buf, size_t max_bytes, bool copy);
+/**< Release the packets pinned, FRAME_CONSUME_SLOW if the writer covered any of
+ *   them meanwhile, the data read may be torn and must not be sent */
+int mgw_rb_read_commit(void *data);
+/**< Reader only, the next read starts from the last key frame not later than
+ *   pts, or pts before the newest packet if from_newest. Packets earlier than
+ *   the ring buffer are read from the DVR of writer if "dvr" is enabled there,
+ *   until the reader catches up with it. Return the pts of the packet to read
+ *   next, negative if there is no key frame to seek */
+int64_t mgw_rb_seek(void *data, int64_t pts, bool from_newest);
+
+/**< Block the reader until a new packet is written, return 0 if there is
+ *   packet to read, ETIMEDOUT or ECANCELED by mgw_rb_cancel_wait() */
+int mgw_rb_wait_packet(void *data, uint32_t timeout_ms);
+void mgw_rb_cancel_wait(void *data);
+/**< Wait by an event loop, the writer writes 1 to the eventfd fd after each
+ *   packet until mgw_rb_disarm_notify(). Return 0 if there is packet to read
+ *   and not armed, EAGAIN if armed. Disarm before reading again */
+int mgw_rb_arm_notify(void *data, int fd);
+void mgw_rb_disarm_notify(void *data);
 
 #ifdef __cpluscplus
 }
@@ -1,54 +1,218 @@
 #include "stream_buff.h"
-#include <sys/shm.h>
+#include "mirror_memory.h"
+#include "share_memory.h"
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <assert.h>
 #include <sys/types.h> //Specified in man 2 open
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <errno.h> //Allows use of error numbers
 #include <fcntl.h> //Specified in man 2 open
 #include <stdio.h>
 #include <unistd.h>
 
-char *CreateShareMemory(int *Fd, const char *name, int size, int frames, void *priv_data)
+/** Where glibc keeps the segments of shm_open */
+#define SHM_DIR			"/dev/shm"
+
+#ifndef F_OFD_SETLKW
+/** Linux 3.15, only declared with _GNU_SOURCE */
+#define F_OFD_SETLKW	38
+#endif
+
+/**
+ * POSIX share memory, every process attached holds a shared flock on it.
+ * The kernel drops the lock when a process exits or crashes, so:
+ *  - who gets the exclusive lock on attach is alone, the segment is new
+ *    or left by crashed processes and is initialized again;
+ *  - who gets the exclusive lock on detach is the last one and unlinks it.
+ * flock turns the exclusive lock into a shared one by dropping it first, so
+ * the attach is serialized by an open file description lock besides, which
+ * is independent of flock and held per open like it, also between threads.
+ */
+static void ShareMemoryName(char *shm_name, size_t len, const char *name)
 {
-	unsigned int uiShareHeadSize = sizeof(SmemoryHead);
-	unsigned int uiShareFrameSize = sizeof(SmemoryFrame) * frames;
-	int fd, shmid;
-	char filename[128];
-	snprintf(filename, 128, "/tmp/.%s", name);
-	umask(0);
-	if ((fd = open(filename, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRWXG | S_IRWXO)) > 0)
+	char *p;
+	snprintf(shm_name, len, SHM_NAME_PREFIX"%s", name);
+	for(p = shm_name + 1; *p; p++)
 	{
-		close(fd);
+		if('/' == *p)
+		{
+			*p = '_';
+		}
+	}
+}
+
+/** Unlinked by the last user between our open and lock */
+static bool IsShareMemoryUnlinked(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) < 0 || 0 == st.st_nlink;
+}
+
+static int LockShareMemoryAttach(int fd, short type)
+{
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 1;
+	while(fcntl(fd, F_OFD_SETLKW, &lock) < 0)
+	{
+		if(EINTR != errno)
+		{
+			printf("lock share mem error:%s\n", strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static char *MapShareMemory(int fd, unsigned int headsize, unsigned int datasize, int flags)
+{
+	char *memory = NULL;
+	size_t maplen = headsize + datasize;
+	if(flags & MEM_FLAG_MIRROR)
+	{
+		memory = CreateMirrorMapping(fd, headsize, datasize);
+		maplen += datasize;
+	}
+	else
+	{
+		memory = (char *)mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(MAP_FAILED == memory)
+		{
+			printf("mmap share mem error:%s\n", strerror(errno));
+			memory = NULL;
+		}
+	}
+
+	if(memory && (flags & MEM_FLAG_HUGEPAGE))
+	{
+		AdviseHugePage(memory, maplen);
+	}
+	return memory;
+}
+
+static char *InitShareMemory(int fd, unsigned int headsize, unsigned int datasize, int frames, int flags, void *priv_data)
+{
+	if(ftruncate(fd, headsize + datasize) < 0)
+	{
+		printf("truncate share mem to %u error:%s\n", headsize + datasize, strerror(errno));
+		return NULL;
+	}
+
+	char *memory = MapShareMemory(fd, headsize, datasize, flags);
+	if(!memory)
+	{
+		return NULL;
+	}
+
+	SmemoryHead *pstuHead = (SmemoryHead *)memory;
+	/** Nothing left by the crashed processes is kept */
+	pstuHead->magic = 0;
+	InitMemoryParam(memory, frames, datasize, priv_data);
+	pstuHead->ucMirror = (flags & MEM_FLAG_MIRROR) ? 1 : 0;
+	pstuHead->uiDataOffset = headsize;
+	return memory;
+}
+
+/** Map an initialized segment by the layout in its head, the creator decided mirror or not */
+static char *AttachShareMemory(int fd, int flags)
+{
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(SmemoryHead))
+	{
+		printf("share mem is not initialized, size=%ld\n", (long)st.st_size);
+		return NULL;
 	}
 
-	unsigned int uiShareSize = size + uiShareHeadSize + uiShareFrameSize;
-	key_t key = ftok(filename, 'k');
-	int iFd = shmid = shmget(key, uiShareSize, IPC_CREAT | S_IRWXU | S_IRWXG | S_IRWXO);
-	if( iFd == -1 )
+	SmemoryHead *h = (SmemoryHead *)mmap(NULL, sizeof(SmemoryHead), PROT_READ, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == (void *)h)
 	{
-		printf("key=%d size=%d/%d\n", key, size, uiShareSize);
-		printf("shmget alloc share mem error:%s\n", strerror(errno));
+		printf("mmap share mem head error:%s\n", strerror(errno));
 		return NULL;
 	}
-//	assert( iFd != -1 );
-	*Fd = iFd;
+	int magic = h->magic;
+	unsigned short version = h->usVersion;
+	bool layout = h->usHeadSize == sizeof(SmemoryHead) && h->usFrameSize == sizeof(SmemoryFrame);
+	unsigned int headsize = h->uiDataOffset;
+	unsigned int datasize = h->datasize;
+	int mirror = h->ucMirror;
+	munmap(h, sizeof(SmemoryHead));
 
-	char *memory = (char *) shmat(shmid, NULL, 0);
-	if( (long)memory == -1 )
+	if(SMEMORY_MAGIC != magic || 0 == headsize || st.st_size < headsize + datasize)
+	{
+		printf("share mem head is invalid, magic=%x size=%ld\n", magic, (long)st.st_size);
+		return NULL;
+	}
+	if(SMEMORY_VERSION != version || !layout)
 	{
-		perror("shmat alloc share mem error:");
+		printf("share mem layout %u is not %u\n", version, SMEMORY_VERSION);
 		return NULL;
 	}
-	//assert( (long)memory != -1 );
-	struct shmid_ds buf;
-	shmctl(shmid, IPC_STAT, &buf);
-	if (buf.shm_nattch == 1)
+
+	flags &= ~MEM_FLAG_MIRROR;
+	return MapShareMemory(fd, headsize, datasize, flags | (mirror ? MEM_FLAG_MIRROR : 0));
+}
+
+char *CreateShareMemory(int *Fd, const char *name, int size, int frames, void *priv_data, int flags)
+{
+	unsigned int uiShareHeadSize = MirrorAlignSize(sizeof(SmemoryHead) + sizeof(SmemoryFrame) * frames);
+	unsigned int uiShareDataSize = MirrorAlignSize(size);
+	char shm_name[NAME_MAX];
+	char *memory = NULL;
+	int fd;
+
+	ShareMemoryName(shm_name, sizeof(shm_name), name);
+	umask(0);
+	while(1)
 	{
-		InitMemoryParam(memory, frames, size, priv_data);
+		fd = shm_open(shm_name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if(fd < 0)
+		{
+			printf("shm_open %s error:%s\n", shm_name, strerror(errno));
+			return NULL;
+		}
+		if(LockShareMemoryAttach(fd, F_WRLCK) < 0)
+		{
+			close(fd);
+			return NULL;
+		}
+
+		if(0 == flock(fd, LOCK_EX | LOCK_NB))
+		{
+			if(!IsShareMemoryUnlinked(fd))
+			{
+				memory = InitShareMemory(fd, uiShareHeadSize, uiShareDataSize, frames, flags, priv_data);
+				/** Others can attach after it is initialized, none of them takes the
+				 *  exclusive lock between as the attach lock is still held */
+				flock(fd, LOCK_SH);
+				LockShareMemoryAttach(fd, F_UNLCK);
+				break;
+			}
+		}
+		else if(0 == flock(fd, LOCK_SH))
+		{
+			if(!IsShareMemoryUnlinked(fd))
+			{
+				LockShareMemoryAttach(fd, F_UNLCK);
+				memory = AttachShareMemory(fd, flags);
+				break;
+			}
+		}
+		close(fd);
 	}
-	//SmemoryHead *pstuHead = (SmemoryHead *)memory;
 
+	if(!memory)
+	{
+		close(fd);
+		return NULL;
+	}
+	*Fd = fd;
 	return memory;
 }
 
@@ -60,20 +224,51 @@ void DeleteShareMemory(void *head)
 		return;
 	}
 
-	shmdt( (void*)pbuf->position.pstuHead );
-
-	struct shmid_ds buf;
-	shmctl(pbuf->iFd, IPC_STAT, &buf);
-	printf("buf.shm_nattch=%lu", buf.shm_nattch);
-	if (buf.shm_nattch == 0)
+	SmemoryHead *h = (SmemoryHead *)pbuf->position.pstuHead;
+	unsigned int headsize = h->uiDataOffset;
+	unsigned int datasize = h->datasize;
+	if(h->ucMirror)
 	{
-		shmctl(pbuf->iFd, IPC_RMID, NULL);
-		pbuf->iFd = -1;
+		DeleteMirrorMapping(pbuf->position.pstuHead, headsize, datasize);
+	}
+	else
+	{
+		munmap(pbuf->position.pstuHead, headsize + datasize);
+	}
 
-		char filename[128];
-		snprintf(filename, 128, "/tmp/.%s", pbuf->Name);
-		remove(filename);
-		printf("(%s %s) ***delete share memory fd=%d name=%s\n", pbuf->Name, pbuf->UserId, pbuf->iFd, pbuf->Name);
+	/** Fail if others still hold the shared lock, a retired one is unlinked already */
+	if(!IsShareMemoryUnlinked(pbuf->iFd) && 0 == flock(pbuf->iFd, LOCK_EX | LOCK_NB))
+	{
+		char shm_name[NAME_MAX];
+		ShareMemoryName(shm_name, sizeof(shm_name), pbuf->Name);
+		shm_unlink(shm_name);
+		printf("(%s %s) ***delete share memory fd=%d name=%s\n", pbuf->Name, pbuf->UserId, pbuf->iFd, shm_name);
 	}
+	close(pbuf->iFd);
+	pbuf->iFd = -1;
 }
 
+int RenameShareMemory(void *head, const char *name)
+{
+	BuffContext *pbuf = (BuffContext *)head;
+	char shm_name[NAME_MAX];
+	char oldpath[NAME_MAX + sizeof(SHM_DIR)];
+	char newpath[NAME_MAX + sizeof(SHM_DIR)];
+	if (pbuf->iFd < 0)
+	{
+		return -1;
+	}
+	ShareMemoryName(shm_name, sizeof(shm_name), pbuf->Name);
+	snprintf(oldpath, sizeof(oldpath), SHM_DIR"%s", shm_name);
+	ShareMemoryName(shm_name, sizeof(shm_name), name);
+	snprintf(newpath, sizeof(newpath), SHM_DIR"%s", shm_name);
+
+	/** Atomic, the name always has a segment, the one replaced is unlinked */
+	if(rename(oldpath, newpath) < 0)
+	{
+		printf("rename share mem %s to %s error:%s\n", oldpath, newpath, strerror(errno));
+		return -1;
+	}
+	printf("(%s %s) ***move share memory fd=%d to name=%s\n", pbuf->Name, pbuf->UserId, pbuf->iFd, shm_name);
+	return 0;
+}
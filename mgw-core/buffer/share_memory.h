@@ -5,8 +5,15 @@
 extern "C"{
 #endif
 
-char *CreateShareMemory(int *Fd, const char *name, int size, int frames, void *priv_data);
+/* The segment of stream buffer "name" is SHM_NAME_PREFIX"name" with '/' replaced by '_' */
+#define SHM_NAME_PREFIX		"/mgw-"
+
+/* flags: MEM_FLAG_MIRROR and MEM_FLAG_HUGEPAGE, the segment is unlinked by the last detach */
+char *CreateShareMemory(int *Fd, const char *name, int size, int frames, void *priv_data, int flags);
 void DeleteShareMemory(void *head);
+/* Move the segment to name in place of the one there, which is unlinked while
+ * still attached, so the last detach of that one does not unlink the name */
+int RenameShareMemory(void *head, const char *name);
 
 #ifdef __cplusplus
 }
@@ -6,8 +6,190 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define _printd(fmt, ...)	printf ("[%s][%d]"fmt"\n", (char *)strrchr(__FILE__, '\\')?(strrchr(__FILE__, '/') + 1):__FILE__, __LINE__, ##__VA_ARGS__)
+/** Jumps of slow readers may happen on every read, only logged if STREAM_BUFF_VERBOSE */
+#ifdef STREAM_BUFF_VERBOSE
+#define _printv(fmt, ...)	_printd(fmt, ##__VA_ARGS__)
+#else
+#define _printv(fmt, ...)
+#endif
+
+/** SmemoryFrame.seq is a per slot seqlock, writer makes it odd before covering
+ *  the slot and even again after the new frame is published. A reader is sure
+ *  the data it got is not torn if seq is the same even value before and after */
+static inline unsigned int FrameSlotSeq(SmemoryFrame *pframe)
+{
+	return __atomic_load_n(&pframe->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline bool FrameSlotValid(SmemoryFrame *pframe)
+{
+	return !(FrameSlotSeq(pframe) & 1);
+}
+
+/** The slot is published and still holds the frame of write count 'frameno' */
+static inline bool FrameSlotHolds(SmemoryFrame *pframe, unsigned int frameno)
+{
+	return FrameSlotValid(pframe) && pframe->uiFrameNo == frameno;
+}
+
+static int JumpToOldestIFrame(MemReader_t *pRead, SmemoryHead *phead, SmemoryFrame *pstuFrames);
+
+/** Release the frames pinned by zero copy read of the reader. A pin is advisory, the writer
+ *  covers a pinned slot like any other, so check the oldest frame pinned which is covered first.
+ *  Return -3 if it has been covered, the data read may be torn and the reader jumps to a key frame */
+static int UnpinReadFrames(MemReader_t *pRead, SmemoryHead *phead, SmemoryFrame *pstuFrames)
+{
+	if(pRead->iPinnedSlot < 0 && pRead->iPinnedNum <= 0)
+	{
+		return 0;
+	}
+	pRead->iPinnedSlot = -1;
+	pRead->iPinnedNum = 0;
+
+	/** Pair with the barrier of writer before covering the data */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(FrameSlotHolds(&pstuFrames[pRead->u32PinnedFrom % phead->uiMaxValidFrames], pRead->u32PinnedFrom))
+	{
+		return 0;
+	}
+	JumpToOldestIFrame(pRead, phead, pstuFrames);
+	return -3;
+}
+
+/** Not FUTEX_PRIVATE_FLAG, readers of share memory may be in other process */
+static inline int futex_wait(volatile unsigned int *uaddr, unsigned int val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline int futex_wake(volatile unsigned int *uaddr)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#define NOTIFY_REGISTRY_BUCKETS	64
+
+/** Readers of a buffer name in this process armed by ArmFrameNotify(), shared by the
+ *  handles of the name which need it. The writer skips the lock while none is armed */
+typedef struct FrameNotify
+{
+	char Name[64];
+	int iRefs;
+	volatile int iArmed;
+	pthread_mutex_t mutex;
+	MemReader_t *pReaders;
+	struct FrameNotify *pNext;
+}FrameNotify;
+
+/** Only taken when a handle looks up or lets go of its entry */
+static pthread_mutex_t g_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FrameNotify *g_notify_buckets[NOTIFY_REGISTRY_BUCKETS];
+
+/** FNV-1a */
+static unsigned int HashNotifyName(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	while(*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash % NOTIFY_REGISTRY_BUCKETS;
+}
+
+static FrameNotify *GetFrameNotify(BuffContext *pcontext)
+{
+	FrameNotify *pnotify;
+	if(pcontext->pNotify)
+	{
+		return pcontext->pNotify;
+	}
+
+	unsigned int bucket = HashNotifyName(pcontext->Name);
+	pthread_mutex_lock(&g_notify_mutex);
+	for(pnotify = g_notify_buckets[bucket]; pnotify; pnotify = pnotify->pNext)
+	{
+		if(0 == strcmp(pnotify->Name, pcontext->Name))
+		{
+			break;
+		}
+	}
+	if(!pnotify && (pnotify = (FrameNotify *)calloc(1, sizeof(FrameNotify))))
+	{
+		snprintf(pnotify->Name, sizeof(pnotify->Name), "%s", pcontext->Name);
+		pthread_mutex_init(&pnotify->mutex, NULL);
+		pnotify->pNext = g_notify_buckets[bucket];
+		g_notify_buckets[bucket] = pnotify;
+	}
+	if(pnotify)
+	{
+		pnotify->iRefs++;
+	}
+	pthread_mutex_unlock(&g_notify_mutex);
+	pcontext->pNotify = pnotify;
+	return pnotify;
+}
+
+static void PutFrameNotify(BuffContext *pcontext)
+{
+	FrameNotify *pnotify = pcontext->pNotify;
+	if(!pnotify)
+	{
+		return;
+	}
+	pcontext->pNotify = NULL;
+
+	pthread_mutex_lock(&g_notify_mutex);
+	if(--pnotify->iRefs > 0)
+	{
+		pthread_mutex_unlock(&g_notify_mutex);
+		return;
+	}
+	for(FrameNotify **link = &g_notify_buckets[HashNotifyName(pnotify->Name)]; *link; link = &(*link)->pNext)
+	{
+		if(*link == pnotify)
+		{
+			*link = pnotify->pNext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_notify_mutex);
+	pthread_mutex_destroy(&pnotify->mutex);
+	free(pnotify);
+}
+
+/** Writer only, after the write count is published */
+static void NotifyFrameReaders(BuffContext *pcontext)
+{
+	FrameNotify *pnotify = GetFrameNotify(pcontext);
+	uint64_t one = 1;
+	/** Full barrier of the write count before, pair with the one of ArmFrameNotify */
+	if(!pnotify || !__atomic_load_n(&pnotify->iArmed, __ATOMIC_SEQ_CST))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pnotify->mutex);
+	for(MemReader_t *pRead = pnotify->pReaders; pRead; pRead = pRead->pNotifyNext)
+	{
+		if(write(pRead->iNotifyFd, &one, sizeof(one)) < 0 && EAGAIN != errno)
+		{
+			_printd("(%s) notify reader failed:%s", pcontext->Name, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&pnotify->mutex);
+}
 
 struct buff_error_entry 
 {
@@ -20,6 +202,7 @@ static const struct buff_error_entry buff_error_entries[] =
     { 0,							"Succeed"                     							},
     { -1,     						"Invalid parameter"         							},
 	{ -2,							"The freame is too big" 								},
+	{ -3,							"The pinned frame is covered by writer"					},
 };
 
 int buff_strerror(int errnum, char *errbuf, size_t errbuf_size)
@@ -53,7 +236,7 @@ void InitMemoryParam(char *phead, int frames, int size, void *priv_data)
 	SmemoryHead *pstuHead = (SmemoryHead *)phead;
 	char *pstuFrames = (char *)phead + sizeof(SmemoryHead);
 	
-	if( pstuHead->magic != 0x12348756 )
+	if( pstuHead->magic != SMEMORY_MAGIC )
 	{
 		memset(pstuHead, 0, sizeof(SmemoryHead));
 	}
@@ -62,17 +245,37 @@ void InitMemoryParam(char *phead, int frames, int size, void *priv_data)
 		pstuHead->bLock = 0;
 	}
 
-	pstuHead->magic = 0x12348756;
+	pstuHead->magic = SMEMORY_MAGIC;
+	pstuHead->usVersion = SMEMORY_VERSION;
+	pstuHead->usHeadSize = sizeof(SmemoryHead);
+	pstuHead->usFrameSize = sizeof(SmemoryFrame);
 	pstuHead->datasize = size;
 	pstuHead->uiMaxValidFrames = frames;
 	pstuHead->ucReaderCount = 0;
 	pstuHead->ucWriterCount = 0;
 	pstuHead->uiWritFrameCount = 0;
+	pstuHead->uiWritePos = 0;
+	pstuHead->uiKeyFrameCount = 0;
     pstuHead->priv_data = priv_data;
 	memset(pstuFrames, 0, sizeof(SmemoryFrame)*frames );
+	int i;
+	for(i = 0; i < frames; i++)
+	{
+		((SmemoryFrame *)pstuFrames)[i].seq = 1;
+	}
 	return;
 }
 
+/** The writer process of share memory may crash without detaching */
+static bool IsWriterAlive(SmemoryHead *h)
+{
+	if(h->n32WriterPid <= 0)
+	{
+		return true;
+	}
+	return 0 == kill(h->n32WriterPid, 0) || EPERM == errno;
+}
+
 BuffContext *CreateStreamBuff(unsigned int size, const char *name, const char *id, int frames, int type, io_mode_t mode, int read_bytime, void *priv_data)
 {
 	BuffContext *pbuf = NULL;
@@ -87,10 +290,10 @@ BuffContext *CreateStreamBuff(unsigned int size, const char *name, const char *i
 		}
         source = (IO_MODE_WRITE == mode) && priv_data ? priv_data : NULL;
 		snprintf(pbuf->Name, sizeof(pbuf->Name), "%s", name);
-		if(0 == type)
-			pHead = CreateShareMemory(&pbuf->iFd, pbuf->Name, size, frames, source);
+		if(MEM_SHARED == (type & MEM_TYPE_MASK))
+			pHead = CreateShareMemory(&pbuf->iFd, pbuf->Name, size, frames, source, type & ~MEM_TYPE_MASK);
 		else
-			pHead = CreateMallocMemory(&pbuf->iFd, pbuf->Name, size, frames, mode, source);
+			pHead = CreateMallocMemory(&pbuf->iFd, pbuf->Name, size, frames, mode, source, type & ~MEM_TYPE_MASK);
 		
 		if(!pHead)
 		{
@@ -100,8 +303,15 @@ BuffContext *CreateStreamBuff(unsigned int size, const char *name, const char *i
 		//SmemoryHead *pstuHead = (SmemoryHead *)pHead;
 		pbuf->position.pstuHead = pHead;
 		pbuf->position.pstuFrames = pbuf->position.pstuHead + sizeof(SmemoryHead);
-		pbuf->position.pstuData = pbuf->position.pstuFrames + (sizeof(SmemoryFrame)*frames);
-		pbuf->type = type;
+		/** Attached to an existing buffer, its frames may differ from the ones asked for */
+		pbuf->position.pstuData = pbuf->position.pstuFrames +
+						(sizeof(SmemoryFrame) * ((SmemoryHead *)pHead)->uiMaxValidFrames);
+		if(((SmemoryHead *)pHead)->uiDataOffset)
+		{
+			pbuf->position.pstuData = pbuf->position.pstuHead + ((SmemoryHead *)pHead)->uiDataOffset;
+		}
+		pbuf->type = type & MEM_TYPE_MASK;
+		pbuf->flags = type & ~MEM_TYPE_MASK;
 		
 		pbuf->priv_data = priv_data;
 		snprintf(pbuf->UserId, sizeof(pbuf->UserId), "%s", id);
@@ -109,22 +319,35 @@ BuffContext *CreateStreamBuff(unsigned int size, const char *name, const char *i
 		SmemoryHead *h = (SmemoryHead *)pbuf->position.pstuHead;
 		if(IO_MODE_READ == mode)
 		{
-			h->ucReaderCount++;
+			__sync_add_and_fetch(&h->ucReaderCount, 1);
 			MemReader_t *read = (MemReader_t *)calloc(1, sizeof(MemReader_t));
 			pbuf->pReadpara = (char *)read;
 			pbuf->pWritepara = NULL;
 			read->breIframe = true;
 			read->bReadByTime = read_bytime;
+			read->iPinnedSlot = -1;
+			read->u32IdleWritCount = UINT_MAX;
+			read->iNotifyFd = -1;
 		}
 		else
 		{
-			if(h->ucWriterCount > 0)
+			if(h->ucWriterCount > 0 && !IsWriterAlive(h))
+			{
+				_printd("the writer %d of buff %s is gone", h->n32WriterPid, name);
+				h->ucWriterCount = 0;
+			}
+			/** Writers may attach from many threads at the same time */
+			if(!__sync_bool_compare_and_swap(&h->ucWriterCount, 0, 1))
 			{
-				free(pbuf);
 				_printd("the buff %s has a writer", name);
+				if(MEM_SHARED == pbuf->type)
+					DeleteShareMemory((void *)pbuf);
+				else
+					DeleteMallocMemory(pbuf->Name, pHead);
+				free(pbuf);
 				return NULL;
 			}
-			h->ucWriterCount++;
+			h->n32WriterPid = getpid();
 			pbuf->pReadpara = NULL;
 			pbuf->pWritepara = NULL;
 		}
@@ -138,41 +361,37 @@ int DeleteStreamBuff(BuffContext *pbuf)
 {
 	int ret = 0;
 	SmemoryHead *h = (SmemoryHead *)pbuf->position.pstuHead;
+	unsigned char readers, writers;
+	/** Release the pin before the memory may be freed */
+	if(pbuf->pReadpara)
+	{
+		DisarmFrameNotify(pbuf);
+		UnpinReadFrames((MemReader_t *)pbuf->pReadpara, h, (SmemoryFrame *)pbuf->position.pstuFrames);
+		free(pbuf->pReadpara);
+	}
+	PutFrameNotify(pbuf);
+
 	if(IO_MODE_WRITE == pbuf->mode)
 	{	
-		h->ucWriterCount--;
+		h->n32WriterPid = 0;
+		writers = __sync_sub_and_fetch(&h->ucWriterCount, 1);
+		readers = h->ucReaderCount;
 	}
 	else
 	{
-		h->ucReaderCount--;
+		readers = __sync_sub_and_fetch(&h->ucReaderCount, 1);
+		writers = h->ucWriterCount;
 	}
-	
-	if(0 == h->ucReaderCount && 0 == h->ucWriterCount)
+	_printd("There is still %d reader, %d write, name=%s, userid=%s", readers, writers, pbuf->Name, pbuf->UserId);
+
+	/** The last handle of share memory or heap memory frees it */
+	if(0 == pbuf->type)
 	{
-		_printd("The ucReaderCount =%d ucWriterCount=%d,memory free ok, name=%s, userid=%s", h->ucReaderCount,h->ucWriterCount, pbuf->Name, pbuf->UserId);
-		if(0 == pbuf->type)
-		{
-			DeleteShareMemory((void *)pbuf);
-			ret = 0;
-		}
-		else
-		{
-			ret = DeleteMallocMemory(pbuf->Name);
-		}
+		DeleteShareMemory((void *)pbuf);
 	}
 	else
 	{
-		_printd("There is still %d reader, %d write, name=%s, userid=%s", h->ucReaderCount,h->ucWriterCount, pbuf->Name, pbuf->UserId);
-		if(0 == pbuf->type)
-		{
-			/** Need to detach to aviod it fill out of process */
-			DeleteShareMemory((void *)pbuf);
-		}
-//		ret = -1; 
-	}
-	if(pbuf->pReadpara)
-	{
-		free(pbuf->pReadpara);
+		ret = DeleteMallocMemory(pbuf->Name, pbuf->position.pstuHead);
 	}
 	if(pbuf->pWritepara)
 	{
@@ -183,38 +402,161 @@ int DeleteStreamBuff(BuffContext *pbuf)
 	return ret;
 }
 
+/** Move the handle to the buffer of 'pnew', 'pnew' is then the handle of the old buffer.
+ *  The reader state and the notify entry of the handle are kept */
+static void SwapStreamBuff(BuffContext *pcontext, BuffContext *pnew)
+{
+	BuffContext old = *pcontext;
+	char *pReadpara = pnew->pReadpara;
+	struct FrameNotify *pNotify = pnew->pNotify;
+	*pcontext = *pnew;
+	pcontext->pReadpara = old.pReadpara;
+	pcontext->pNotify = old.pNotify;
+	*pnew = old;
+	pnew->pReadpara = pReadpara;
+	pnew->pNotify = pNotify;
+}
+
+BuffContext *PrepareResizeStreamBuff(BuffContext *pcontext, unsigned int size, int frames)
+{
+	if(!pcontext || IO_MODE_WRITE != pcontext->mode || 0 == size || frames <= 0)
+	{
+		_printd("Invalid parameter");
+		return NULL;
+	}
+	char tmpname[sizeof(pcontext->Name)];
+
+	/** Create the new buffer under a temporary name, it takes the name over only once committed.
+	 *  The name never goes without the live buffer, and nothing changes if the resize fails */
+	snprintf(tmpname, sizeof(tmpname), "%.40s~resize%d", pcontext->Name, (int)getpid());
+	BuffContext *pnew = CreateStreamBuff(size, tmpname, pcontext->UserId, frames,
+							pcontext->type | pcontext->flags, IO_MODE_WRITE, 0, pcontext->priv_data);
+	if(!pnew)
+	{
+		_printd("(%s %s) resize to %u bytes %d frames failed", pcontext->Name, pcontext->UserId, size, frames);
+	}
+	return pnew;
+}
+
+int CommitResizeStreamBuff(BuffContext *pcontext, BuffContext *pnew)
+{
+	if(!pcontext || !pnew || IO_MODE_WRITE != pcontext->mode)
+	{
+		_printd("Invalid parameter");
+		return -1;
+	}
+	SmemoryHead *h = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryHead *hnew = (SmemoryHead *)pnew->position.pstuHead;
+	int ret;
+
+	if(MEM_SHARED == pnew->type)
+		ret = RenameShareMemory((void *)pnew, pcontext->Name);
+	else
+		ret = RenameMallocMemory(pnew->Name, pnew->position.pstuHead, pcontext->Name);
+	if(ret < 0)
+	{
+		_printd("(%s %s) resize failed to take the name over", pcontext->Name, pcontext->UserId);
+		return -1;
+	}
+	snprintf(pnew->Name, sizeof(pnew->Name), "%s", pcontext->Name);
+	_printd("(%s %s) resize from %u bytes %u frames to %u bytes %u frames", pcontext->Name, pcontext->UserId,
+				h->datasize, h->uiMaxValidFrames, hnew->datasize, hnew->uiMaxValidFrames);
+
+	/** Readers move to the new one after reading all frames of the old one */
+	__atomic_store_n(&h->ucRetired, 1, __ATOMIC_RELEASE);
+	futex_wake(&h->uiWritFrameCount);
+	NotifyFrameReaders(pcontext);
+	SwapStreamBuff(pcontext, pnew);
+	return 0;
+}
+
+int ResizeStreamBuff(BuffContext *pcontext, unsigned int size, int frames)
+{
+	BuffContext *pnew = PrepareResizeStreamBuff(pcontext, size, frames);
+	if(!pnew)
+	{
+		return -1;
+	}
+	int ret = CommitResizeStreamBuff(pcontext, pnew);
+	DeleteStreamBuff(pnew);
+	return ret;
+}
+
+/** The writer has moved to a new buffer of the same name, follow it */
+static int ReattachStreamBuff(BuffContext *pcontext)
+{
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	BuffContext *pnew = CreateStreamBuff(phead->datasize, pcontext->Name, pcontext->UserId, phead->uiMaxValidFrames,
+							pcontext->type | pcontext->flags, IO_MODE_READ, pRead->bReadByTime, pcontext->priv_data);
+	if(!pnew)
+	{
+		_printd("(%s %s) attach the new buffer failed", pcontext->Name, pcontext->UserId);
+		return -1;
+	}
+
+	DisarmFrameNotify(pcontext);
+	UnpinReadFrames(pRead, phead, pstuFrames);
+	SwapStreamBuff(pcontext, pnew);
+	DeleteStreamBuff(pnew);
+
+	/** Nothing is lost, the new buffer starts from the frame after the last one of old */
+	pRead->u32RdFrameCount = 0;
+	pRead->breIframe = false;
+	pRead->u32IdleWritCount = UINT_MAX;
+	_printd("(%s %s) reattached to the resized buffer", pcontext->Name, pcontext->UserId);
+	return 0;
+}
+
 
 char *SearchOneWriteBuff(BuffContext *pcontext)
 {
 	return NULL;
 }
 
-int CheckBuffDataCover(unsigned int pos_s, unsigned int pos_e, int next, SmemoryFrame *pstuFrames, unsigned int uiMaxValidFrames)
+static inline bool PositionInRange(unsigned int pos, unsigned int pos_s, unsigned int pos_e)
+{
+	if(pos_s < pos_e)
+	{
+		return pos_s <= pos && pos < pos_e;
+	}
+	return pos_s <= pos || pos < pos_e;
+}
+
+/** Count slots from 'w' which will be covered by data in [pos_s, pos_e),
+ *  slot 'w' itself is always covered because its frame info will be reused */
+static int CheckBuffDataCover(unsigned int pos_s, unsigned int pos_e, int w, SmemoryFrame *pstuFrames, unsigned int uiMaxValidFrames)
 {
 	int i;
-	unsigned int npos_s = 0;
-	for(i = 0; i < uiMaxValidFrames-2; i++)
+	for(i = 1; i < uiMaxValidFrames; i++)
 	{
-		npos_s = pstuFrames[next+i].position;
-		if(pos_s < pos_e)
+		SmemoryFrame *pframe = &pstuFrames[(w+i) % uiMaxValidFrames];
+		if(FrameSlotValid(pframe) &&
+			!PositionInRange(pframe->position, pos_s, pos_e))
 		{
-			if(pos_s <= npos_s && npos_s <= pos_e)
-			{
-				pstuFrames[next+i].ucValidFlag = 0;
-				continue;
-			}
+			break;
 		}
-		else
+	}
+	return i;
+}
+
+/** Invalidate the covered slots, a slot pinned by reader is taken over as well,
+ *  the reader finds seq changed when it releases and jumps. A slow reader never blocks the writer */
+static void ReclaimCoveredFrames(int w, int count, SmemoryFrame *pstuFrames, unsigned int uiMaxValidFrames)
+{
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		SmemoryFrame *pframe = &pstuFrames[(w+i) % uiMaxValidFrames];
+		unsigned int seq = pframe->seq;
+		if(!(seq & 1))
 		{
-			if(pos_s <= npos_s || npos_s <= pos_e)
-			{
-				pstuFrames[next+i].ucValidFlag = 0;
-				continue;
-			}
+			__atomic_store_n(&pframe->seq, seq + 1, __ATOMIC_RELAXED);
 		}
-		break;
 	}
-	return 0;
+	/** Keep the data writes after the invalidation */
+	__sync_synchronize();
 }
 
 int PutOneFrameToBuff(BuffContext *pcontext, uint8_t *pframe, uint32_t framelen,
@@ -230,7 +572,6 @@ int PutOneFrameToBuff(BuffContext *pcontext, uint8_t *pframe, uint32_t framelen,
 	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
 	char *pstart_addr = pcontext->position.pstuData;
 	int w = phead->uiWritFrameCount % phead->uiMaxValidFrames;
-	int wnext = (w+1) % phead->uiMaxValidFrames;
 	unsigned int pos_s;
 	unsigned int pos_e;
 	if(phead->datasize/2 <= framelen)
@@ -239,83 +580,93 @@ int PutOneFrameToBuff(BuffContext *pcontext, uint8_t *pframe, uint32_t framelen,
 		return -2;
 	}
 
-	unsigned int position = pstuFrames[w].position;
-	if(position + framelen <= phead->datasize)
+	unsigned int position = phead->uiWritePos;
+	pos_s = position;
+	pos_e = (position + framelen) % phead->datasize;
+
+	int covered = CheckBuffDataCover(pos_s, pos_e, w, pstuFrames, phead->uiMaxValidFrames);
+	ReclaimCoveredFrames(w, covered, pstuFrames, phead->uiMaxValidFrames);
+
+	if(phead->ucMirror || position + framelen <= phead->datasize)
 	{
-		pos_s = position;
 		memcpy(pstart_addr + position, pframe, framelen);
-		position += framelen;
-		pos_e = position;
-		if(position == phead->datasize)
-		{
-			position = 0;
-		}
 	}
 	else
 	{
 		int left = phead->datasize - position;
 		int len = framelen - left;
-		pos_s = position;
 		memcpy(pstart_addr + position, pframe, left);
 		memcpy(pstart_addr, pframe + left, len);
-		position = len;
-		pos_e = position;
 	}
 
+	pstuFrames[w].position = pos_s;
 	pstuFrames[w].len = framelen;
 	pstuFrames[w].stuFrameInfo.frametype = frametype;
 	pstuFrames[w].stuFrameInfo.timestamp = timestamp;
     pstuFrames[w].stuFrameInfo.priority  = priority;
-	pstuFrames[w].ucValidFlag = 1;
-	
-//	SearchOneWriteBuff(BuffContext *pcontext);
-	CheckBuffDataCover(pos_s, pos_e, wnext, pstuFrames, phead->uiMaxValidFrames);
+	pstuFrames[w].uiFrameNo = phead->uiWritFrameCount;
+	/** Publish the frame, pair with the acquire of readers */
+	__atomic_store_n(&pstuFrames[w].seq, pstuFrames[w].seq + 1, __ATOMIC_RELEASE);
+
+	if(FRAME_I == frametype || FRAME_IDR == frametype)
+	{
+		SKeyFrameIndex *pkey = &phead->stuKeyFrames[phead->uiKeyFrameCount % KEY_FRAME_INDEX_SIZE];
+		pkey->uiFrameNo = phead->uiWritFrameCount;
+		pkey->timestamp = timestamp;
+		__atomic_store_n(&phead->uiKeyFrameCount, phead->uiKeyFrameCount + 1, __ATOMIC_RELEASE);
+	}
 
-//	pstuFrames[wnext].ucValidFlag = 0;
-	pstuFrames[wnext].position = position;
-	phead->uiWritFrameCount++;
+	phead->uiWritePos = pos_e;
+	__sync_add_and_fetch(&phead->uiWritFrameCount, 1);
+	/** Always wake, a waiter may be a read only tap of another process that can't be counted */
+	futex_wake(&phead->uiWritFrameCount);
+	NotifyFrameReaders(pcontext);
 
 	return 0;
 }
 
-/**< 如果buffer能力过小，可能需要很多次查询，很久才能等到I帧 */
+/** Get the frame count of the k-th key frame in the index, fail if it has been covered */
+static bool GetIndexedKeyFrame(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned int k, unsigned int *pframeno)
+{
+	unsigned int frameno = phead->stuKeyFrames[k % KEY_FRAME_INDEX_SIZE].uiFrameNo;
+	SmemoryFrame *pframe = &pstuFrames[frameno % phead->uiMaxValidFrames];
+	/** The entry may be rewritten meanwhile, the slot tells whether it is still a key frame */
+	if(!FrameSlotHolds(pframe, frameno) ||
+		(pframe->stuFrameInfo.frametype != FRAME_I && pframe->stuFrameInfo.frametype != FRAME_IDR))
+	{
+		return false;
+	}
+	*pframeno = frameno;
+	return true;
+}
+
+/**< 从关键帧索引里找最老的I帧，索引外的帧已经被覆盖，最多查询 KEY_FRAME_INDEX_SIZE 次 */
 static int JumpToOldestIFrame(MemReader_t *pRead, SmemoryHead *phead, SmemoryFrame *pstuFrames)
 {
-	if(phead->uiWritFrameCount == 0)
+	unsigned int kcount = __atomic_load_n(&phead->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int wcount = phead->uiWritFrameCount;
+	if(wcount == 0)
 	{
 		pRead->u32RdFrameCount = 0;
 		return 0;
 	}
-	int iTempPos = phead->uiWritFrameCount;
 
-	int pos = iTempPos;
-	int i;
-	for(i=0; i < phead->uiMaxValidFrames; i++)
+	unsigned int k = kcount > KEY_FRAME_INDEX_SIZE ? kcount - KEY_FRAME_INDEX_SIZE : 0;
+	for(; k != kcount; k++)
 	{
-		pos = (iTempPos+i) % phead->uiMaxValidFrames;
-		// if (pstuFrames[pos].stuFrameInfo.frametype == FRAME_I)
-		// 	_printd("key frame, valid(%d)", pstuFrames[pos].ucValidFlag);
-
-		if(pstuFrames[pos].ucValidFlag && pstuFrames[pos].stuFrameInfo.frametype == FRAME_I)
+		unsigned int frameno;
+		if(!GetIndexedKeyFrame(phead, pstuFrames, k, &frameno))
 		{
-            /**< total write frames less than queue capacity*/
-			int iNewPos = (iTempPos+i) - phead->uiMaxValidFrames;
-			if(iNewPos < 0)
-			{
-				iNewPos = 0;
-			}
-
-			if((unsigned int)iNewPos < pRead->u32RdFrameCount)
-			{
-				if(pRead->u32RdFrameCount < (unsigned int)iTempPos)
-				{
-					continue;
-				}
-			}
-			pRead->u32RdFrameCount = iNewPos;
-			_printd("JumpToOldestIFrame is ok, droped frame:%d", i);
-			return 0;
+			continue;
+		}
+		/** Do not go back while the reader is still behind the writer */
+		if((int)(frameno - pRead->u32RdFrameCount) < 0 && (int)(wcount - pRead->u32RdFrameCount) > 0)
+		{
+			continue;
 		}
+		_printv("JumpToOldestIFrame is ok, droped frame:%d", (int)(frameno - pRead->u32RdFrameCount));
+		pRead->u32RdFrameCount = frameno;
+		return 0;
 	}
 	//_printd("Jump to oldest key frame but not found! write pos(%u)", phead->uiWritFrameCount);
 	return -1;
@@ -324,113 +675,346 @@ static int JumpToOldestIFrame(MemReader_t *pRead, SmemoryHead *phead, SmemoryFra
 /**< 只适用于新加进来的消费者跳到最新的I帧，其他情况跳到最新的I帧会出现回退情况！ */
 static int JumpTonewestIFrame(MemReader_t *pRead, SmemoryHead *phead, SmemoryFrame *pstuFrames)
 {
+	unsigned int kcount = __atomic_load_n(&phead->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int frameno;
 	if(phead->uiWritFrameCount == 0)
 	{
 		pRead->u32RdFrameCount = 0;
 		return 0;
 	}
-	int iTempPos = phead->uiWritFrameCount;
-	int diff = phead->uiWritFrameCount - pRead->u32RdFrameCount;
-	int min = diff > 0?pRead->u32RdFrameCount:phead->uiWritFrameCount-phead->uiMaxValidFrames;
-	int pos = iTempPos;
-	int i;
-	for(i=iTempPos-1; i > min && i >= 0; i--)
+
+	if(kcount == 0 || !GetIndexedKeyFrame(phead, pstuFrames, kcount - 1, &frameno))
 	{
-		pos = i % phead->uiMaxValidFrames;
-		if(pstuFrames[pos].ucValidFlag && pstuFrames[pos].stuFrameInfo.frametype == FRAME_I)
-		{
-			int iNewPos = i;
-			if((unsigned int)iNewPos >= pRead->u32RdFrameCount)
-			{
-				pRead->u32RdFrameCount = iNewPos;
-				_printd("JumpTonewestIFrame is ok");
-				return 0;
-			}
-			else
-			{
-				break;
-			}
-		}
+		return -1;
 	}
-	return -1;
+	if((int)(frameno - pRead->u32RdFrameCount) < 0)
+	{
+		return -1;
+	}
+	pRead->u32RdFrameCount = frameno;
+	_printv("JumpTonewestIFrame is ok");
+	return 0;
+}
+
+/** Time from the frame of read count to the newest frame */
+static unsigned long long ReadFrameLag(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned int rcount)
+{
+	unsigned int wcount = __atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	if((int)(wcount - 1 - rcount) <= 0)
+	{
+		return 0;
+	}
+	unsigned long long rtime = pstuFrames[rcount % phead->uiMaxValidFrames].stuFrameInfo.timestamp;
+	unsigned long long wtime = pstuFrames[(wcount - 1) % phead->uiMaxValidFrames].stuFrameInfo.timestamp;
+	return wtime > rtime ? wtime - rtime : 0;
 }
 
 unsigned long long CheckBuffDuration(BuffContext *pcontext)
 {
-	if(!pcontext)
+	if(!pcontext || !pcontext->pReadpara)
 	{
 		_printd("Invalid parameter");
 		return 0;
 	}
 	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
 	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
-	// char *pstart_addr = pcontext->position.pstuData;
 	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
-	int wcount = phead->uiWritFrameCount - 1;
-	if(wcount <= pRead->u32RdFrameCount)
-	{
-		return 0;
-	}
-	int rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
-	int w = wcount % phead->uiMaxValidFrames;
-	return pstuFrames[w].stuFrameInfo.timestamp - pstuFrames[rp].stuFrameInfo.timestamp;
+	return ReadFrameLag(phead, pstuFrames, pRead->u32RdFrameCount);
 }
 
-int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe,uint32_t maxframelen,
-                        int64_t *timestamp, frame_t *frametype, int *priority)
+void SetBuffLagPolicy(BuffContext *pcontext, const SBuffLagPolicy *policy)
 {
-	/** 两个原则：1.读得太慢了，需要往前赶，跳到最老的I帧读取；
-	 * 			 2.读得太快了，需要等数据写进来，跳到最新的I帧去读取？？ 我认为应该原地等候，因为跳到最新的I帧相当于后退了
-	 */
-
-	if(!pcontext || !pframe)
+	if(!pcontext || !pcontext->pReadpara)
 	{
-		_printd("Invalid parameter, pcontext(%p), pframe(%p)", pcontext, pframe);
-		return -1;
+		_printd("Invalid parameter");
+		return;
 	}
-	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
-	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
-	char *pstart_addr = pcontext->position.pstuData;
 	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
-	int rp = 0;//pRead->u32RdFrameCount % phead->uiMaxValidFrames;
-	
-	/** 已经读到当前写的位置，读得太快了！ */
-	if(phead->uiWritFrameCount == pRead->u32RdFrameCount)
+	if(policy)
 	{
-		return FRAME_CONSUME_FAST;
+		pRead->stuLag = *policy;
 	}
-	
-	/** 读的总数已经超过写的总数了，读得太快了，需要跳到最老的I帧？？？。不可能执行到的情况 unlikely */
-	if(phead->uiWritFrameCount < pRead->u32RdFrameCount)
+	else
 	{
-		_printd("(%s %s)  w=%d < r=%d so need jump count=%d\n", pcontext->Name, pcontext->UserId,
-                        phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
-		JumpToOldestIFrame(pRead, phead, pstuFrames);
-		return FRAME_CONSUME_FAST;
+		memset(&pRead->stuLag, 0, sizeof(pRead->stuLag));
 	}
+	pRead->bSkipGop = false;
+}
 
-	/** 写的总数 - 读的总数 > buffer最大缓存的数量，读得太慢了，写的数据已经覆盖了还没有读的数据， 要跳到最老的I帧？？？*/
-	if((phead->uiWritFrameCount - pRead->u32RdFrameCount) > phead->uiMaxValidFrames)
+/** First of [lo, hi) which is not covered yet, covered frames are always the oldest ones */
+static unsigned int FirstValidFrame(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned int lo, unsigned int hi)
+{
+	while(lo != hi)
 	{
-		/*if(!pRead->u32RdFrameCount)
+		unsigned int mid = lo + (hi - lo) / 2;
+		if(FrameSlotHolds(&pstuFrames[mid % phead->uiMaxValidFrames], mid))
 		{
-			_printd("(%s %s) need jump w=%d r=%d count=%d\n", pcontext->Name, pcontext->UserId,
-                        phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
-		}*/
-		if(JumpToOldestIFrame(pRead, phead, pstuFrames) == -1)
+			hi = mid;
+		}
+		else
 		{
-			return FRAME_CONSUME_SLOW;
+			lo = mid + 1;
 		}
 	}
+	return lo;
+}
 
-	/** 第一帧需要是 I 帧，跳到最新的I帧 */
-	if(pRead->breIframe)
+/** Binary search the key frame index, the last key frame not later than timestamp or the oldest one */
+static int SeekKeyFrame(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned long long timestamp, unsigned int *pframeno)
+{
+	unsigned int kcount = __atomic_load_n(&phead->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int lo = kcount > KEY_FRAME_INDEX_SIZE ? kcount - KEY_FRAME_INDEX_SIZE : 0;
+	unsigned int hi = kcount;
+	unsigned int frameno;
+
+	/** Skip the key frames covered */
+	while(lo != hi)
 	{
-		if(phead->uiWritFrameCount >= 5)
+		unsigned int mid = lo + (hi - lo) / 2;
+		if(GetIndexedKeyFrame(phead, pstuFrames, mid, &frameno))
 		{
-			pRead->u32RdFrameCount = phead->uiWritFrameCount - 5;
+			hi = mid;
 		}
-		if(JumpTonewestIFrame(pRead, phead, pstuFrames) < 0)
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	hi = kcount;
+	/** Find the first key frame later than timestamp, the one before it is the key frame sought */
+	unsigned int first = lo;
+	while(lo != hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if(phead->stuKeyFrames[mid % KEY_FRAME_INDEX_SIZE].timestamp <= timestamp)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	for(unsigned int k = lo > first ? lo - 1 : first; k != kcount; k++)
+	{
+		if(GetIndexedKeyFrame(phead, pstuFrames, k, pframeno))
+		{
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/** Binary search the slot ring, the first frame not earlier than timestamp */
+static int SeekFrame(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned long long timestamp, unsigned int *pframeno)
+{
+	unsigned int wcount = __atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int lo = wcount > phead->uiMaxValidFrames ? wcount - phead->uiMaxValidFrames : 0;
+	unsigned int hi = wcount;
+
+	lo = FirstValidFrame(phead, pstuFrames, lo, hi);
+	if(lo == hi)
+	{
+		return -1;
+	}
+	while(lo != hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		if(pstuFrames[mid % phead->uiMaxValidFrames].stuFrameInfo.timestamp < timestamp)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	/** All frames are earlier, wait for the next one */
+	*pframeno = lo;
+	return 0;
+}
+
+int64_t SeekStreamBuff(BuffContext *pcontext, int64_t timestamp, int whence, bool keyframe)
+{
+	if(!pcontext || !pcontext->pReadpara || (SEEK_SET != whence && SEEK_END != whence))
+	{
+		_printd("Invalid parameter");
+		return -1;
+	}
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	unsigned int wcount = __atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int frameno;
+
+	if(0 == wcount)
+	{
+		return -1;
+	}
+	if(SEEK_END == whence)
+	{
+		timestamp += pstuFrames[(wcount - 1) % phead->uiMaxValidFrames].stuFrameInfo.timestamp;
+	}
+	if(timestamp < 0)
+	{
+		timestamp = 0;
+	}
+	if((keyframe ? SeekKeyFrame(phead, pstuFrames, timestamp, &frameno) :
+					SeekFrame(phead, pstuFrames, timestamp, &frameno)) < 0)
+	{
+		return -1;
+	}
+
+	pRead->u32RdFrameCount = frameno;
+	pRead->breIframe = false;
+	pRead->bSkipGop = false;
+	pRead->iCarryPriority = 0;
+	pRead->u32IdleWritCount = UINT_MAX;
+	_printd("(%s %s) seek to %lld, r=%u w=%u", pcontext->Name, pcontext->UserId, (long long)timestamp, frameno, wcount);
+	if(frameno == wcount)
+	{
+		return timestamp;
+	}
+	return pstuFrames[frameno % phead->uiMaxValidFrames].stuFrameInfo.timestamp;
+}
+
+/** Highest priority of key frames in [from, to), a key frame of new stream headers must not be lost by a jump */
+static int JumpedKeyFramePriority(SmemoryHead *phead, SmemoryFrame *pstuFrames, unsigned int from, unsigned int to)
+{
+	unsigned int kcount = __atomic_load_n(&phead->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int k = kcount > KEY_FRAME_INDEX_SIZE ? kcount - KEY_FRAME_INDEX_SIZE : 0;
+	int priority = 0;
+	for(; k != kcount; k++)
+	{
+		unsigned int frameno;
+		if(!GetIndexedKeyFrame(phead, pstuFrames, k, &frameno) ||
+			(int)(frameno - from) < 0 || (int)(frameno - to) >= 0)
+		{
+			continue;
+		}
+		if(pstuFrames[frameno % phead->uiMaxValidFrames].stuFrameInfo.priority > priority)
+		{
+			priority = pstuFrames[frameno % phead->uiMaxValidFrames].stuFrameInfo.priority;
+		}
+	}
+	return priority;
+}
+
+/** Shed frames from the read frame by the lag policy, return 1 if '*prp' is left to read */
+static int ShedLaggingFrames(BuffContext *pcontext, unsigned int wcount, int *prp)
+{
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	SBuffLagPolicy *lag = &pRead->stuLag;
+	unsigned long long lagms = ReadFrameLag(phead, pstuFrames, pRead->u32RdFrameCount) / 1000;
+	int rp = *prp;
+
+	if(lag->uiJumpNewestMs && lagms >= lag->uiJumpNewestMs)
+	{
+		unsigned int rcount = pRead->u32RdFrameCount;
+		if(JumpTonewestIFrame(pRead, phead, pstuFrames) == 0 && pRead->u32RdFrameCount != rcount)
+		{
+			_printd("(%s %s) lag %llu ms, jump to the newest iframe, droped frame:%d", pcontext->Name, pcontext->UserId,
+					lagms, (int)(pRead->u32RdFrameCount - rcount));
+			pRead->iCarryPriority = JumpedKeyFramePriority(phead, pstuFrames, rcount, pRead->u32RdFrameCount);
+			pRead->bSkipGop = false;
+			rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
+			if(!FrameSlotHolds(&pstuFrames[rp], pRead->u32RdFrameCount))
+			{
+				return FRAME_CONSUME_SLOW;
+			}
+			*prp = rp;
+			return 1;
+		}
+	}
+	if(lag->uiSkipGopMs && lagms >= lag->uiSkipGopMs && !pRead->bSkipGop)
+	{
+		_printd("(%s %s) lag %llu ms, skip video to the next iframe", pcontext->Name, pcontext->UserId, lagms);
+		pRead->bSkipGop = true;
+	}
+
+	bool dropnonref = lag->uiDropNonRefMs && lagms >= lag->uiDropNonRefMs;
+	while(pRead->bSkipGop || dropnonref)
+	{
+		frame_t frametype = pstuFrames[rp].stuFrameInfo.frametype;
+		if(FRAME_I == frametype || FRAME_IDR == frametype)
+		{
+			pRead->bSkipGop = false;
+			break;
+		}
+		if(FRAME_AAC == frametype || (!pRead->bSkipGop && FRAME_B != frametype))
+		{
+			break;
+		}
+		if(++pRead->u32RdFrameCount == wcount)
+		{
+			return FRAME_CONSUME_FAST;
+		}
+		rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
+		if(!FrameSlotHolds(&pstuFrames[rp], pRead->u32RdFrameCount))
+		{
+			return FRAME_CONSUME_SLOW;
+		}
+	}
+	*prp = rp;
+	return 1;
+}
+
+/** Find the slot of next frame to read, return 1 if found and the slot is set to '*prp' */
+static int LocateReadFrame(BuffContext *pcontext, int64_t *timestamp, int *prp)
+{
+	/** 两个原则：1.读得太慢了，需要往前赶，跳到最老的I帧读取；
+	 * 			 2.读得太快了，需要等数据写进来，跳到最新的I帧去读取？？ 我认为应该原地等候，因为跳到最新的I帧相当于后退了
+	 */
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	int rp = 0;//pRead->u32RdFrameCount % phead->uiMaxValidFrames;
+	/** Frames before the count are published, pair with the write count increasing */
+	unsigned int wcount = __atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	
+	/** 已经读到当前写的位置，读得太快了！ */
+	if(wcount == pRead->u32RdFrameCount)
+	{
+		/** All frames read, and no more will come if the buffer is retired */
+		if(__atomic_load_n(&phead->ucRetired, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE) == wcount)
+		{
+			ReattachStreamBuff(pcontext);
+		}
+		return FRAME_CONSUME_FAST;
+	}
+	
+	/** 读的总数已经超过写的总数了，读得太快了，需要跳到最老的I帧？？？。不可能执行到的情况 unlikely */
+	if(wcount < pRead->u32RdFrameCount)
+	{
+		_printd("(%s %s)  w=%d < r=%d so need jump count=%d\n", pcontext->Name, pcontext->UserId,
+                        phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
+		JumpToOldestIFrame(pRead, phead, pstuFrames);
+		return FRAME_CONSUME_FAST;
+	}
+
+	/** 写的总数 - 读的总数 > buffer最大缓存的数量，读得太慢了，写的数据已经覆盖了还没有读的数据， 要跳到最老的I帧？？？*/
+	if((wcount - pRead->u32RdFrameCount) > phead->uiMaxValidFrames)
+	{
+		/*if(!pRead->u32RdFrameCount)
+		{
+			_printd("(%s %s) need jump w=%d r=%d count=%d\n", pcontext->Name, pcontext->UserId,
+                        phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
+		}*/
+		if(JumpToOldestIFrame(pRead, phead, pstuFrames) == -1)
+		{
+			return FRAME_CONSUME_SLOW;
+		}
+	}
+
+	/** 第一帧需要是 I 帧，跳到最新的I帧 */
+	if(pRead->breIframe)
+	{
+		/** Start from the newest GOP which is still in buffer */
+		pRead->u32RdFrameCount = wcount > phead->uiMaxValidFrames ? wcount - phead->uiMaxValidFrames : 0;
+		if(JumpTonewestIFrame(pRead, phead, pstuFrames) < 0)
 		{
 			return 0;
 		}
@@ -439,9 +1023,9 @@ int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe,uint32_t maxfram
 	
 	/** 当前需要读的帧已经被覆盖了，跳到最老的I帧？？？ */
 	rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
-	if(pstuFrames[rp].ucValidFlag == 0)
+	if(!FrameSlotHolds(&pstuFrames[rp], pRead->u32RdFrameCount))
 	{
-		_printd("(%s %s)  pos=%d invalid frame ,jump to oldest iframe r=%d w=%d\n",
+		_printv("(%s %s)  pos=%d invalid frame ,jump to oldest iframe r=%d w=%d\n",
 				pcontext->Name, pcontext->UserId, rp, pRead->u32RdFrameCount, phead->uiWritFrameCount);
 		if(JumpToOldestIFrame(pRead, phead, pstuFrames) == -1)
 		{
@@ -450,13 +1034,16 @@ int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe,uint32_t maxfram
 		rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
 	}
 
-	/** 读到超大的帧，不要它 */
-	if(pstuFrames[rp].len > maxframelen)
+	/** Degrade by the lag policy before the reader falls out of the buffer */
+	if(pRead->stuLag.uiDropNonRefMs || pRead->stuLag.uiSkipGopMs || pRead->stuLag.uiJumpNewestMs)
 	{
-		_printd("maxframelen=%d len=%d", maxframelen, pstuFrames[rp].len);
-		return 0;
+		int ret = ShedLaggingFrames(pcontext, wcount, &rp);
+		if(ret != 1)
+		{
+			return ret;
+		}
 	}
-	
+
 	/** 通过时间读取帧 */
 	if(pRead->bReadByTime)
 	{
@@ -472,38 +1059,94 @@ int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe,uint32_t maxfram
 		
 	}
 
-	unsigned int position = pstuFrames[rp].position;
-	if(position + pstuFrames[rp].len <= phead->datasize)
+	*prp = rp;
+	return 1;
+}
+
+int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe,uint32_t maxframelen,
+                        int64_t *timestamp, frame_t *frametype, int *priority)
+{
+	if(!pcontext || !pframe)
+	{
+		_printd("Invalid parameter, pcontext(%p), pframe(%p)", pcontext, pframe);
+		return -1;
+	}
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	char *pstart_addr = pcontext->position.pstuData;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	unsigned int wcount = phead->uiWritFrameCount;
+	int rp = 0;
+	int ret = LocateReadFrame(pcontext, timestamp, &rp);
+	if(ret != 1)
+	{
+		pRead->u32IdleWritCount = wcount;
+		return ret;
+	}
+
+	/** Snapshot the slot, writer may cover it at any time during the copy */
+	SmemoryFrame *pslot = &pstuFrames[rp];
+	unsigned int seq = FrameSlotSeq(pslot);
+	unsigned int position = pslot->position;
+	unsigned int framelen = pslot->len;
+	SMemFrameInfo info = pslot->stuFrameInfo;
+	if((seq & 1) || pslot->uiFrameNo != pRead->u32RdFrameCount ||
+		position >= phead->datasize || framelen > phead->datasize)
+	{
+		return FRAME_CONSUME_SLOW;
+	}
+
+	/** 读到超大的帧，不要它 */
+	if(framelen > maxframelen)
+	{
+		_printd("maxframelen=%d len=%d", maxframelen, framelen);
+		/** Dropped like GetFramesFromBuff(), the next read goes on with the frame after it */
+		pRead->u32RdFrameCount++;
+		return 0;
+	}
+	
+	if(phead->ucMirror || position + framelen <= phead->datasize)
 	{
-		memcpy(*pframe, pstart_addr + position, pstuFrames[rp].len);
+		memcpy(*pframe, pstart_addr + position, framelen);
 	}
 	else
 	{
 		int left = phead->datasize - position;
-		int len = pstuFrames[rp].len - left;
+		int len = framelen - left;
 
 		memcpy(*pframe, pstart_addr + position, left);
 		memcpy(*pframe + left, pstart_addr, len);
 	}
 
-	if (pstuFrames[rp].stuFrameInfo.frametype != FRAME_AAC && 
+	/** The copy is torn if seq changed, next read will jump to the oldest I frame */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&pslot->seq, __ATOMIC_RELAXED) != seq)
+	{
+		_printv("(%s %s)  pos=%d covered while reading, r=%d w=%d\n",
+				pcontext->Name, pcontext->UserId, rp, pRead->u32RdFrameCount, phead->uiWritFrameCount);
+		return FRAME_CONSUME_SLOW;
+	}
+
+	if (info.frametype != FRAME_AAC && 
 			((*pframe)[0] || (*pframe)[1] ||
 			((*pframe)[3] != 1 && (*pframe)[4] != 1)))
 			_printd("stream buffer find a video frame "
 						"data[0]:%02x, data[1]:%02x, data[2]:%02x, data[3]:%02x, data[3]:%02x",
 						(*pframe)[0], (*pframe)[1], (*pframe)[2],(*pframe)[3],(*pframe)[4]);
 
-	*timestamp = pstuFrames[rp].stuFrameInfo.timestamp;
-	*frametype = pstuFrames[rp].stuFrameInfo.frametype;
-    *priority  = pstuFrames[rp].stuFrameInfo.priority;
+	*timestamp = info.timestamp;
+	*frametype = info.frametype;
+    *priority  = info.priority > pRead->iCarryPriority ? info.priority : pRead->iCarryPriority;
+	pRead->iCarryPriority = 0;
 
 	pRead->u32RdFrameCount++;
-	return pstuFrames[rp].len;
+	return framelen;
 }
 
-int GetOneFrameFromBuff2(BuffContext *pcontext, SGetFrameInfo *pinfo)
+
+int GetOneFrameRefFromBuff(BuffContext *pcontext, SGetFrameInfo *pinfo)
 {
-	if(!pcontext || !pinfo)
+	if(!pcontext || !pinfo || !pcontext->pReadpara)
 	{
 		_printd("Invalid parameter");
 		return -1;
@@ -512,73 +1155,382 @@ int GetOneFrameFromBuff2(BuffContext *pcontext, SGetFrameInfo *pinfo)
 	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
 	char *pstart_addr = pcontext->position.pstuData;
 	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
-	int rp = 0;//pRead->u32RdFrameCount % phead->uiMaxValidFrames;
-	
-	if(phead->uiWritFrameCount == pRead->u32RdFrameCount)
+	int64_t timestamp = pinfo->timestamp;
+	unsigned int wcount = phead->uiWritFrameCount;
+	int rp = 0;
+
+	pinfo->slot = -1;
+	/** Only one read can be pinned by a reader, commit the last one */
+	UnpinReadFrames(pRead, phead, pstuFrames);
+
+	int ret = LocateReadFrame(pcontext, &timestamp, &rp);
+	if(ret != 1)
 	{
-		return 0;
+		pRead->u32IdleWritCount = wcount;
+		pinfo->timestamp = timestamp;
+		return ret;
 	}
-	
-	if(phead->uiWritFrameCount < pRead->u32RdFrameCount)
+
+	/** Snapshot the slot, the pin does not stop the writer from covering it */
+	SmemoryFrame *pslot = &pstuFrames[rp];
+	unsigned int seq = FrameSlotSeq(pslot);
+	unsigned int position = pslot->position;
+	unsigned int framelen = pslot->len;
+	SMemFrameInfo info = pslot->stuFrameInfo;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if((seq & 1) || pslot->uiFrameNo != pRead->u32RdFrameCount || __atomic_load_n(&pslot->seq, __ATOMIC_RELAXED) != seq ||
+		position >= phead->datasize || framelen > phead->datasize)
+	{
+		/** Covered by writer just now, next read will jump to the oldest I frame */
+		return FRAME_CONSUME_SLOW;
+	}
+
+	if(phead->ucMirror || position + framelen <= phead->datasize)
+	{
+		pinfo->addrnum = 1;
+		pinfo->faddr[0].len = framelen;
+		pinfo->faddr[0].pframe = pstart_addr + position;
+	}
+	else
+	{
+		int left = phead->datasize - position;
+
+		pinfo->addrnum = 2;
+		pinfo->faddr[0].len = left;
+		pinfo->faddr[0].pframe = pstart_addr + position;
+		pinfo->faddr[1].len = framelen - left;
+		pinfo->faddr[1].pframe = pstart_addr;
+	}
+	pinfo->timestamp = info.timestamp;
+	pinfo->frametype = info.frametype;
+	pinfo->priority  = info.priority;
+	if(pRead->iCarryPriority > pinfo->priority)
+	{
+		pinfo->priority = pRead->iCarryPriority;
+	}
+	pRead->iCarryPriority = 0;
+	pinfo->slot = rp;
+
+	pRead->iPinnedSlot = rp;
+	pRead->u32PinnedFrom = pRead->u32RdFrameCount;
+	pRead->u32RdFrameCount++;
+	return framelen;
+}
+
+int ReleaseOneFrameToBuff(BuffContext *pcontext, SGetFrameInfo *pinfo)
+{
+	int ret = 0;
+	if(!pcontext || !pinfo || !pcontext->pReadpara || pinfo->slot < 0)
 	{
-		_printd("(%s %s)  w=%d < r=%d so need jump count=%d\n", pcontext->Name, pcontext->UserId, phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
-		JumpToOldestIFrame(pRead, phead, pstuFrames);
 		return 0;
 	}
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
 
-	if((phead->uiWritFrameCount - pRead->u32RdFrameCount) > phead->uiMaxValidFrames)
+	if(pRead->iPinnedSlot == pinfo->slot)
 	{
-		_printd("(%s %s) need jump w=%d r=%d count=%d\n", pcontext->Name, pcontext->UserId, phead->uiWritFrameCount, pRead->u32RdFrameCount, phead->uiMaxValidFrames);
-		if(JumpToOldestIFrame(pRead, phead, pstuFrames) == -1)
+		ret = UnpinReadFrames(pRead, (SmemoryHead *)pcontext->position.pstuHead,
+								(SmemoryFrame *)pcontext->position.pstuFrames);
+	}
+	pinfo->slot = -1;
+	return ret;
+}
+
+int GetFramesFromBuff(BuffContext *pcontext, SGetFrameInfo *pinfos, int maxframes, unsigned int maxbytes, uint8_t *pcopy)
+{
+	if(!pcontext || !pinfos || maxframes <= 0 || !pcontext->pReadpara)
+	{
+		_printd("Invalid parameter");
+		return -1;
+	}
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	SmemoryFrame *pstuFrames = (SmemoryFrame *)pcontext->position.pstuFrames;
+	char *pstart_addr = pcontext->position.pstuData;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	int64_t timestamp = pinfos[0].timestamp;
+	unsigned int wcount = phead->uiWritFrameCount;
+	unsigned int bytes = 0;
+	int count = 0;
+	int rp = 0;
+
+	UnpinReadFrames(pRead, phead, pstuFrames);
+	int ret = LocateReadFrame(pcontext, &timestamp, &rp);
+	if(ret != 1)
+	{
+		pRead->u32IdleWritCount = wcount;
+		pinfos[0].timestamp = timestamp;
+		return ret;
+	}
+
+	/** The first frame is located as a single read, the following ones are taken while they
+	 *  are published in order, any jump or shedding is left to the next batch */
+	wcount = __atomic_load_n(&phead->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	pRead->u32PinnedFrom = pRead->u32RdFrameCount;
+	while(count < maxframes)
+	{
+		SmemoryFrame *pslot = &pstuFrames[rp];
+		SGetFrameInfo *pinfo = &pinfos[count];
+		unsigned int seq = FrameSlotSeq(pslot);
+		if((seq & 1) || pslot->uiFrameNo != pRead->u32RdFrameCount)
 		{
-			return 0;
+			break;
+		}
+		unsigned int position = pslot->position;
+		unsigned int framelen = pslot->len;
+		SMemFrameInfo info = pslot->stuFrameInfo;
+		bool take = position < phead->datasize && framelen <= phead->datasize &&
+					(0 == count || bytes + framelen <= maxbytes);
+		if(take && count > 0)
+		{
+			take = !pRead->bSkipGop && !(pRead->stuLag.uiDropNonRefMs && FRAME_B == info.frametype) &&
+					!(pRead->bReadByTime && 0 != timestamp && (unsigned long long)timestamp + 2000 < info.timestamp);
+		}
+		if(!take || (0 == count && framelen > maxbytes))
+		{
+			/** Too big to read, drop it */
+			if(take)
+			{
+				_printd("maxbytes=%u len=%u", maxbytes, framelen);
+				pRead->u32RdFrameCount++;
+			}
+			break;
+		}
+
+		if(pcopy)
+		{
+			if(phead->ucMirror || position + framelen <= phead->datasize)
+			{
+				memcpy(pcopy + bytes, pstart_addr + position, framelen);
+			}
+			else
+			{
+				int left = phead->datasize - position;
+				memcpy(pcopy + bytes, pstart_addr + position, left);
+				memcpy(pcopy + bytes + left, pstart_addr, framelen - left);
+			}
+			/** Torn by writer, next read will jump to the oldest I frame */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&pslot->seq, __ATOMIC_RELAXED) != seq)
+			{
+				break;
+			}
+			pinfo->addrnum = 1;
+			pinfo->faddr[0].len = framelen;
+			pinfo->faddr[0].pframe = (char *)pcopy + bytes;
+			pinfo->slot = -1;
+		}
+		else
+		{
+			/** The pin does not stop the writer, the slot read must be of the frame */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&pslot->seq, __ATOMIC_RELAXED) != seq)
+			{
+				break;
+			}
+			if(phead->ucMirror || position + framelen <= phead->datasize)
+			{
+				pinfo->addrnum = 1;
+				pinfo->faddr[0].len = framelen;
+				pinfo->faddr[0].pframe = pstart_addr + position;
+			}
+			else
+			{
+				int left = phead->datasize - position;
+
+				pinfo->addrnum = 2;
+				pinfo->faddr[0].len = left;
+				pinfo->faddr[0].pframe = pstart_addr + position;
+				pinfo->faddr[1].len = framelen - left;
+				pinfo->faddr[1].pframe = pstart_addr;
+			}
+			pinfo->slot = rp;
+			pRead->iPinnedNum++;
+		}
+		pinfo->maxframelen = framelen;
+		pinfo->timestamp = info.timestamp;
+		pinfo->frametype = info.frametype;
+		pinfo->priority  = info.priority;
+		if(0 == count && pRead->iCarryPriority > pinfo->priority)
+		{
+			pinfo->priority = pRead->iCarryPriority;
 		}
+
+		bytes += framelen;
+		count++;
+		if(++pRead->u32RdFrameCount == wcount)
+		{
+			break;
+		}
+		rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
 	}
 
-	if(pRead->breIframe)
+	if(count > 0)
+	{
+		pRead->iCarryPriority = 0;
+		return count;
+	}
+	/** Covered by writer just now, next read will jump to the oldest I frame */
+	return pRead->u32RdFrameCount == pRead->u32PinnedFrom ? FRAME_CONSUME_SLOW : 0;
+}
 
+int ReleaseFramesToBuff(BuffContext *pcontext)
+{
+	if(!pcontext || !pcontext->pReadpara)
 	{
-		pRead->u32RdFrameCount = phead->uiWritFrameCount - 5;
-		if(JumpTonewestIFrame(pRead, phead, pstuFrames) < 0)
+		return 0;
+	}
+	return UnpinReadFrames((MemReader_t *)pcontext->pReadpara, (SmemoryHead *)pcontext->position.pstuHead,
+					(SmemoryFrame *)pcontext->position.pstuFrames);
+}
+
+int WaitFrameFromBuff(BuffContext *pcontext, unsigned int timeout_ms)
+{
+	if(!pcontext || !pcontext->pReadpara)
+	{
+		_printd("Invalid parameter");
+		return -1;
+	}
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	struct timespec now, deadline, timeout;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while(1)
+	{
+		if(pRead->bCancelWait)
+		{
+			pRead->bCancelWait = false;
+			return ECANCELED;
+		}
+		/** Read again to move to the new buffer */
+		if(__atomic_load_n(&phead->ucRetired, __ATOMIC_ACQUIRE))
 		{
 			return 0;
 		}
-		pRead->breIframe = false;
-	}
-	
-	rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
-	if(pstuFrames[rp].ucValidFlag == 0)
-	{
-		_printd("(%s %s)  pos=%d invalid frame ,jump to oldest iframe r=%d w=%d\n", pcontext->Name, pcontext->UserId, rp, pRead->u32RdFrameCount, phead->uiWritFrameCount);
-		if(JumpToOldestIFrame(pRead, phead, pstuFrames) == -1)
+
+		unsigned int wcount = phead->uiWritFrameCount;
+		/** There are unread frames and the last read did not stop at this count */
+		if(wcount != pRead->u32RdFrameCount && wcount != pRead->u32IdleWritCount)
 		{
 			return 0;
 		}
-		rp = pRead->u32RdFrameCount % phead->uiMaxValidFrames;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+		timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if(timeout.tv_nsec < 0)
+		{
+			timeout.tv_sec--;
+			timeout.tv_nsec += 1000000000;
+		}
+		if(timeout.tv_sec < 0)
+		{
+			return ETIMEDOUT;
+		}
+
+		/** Returns at once if a frame was written since wcount was read */
+		ret = futex_wait(&phead->uiWritFrameCount, wcount, &timeout);
+		if(ret < 0 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+		{
+			_printd("(%s %s) futex wait failed:%s", pcontext->Name, pcontext->UserId, strerror(errno));
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	unsigned int position = pstuFrames[rp].position;
-	if(position + pstuFrames[rp].len <= phead->datasize)
+void CancelWaitFrameFromBuff(BuffContext *pcontext)
+{
+	if(!pcontext || !pcontext->pReadpara)
 	{
-		pinfo->addrnum = 1;
-		pinfo->faddr[0].len = pstuFrames[rp].len;
-		pinfo->faddr[0].pframe = pstart_addr + position;
+		return;
 	}
-	else
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+
+	pRead->bCancelWait = true;
+	__sync_synchronize();
+	/** Other readers of this buffer will wake up and wait again */
+	futex_wake(&phead->uiWritFrameCount);
+}
+
+int ArmFrameNotify(BuffContext *pcontext, int fd)
+{
+	if(!pcontext || !pcontext->pReadpara || fd < 0)
 	{
-		int left = phead->datasize - position;
-		int len = pstuFrames[rp].len - left;
-		
-		pinfo->addrnum = 2;
-		pinfo->faddr[0].len = left;
-		pinfo->faddr[0].pframe = pstart_addr + position;
-		pinfo->faddr[1].len = len;
-		pinfo->faddr[1].pframe = pstart_addr;
+		_printd("Invalid parameter");
+		return -1;
+	}
+	SmemoryHead *phead = (SmemoryHead *)pcontext->position.pstuHead;
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	FrameNotify *pnotify = GetFrameNotify(pcontext);
+	if(!pnotify)
+	{
+		return -1;
 	}
-	pinfo->timestamp = pstuFrames[rp].stuFrameInfo.timestamp;
-	pinfo->frametype = pstuFrames[rp].stuFrameInfo.frametype;
 
-	pRead->u32RdFrameCount++;
-	return pstuFrames[rp].len;
+	/** Counted apart from the futex waiters, the writer only wakes the futex for them */
+	if(pRead->iNotifyFd < 0)
+	{
+		pRead->iNotifyFd = fd;
+		pthread_mutex_lock(&pnotify->mutex);
+		pRead->pNotifyPrev = NULL;
+		pRead->pNotifyNext = pnotify->pReaders;
+		if(pnotify->pReaders)
+		{
+			pnotify->pReaders->pNotifyPrev = pRead;
+		}
+		pnotify->pReaders = pRead;
+		pthread_mutex_unlock(&pnotify->mutex);
+		__sync_add_and_fetch(&pnotify->iArmed, 1);
+	}
+
+	/** Written before the writer could see the reader armed, same as WaitFrameFromBuff */
+	unsigned int wcount = phead->uiWritFrameCount;
+	if(__atomic_load_n(&phead->ucRetired, __ATOMIC_ACQUIRE) ||
+		(wcount != pRead->u32RdFrameCount && wcount != pRead->u32IdleWritCount))
+	{
+		DisarmFrameNotify(pcontext);
+		return 0;
+	}
+	return EAGAIN;
 }
 
+void DisarmFrameNotify(BuffContext *pcontext)
+{
+	if(!pcontext || !pcontext->pReadpara)
+	{
+		return;
+	}
+	MemReader_t *pRead = (MemReader_t *)pcontext->pReadpara;
+	FrameNotify *pnotify = pcontext->pNotify;
+	if(pRead->iNotifyFd < 0 || !pnotify)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pnotify->mutex);
+	if(pRead->pNotifyPrev)
+	{
+		pRead->pNotifyPrev->pNotifyNext = pRead->pNotifyNext;
+	}
+	else
+	{
+		pnotify->pReaders = pRead->pNotifyNext;
+	}
+	if(pRead->pNotifyNext)
+	{
+		pRead->pNotifyNext->pNotifyPrev = pRead->pNotifyPrev;
+	}
+	pthread_mutex_unlock(&pnotify->mutex);
+	__sync_sub_and_fetch(&pnotify->iArmed, 1);
+	pRead->iNotifyFd = -1;
+}
@@ -12,12 +12,26 @@ extern "C"{
 #endif
 
 #define MAX_MEMORY_BANK	1
+/* Count of recent key frames indexed in SmemoryHead */
+#define KEY_FRAME_INDEX_SIZE	64
+
+#define SMEMORY_MAGIC		0x12348756
+/* Layout of SmemoryHead and SmemoryFrame, bump it on any change of them. Processes
+ * attaching share memory by name, mgw-tap included, refuse a layout they do not know */
+#define SMEMORY_VERSION		2
 
 typedef enum mem_type {
 	MEM_SHARED = 0,
 	MEM_DYNAMIC,
 }mem_t;
 
+/* Flags or-ed with the type of memory */
+#define MEM_TYPE_MASK		0xff
+/* Map the data region twice back to back, frames never wrap */
+#define MEM_FLAG_MIRROR		(1 << 8)
+/* Back the data region by transparent huge pages */
+#define MEM_FLAG_HUGEPAGE	(1 << 9)
+
 typedef enum io_mode {
 	IO_MODE_READ 	= (1 << 0),
 	IO_MODE_WRITE	= (1 << 1),
@@ -33,9 +47,11 @@ typedef struct _SMemFrameInfo
 
 typedef struct _SmemoryFrame
 {
-	/* Flag of valid frame */
-	char ucValidFlag;
-	char reserved[3];
+	/* Sequence of slot, odd while the slot is invalid or being written,
+	 * even after the frame is published. Readers check it around the read */
+	volatile unsigned int seq;
+	/* Write count of the frame in this slot */
+	unsigned int uiFrameNo;
 	 /*the offet of start address*/
 	unsigned int position;
 	/*the frame length */
@@ -44,17 +60,31 @@ typedef struct _SmemoryFrame
 	SMemFrameInfo stuFrameInfo;
 }SmemoryFrame;
 
+typedef struct _SKeyFrameIndex
+{
+	/* Write count of the key frame */
+	unsigned int uiFrameNo;
+	unsigned long long timestamp;
+}SKeyFrameIndex;
+
 /** Share memory context */
 typedef struct _SmemoryHead
 {
 	int magic;
+	/* SMEMORY_VERSION, sizeof(SmemoryHead) and sizeof(SmemoryFrame) of the creator */
+	unsigned short usVersion;
+	unsigned short usHeadSize;
+	unsigned short usFrameSize;
+	unsigned short usReserved;
 	/** size of continuously data */
 	unsigned int datasize;
-	/* Count frames of write */
-	unsigned int uiWritFrameCount;
+	/* Count frames of write, also the futex word to wake up readers */
+	volatile unsigned int uiWritFrameCount;
+	/* Offset of next frame in data */
+	unsigned int uiWritePos;
 	/* Count of max valid frames */
 	unsigned int uiMaxValidFrames;
-	/* Mutex of write */
+	/* Process of writer, a writer which is gone can be replaced */
 	int n32WriterPid;
 	/* Count of writer */
 	unsigned char ucWriterCount;
@@ -62,9 +92,19 @@ typedef struct _SmemoryHead
 	unsigned char ucReaderCount;
 	/* Block Write or not */
 	unsigned char bLock;
+	/* Data region is mirrored, a frame is always continuous from pstuData + position */
+	unsigned char ucMirror;
+	/* Offset of data region from head, 0 if it follows the frames directly */
+	unsigned int uiDataOffset;
 	char *pnext;
 	char *prev;
-	char reserved[4];
+	/* Replaced by a new buffer of the same name, readers move to it after reading all frames */
+	volatile unsigned char ucRetired;
+	char reserved[3];
+	/* Count of key frames written, the newest one is at (count-1) % KEY_FRAME_INDEX_SIZE */
+	volatile unsigned int uiKeyFrameCount;
+	/* Ring of recent key frames */
+	SKeyFrameIndex stuKeyFrames[KEY_FRAME_INDEX_SIZE];
 
     void *priv_data;
 }SmemoryHead;
@@ -79,6 +119,18 @@ typedef struct _SMemoryPosition
 	char *pstuData;
 }SMemoryPosition;
 
+/** Lag policy of a reader which falls behind the writer, the lag is CheckBuffDuration()
+ *  in ms and each step is taken once the lag reaches its threshold, 0 disables a step */
+typedef struct _SBuffLagPolicy
+{
+	/* Drop non reference frames (FRAME_B) */
+	unsigned int uiDropNonRefMs;
+	/* Skip video to the next key frame, audio is kept */
+	unsigned int uiSkipGopMs;
+	/* Jump to the newest key frame */
+	unsigned int uiJumpNewestMs;
+}SBuffLagPolicy;
+
 typedef struct tag_MemReader
 {
 	/** Aready read frame count */
@@ -90,6 +142,25 @@ typedef struct tag_MemReader
 	bool bResetPos;
 	/** Read data by time or not */
 	bool bReadByTime;
+	/** Slot pinned by zero copy read, -1 if none */
+	int iPinnedSlot;
+	/** Frames of read count [u32PinnedFrom, u32PinnedFrom + iPinnedNum) pinned by zero copy batch read */
+	unsigned int u32PinnedFrom;
+	int iPinnedNum;
+	/** Write count when the last read got nothing */
+	unsigned int u32IdleWritCount;
+	/** Interrupt the waiting reader */
+	volatile bool bCancelWait;
+	/** Eventfd armed by ArmFrameNotify(), -1 if not armed */
+	int iNotifyFd;
+	struct tag_MemReader *pNotifyNext;
+	struct tag_MemReader *pNotifyPrev;
+	/** Shed frames by lag, see SBuffLagPolicy */
+	SBuffLagPolicy stuLag;
+	/** Skipping video to the next key frame, audio is still read */
+	bool bSkipGop;
+	/** Priority of key frames jumped over, given to the key frame jumped to */
+	int iCarryPriority;
 }MemReader_t;
 
 typedef struct tag_MemWriter
@@ -108,10 +179,14 @@ typedef struct BuffContext
 	io_mode_t mode;
 	//SHARE_MEMORY	= 0x00, MALLOC_MEMORY = 0x01,
 	int type;
+	/* MEM_FLAG_* the buffer created with */
+	int flags;
 	//MemWriter_t
 	char *pWritepara;
 	//MemReader_t
 	char *pReadpara;
+	/** Eventfd readers of the name in this process, taken when first needed */
+	struct FrameNotify *pNotify;
 }BuffContext;
 
 typedef struct _FrameAddrInfo_
@@ -127,6 +202,9 @@ typedef struct _SGetFrameInfo_
 	unsigned long long timestamp;
 	char addrnum;
 	frame_t frametype;
+	int priority;
+	/* Pinned slot of zero copy read, -1 if not pinned */
+	int slot;
 }SGetFrameInfo;
 void InitMemoryParam(char *phead, int frames, int size, void *priv_data);
 
@@ -135,6 +213,15 @@ BuffContext *CreateStreamBuff(unsigned int size, const char *name,
 							io_mode_t mode, int read_bytime, void *priv_data);
 
 int DeleteStreamBuff(BuffContext *pbuf);
+/* Writer only, replace the buffer by a new one of size and frames under the same name.
+ * The handle stays valid, readers move to the new buffer after reading all frames of the old one */
+int ResizeStreamBuff(BuffContext *pcontext, unsigned int size, int frames);
+/* ResizeStreamBuff() in two steps. Prepare creates the new buffer, which is slow and may run
+ * on another thread while the writer goes on. Commit is quick and called by the writer between
+ * two frames, pnew is the handle of the old buffer after it succeeds. The caller deletes pnew
+ * either way, which may be as slow as the create */
+BuffContext *PrepareResizeStreamBuff(BuffContext *pcontext, unsigned int size, int frames);
+int CommitResizeStreamBuff(BuffContext *pcontext, BuffContext *pnew);
 
 /*frametype:0:IFrame*/
 int PutOneFrameToBuff(BuffContext *pcontext, uint8_t *pframe, uint32_t framelen,
@@ -142,9 +229,33 @@ int PutOneFrameToBuff(BuffContext *pcontext, uint8_t *pframe, uint32_t framelen,
 /*By copy*/
 int GetOneFrameFromBuff(BuffContext *pcontext, uint8_t **pframe, uint32_t maxframelen,
 						int64_t *timestamp, frame_t *frametype, int *priority);
-/* No copy*/
-int GetOneFrameFromBuff2(BuffContext *pcontext, SGetFrameInfo *pinfo);
+/* No copy, the frame is pinned until ReleaseOneFrameToBuff(),
+ * pinfo->timestamp is the input time if read by time.
+ * A pin never blocks the writer, release returns -3 if the frame was covered meanwhile */
+int GetOneFrameRefFromBuff(BuffContext *pcontext, SGetFrameInfo *pinfo);
+int ReleaseOneFrameToBuff(BuffContext *pcontext, SGetFrameInfo *pinfo);
+/* Read the frames available up to maxframes frames and maxbytes bytes at once, return the count.
+ * Copied one after another into pcopy of maxbytes if not NULL, otherwise no copy and the frames
+ * are pinned until ReleaseFramesToBuff() or the next read, pinfos[0].timestamp is the input time if read by time */
+int GetFramesFromBuff(BuffContext *pcontext, SGetFrameInfo *pinfos, int maxframes, unsigned int maxbytes, uint8_t *pcopy);
+int ReleaseFramesToBuff(BuffContext *pcontext);
 unsigned long long CheckBuffDuration(BuffContext *pcontext);
+/* Reader only, NULL to disable */
+void SetBuffLagPolicy(BuffContext *pcontext, const SBuffLagPolicy *policy);
+/* Reader only, move to the last key frame not later than timestamp, or the oldest one if all are later.
+ * Move to the first frame not earlier than timestamp if not keyframe. timestamp is from the newest
+ * frame if whence is SEEK_END, return the timestamp of the frame to read next or -1 if not found */
+int64_t SeekStreamBuff(BuffContext *pcontext, int64_t timestamp, int whence, bool keyframe);
+
+/* Block until new frame is written, return 0 if there is frame to read,
+ * ETIMEDOUT if timeout and ECANCELED if interrupted by CancelWaitFrameFromBuff() */
+int WaitFrameFromBuff(BuffContext *pcontext, unsigned int timeout_ms);
+void CancelWaitFrameFromBuff(BuffContext *pcontext);
+/* Wait by an event loop instead of blocking, the writer of this process writes 1 to the eventfd
+ * fd after each frame until DisarmFrameNotify(). Return 0 if there is frame to read, the reader
+ * is not armed then, EAGAIN if armed. Disarm before reading again */
+int ArmFrameNotify(BuffContext *pcontext, int fd);
+void DisarmFrameNotify(BuffContext *pcontext);
 
 #ifdef __cplusplus
 }
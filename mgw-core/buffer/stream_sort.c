@@ -1,14 +1,38 @@
 #include "stream_sort.h"
-#include <time.h>
 #include <stdlib.h>
 #include <assert.h>
 
 #include "util/base.h"
 #include "util/bmem.h"
+#include "util/platform.h"
+#include "buffer_pool.h"
 
 #define DEFAULT_SORT_TIME	1000*1000//us
 #define MAX_SORT_BUFF_LEN	8*1024*1024//byte
 #define MIM_SORT_BUFF_LEN	1*1024*1024//byte
+/** Frames are stored in segments of this size with the head, a bigger frame has its own */
+#define SORT_SEGMENT_SIZE	256*1024//byte
+#define SORT_SEGMENT_DATA	(SORT_SEGMENT_SIZE - sizeof(SC_sssegment))
+/** Max frames waiting in sort by default, the earliest one is output when the pool is exhausted */
+#define SORT_NODE_POOL_SIZE	1024
+#define SORT_CACHE_LINE		64
+#define SORT_NSEC_PER_SEC	1000000000ULL
+/** Sort time shrinks to the disorder seen in the last period */
+#define SORT_DECAY_PERIOD	10//s
+/** Sort time under it is closed, ordered frames pass straight through */
+#define SORT_TIME_MIN		1000//us
+
+typedef struct _SC_sssegment_
+{
+	struct _SC_sssegment_ *next;
+	/* Size of data */
+	unsigned int size;
+	/* Offset of the next frame */
+	unsigned int used;
+	/* Frames stored and not output yet, the segment is free at 0 */
+	unsigned int refs;
+	char data[];
+}SC_sssegment;
 
 typedef struct _SC_ssnode_
 {
@@ -19,48 +43,57 @@ typedef struct _SC_ssnode_
 	unsigned long long timestamp;
 	char frametype;
     int priority;
-	/* Flag of valid frame */
-	char ucValidFlag;
-	char reserved[2];
-	struct _SC_ssnode_ *prev;
+	/* Order of arrival, frames of the same timestamp are output by it */
+	unsigned int seq;
+	/* Segment the data stored in */
+	SC_sssegment *segment;
+	/* Next free node, only valid in the free list */
 	struct _SC_ssnode_ *next;
-}SC_ssnode;
+}__attribute__((aligned(SORT_CACHE_LINE))) SC_ssnode;
 
-typedef struct _SC_frameaddr_
+/** Nodes are preallocated and cache aligned, no allocation for each frame */
+typedef struct _SC_sspool_
 {
-	/*the data of start address*/
-	unsigned int position;
-	struct _SC_frameaddr_ *prev;
-	struct _SC_frameaddr_ *next;
-}SC_frameaddr;
+	SC_ssnode *nodes;
+	SC_ssnode *freelist;
+	unsigned int uiFreeCount;
+	/* Min heap by timestamp of frames not output */
+	SC_ssnode **heap;
+	unsigned int uiHeapSize;
+	unsigned int uiCapacity;
+	/* Most nodes in use at the same time */
+	unsigned int uiPeakUsed;
+	/* Count frames found the pool exhausted */
+	unsigned int uiExhausted;
+}SC_sspool;
 
 typedef struct _SC_ssbuff_
 {
-	int magic; /**/	
+	int magic; /**/
 	/* prival */
 	void *puser;
-	/* Time sort list */
-	SC_ssnode *phead;
-	/* Frame list by address */
-	SC_frameaddr *frameaddr;
+	SC_sspool *pool;
+	/* Bytes of segments kept for reuse */
 	unsigned int datasize;
-	/*the data of start address*/
-	char *pdata;
-	/*offset address**/
-	unsigned int position;
+	/* Segment frames are appended to */
+	SC_sssegment *cursegment;
+	/* Segments free for reuse */
+	SC_sssegment *freesegment;
+	/* Bytes of all segments allocated */
+	unsigned int uiSegmentSize;
 	/* Count frames of input */
 	unsigned int uiPutFrameCount;
 	unsigned int uiValidLen;
 	unsigned int uiSortTime;
-	/* sort time bakup and resume */
+	/* Floor of sort time, 0 passes ordered frames straight through */
 	unsigned int uiSortTimeBak;
 	unsigned int uiMaxSortTime;
-	/* Count time of sort */
+	/* Max disorder seen in this decay period */
 	unsigned int uiAnalyTime;
 	unsigned long long maxtimestamp;
 	unsigned long long mintimestamp;
 	unsigned long long premintimestamp;
-	
+
 	/* Count frames of output */
 	unsigned int u32PopFrameCount;
 	/* Droped count of too late frame */
@@ -71,583 +104,380 @@ typedef struct _SC_ssbuff_
 	unsigned int u32EarlyFrameDrop;
 	/* Continuously droped count of too late */
 	unsigned int u32LateFrameDrop;
-	
-	/* Memory free size */
-	unsigned int freesize;
-	/* Memory free time */
-	unsigned long long freetime;
-	/* Count resort time */
+
+	/* Start of the decay period, monotonic ns */
 	unsigned long long analytime;
-	
+
 	struct dstr name;
 	struct dstr userid;
-	
+
 	SortDataCallback Datacallback;
 }SC_ssbuff;
 
-
-int DefaultStreamSortBuff(SC_ssbuff *pssbuf, unsigned int uiSize, unsigned int uiSortTime, unsigned int uiMaxSortTime)
+static SC_sspool *CreateSortPool(unsigned int capacity)
 {
-	pssbuf->magic = 0x123456;
-	pssbuf->datasize = uiSize;
-	pssbuf->phead = NULL;
-	pssbuf->frameaddr = NULL;
-	pssbuf->pdata = (char *)pssbuf + sizeof(SC_ssbuff);
-	pssbuf->position = 0;
-	pssbuf->uiValidLen = 0;
-	pssbuf->uiPutFrameCount = 0;
-	pssbuf->uiSortTime = uiSortTime;
-	pssbuf->uiSortTimeBak = uiSortTime;
-	if(uiMaxSortTime < DEFAULT_SORT_TIME)
-	{
-		pssbuf->uiMaxSortTime = DEFAULT_SORT_TIME;
-	}
-	else
+	/** Page aligned, so cache aligned */
+	char *nodes = AllocPoolBuff(sizeof(SC_ssnode) * capacity);
+	if(!nodes)
 	{
-		pssbuf->uiMaxSortTime = uiMaxSortTime;
+		return NULL;
 	}
-	pssbuf->maxtimestamp = 0;
-	pssbuf->mintimestamp = 0;
-	pssbuf->u32PopFrameCount = 0;
-	pssbuf->u32LateFrameCount = 0;
-	pssbuf->u32EarlyFrameCount = 0;
-	pssbuf->freesize = uiSize;
-	pssbuf->freetime = time(NULL);
-	pssbuf->analytime = time(NULL);
-	return 0;
+	memset(nodes, 0, sizeof(SC_ssnode) * capacity);
+	SC_sspool *pool = (SC_sspool *)bzalloc(sizeof(SC_sspool));
+	pool->nodes = (SC_ssnode *)nodes;
+	pool->heap = (SC_ssnode **)bzalloc(sizeof(SC_ssnode *) * capacity);
+	pool->uiCapacity = capacity;
+	return pool;
 }
 
-void *pCreateStreamSort(RegisterSortInfo *info)
+static void DeleteSortPool(SC_sspool *pool)
 {
-	if(!info || info->uiSize < MIM_SORT_BUFF_LEN || !info->Datacallback)
-	{
-		return NULL;
-	}
-	unsigned int len = info->uiSize+sizeof(SC_ssbuff);
-	SC_ssbuff *pssbuf = (SC_ssbuff *)calloc(1, len);
-	DefaultStreamSortBuff(pssbuf, info->uiSize, info->uiSortTime, info->uiMaxSortTime);
-	pssbuf->puser = info->puser;
-	dstr_copy_dstr(&pssbuf->name, &info->name);
-	dstr_copy_dstr(&pssbuf->userid, &info->userid);
-	pssbuf->Datacallback = info->Datacallback;
-	return (void *)pssbuf;	
+	FreePoolBuff((char *)pool->nodes, sizeof(SC_ssnode) * pool->uiCapacity);
+	bfree(pool->heap);
+	bfree(pool);
 }
 
-int FillTheNode(SC_ssnode *nd, char *position, unsigned int frame_len, unsigned long long timestamp, char frametype, int priority)
+static void ResetSortPool(SC_sspool *pool)
 {
-	nd->frametype = frametype;
-	nd->len = frame_len;
-	nd->position = position;
-	nd->timestamp = timestamp;
-    nd->priority = priority;
-	nd->ucValidFlag = 1;
-	return 0;
+	unsigned int i;
+	pool->freelist = NULL;
+	for(i = pool->uiCapacity; i > 0; i--)
+	{
+		pool->nodes[i - 1].next = pool->freelist;
+		pool->freelist = &pool->nodes[i - 1];
+	}
+	pool->uiFreeCount = pool->uiCapacity;
+	pool->uiHeapSize = 0;
 }
 
-unsigned long long InsertSortMiddle(SC_ssnode *head, SC_ssnode *nd)
+static inline SC_ssnode *AllocSortNode(SC_sspool *pool)
 {
-	SC_ssnode *p = head;
-	unsigned long long alatime = 0;
-	while(p)
+	SC_ssnode *nd = pool->freelist;
+	if(nd)
 	{
-		if(p->timestamp <= nd->timestamp)
+		pool->freelist = nd->next;
+		pool->uiFreeCount--;
+		if(pool->uiCapacity - pool->uiFreeCount > pool->uiPeakUsed)
 		{
-			p = p->next;
-			continue;
+			pool->uiPeakUsed = pool->uiCapacity - pool->uiFreeCount;
 		}
-		alatime = p->prev->timestamp;
-		nd->next = p;
-		nd->prev = p->prev;
-		p->prev->next = nd;
-		p->prev = nd;
-		break;
 	}
-	return alatime;
+	return nd;
 }
 
-int InsertSortEnd(SC_ssnode *head, SC_ssnode *nd)
+static inline void FreeSortNode(SC_sspool *pool, SC_ssnode *nd)
 {
-	SC_ssnode *p = head;
-	while(p->next)
+	nd->position = NULL;
+	nd->segment = NULL;
+	nd->next = pool->freelist;
+	pool->freelist = nd;
+	pool->uiFreeCount++;
+}
+
+static inline bool SortNodeBefore(SC_ssnode *a, SC_ssnode *b)
+{
+	if(a->timestamp != b->timestamp)
 	{
-		p = p->next;
+		return a->timestamp < b->timestamp;
 	}
-	nd->next = NULL;
-	nd->prev = p;
-	p->next = nd;
-	
-	return 0;
+	return (int)(a->seq - b->seq) < 0;
 }
 
-int FreeSortNode(SC_ssnode *head, SC_ssnode *nd)
+static void HeapPush(SC_sspool *pool, SC_ssnode *nd)
 {
-	SC_ssnode *p = head;	
-	while(p)
+	unsigned int i = pool->uiHeapSize++;
+	while(i > 0)
 	{
-		if(p == nd)
+		unsigned int parent = (i - 1) / 2;
+		if(!SortNodeBefore(nd, pool->heap[parent]))
 		{
-			
+			break;
 		}
-		p = p->next;
+		pool->heap[i] = pool->heap[parent];
+		i = parent;
 	}
-	return 0;
+	pool->heap[i] = nd;
 }
 
-unsigned int MemcpyToSortBuff(SC_ssbuff *ssbuf, char *pframe, unsigned int frame_len)
+static SC_ssnode *HeapPop(SC_sspool *pool)
 {
-	unsigned int position = ssbuf->position;
-	unsigned int wpos = ssbuf->position;
-    //_printd("data: data[-3]:%02x, data[-2]:%02x, data[-1]:%02x, data[0]:%02x, data[1]:%02x\n",
-    //    pframe[-3], pframe[-2], pframe[-1], pframe[0], pframe[1]);
-	if(position + frame_len <= ssbuf->datasize)
+	SC_ssnode *top = pool->heap[0];
+	SC_ssnode *last = pool->heap[--pool->uiHeapSize];
+	unsigned int i = 0, n = pool->uiHeapSize;
+	while(1)
 	{
-		memcpy(ssbuf->pdata + position, pframe, frame_len);
-		position += frame_len;
-		if(position == ssbuf->datasize)
+		unsigned int child = i * 2 + 1;
+		if(child >= n)
 		{
-			position = 0;
+			break;
+		}
+		if(child + 1 < n && SortNodeBefore(pool->heap[child + 1], pool->heap[child]))
+		{
+			child++;
+		}
+		if(!SortNodeBefore(pool->heap[child], last))
+		{
+			break;
 		}
+		pool->heap[i] = pool->heap[child];
+		i = child;
 	}
-	else
+	if(n > 0)
 	{
-#if 0
-		int left = ssbuf->datasize - position;
-		int len = frame_len - left;
-		memcpy(ssbuf->pdata + position, pframe, left);
-		memcpy(ssbuf->pdata, pframe + left, len);
-		position = len;
-#endif
-		if (frame_len > position) {
-			_printd("-------------->>> memory error !\n");
-			assert(frame_len < position);
-		}
-		memcpy(ssbuf->pdata, pframe, frame_len);
-		position = frame_len;
-		wpos = 0;
+		pool->heap[i] = last;
 	}
-
-	ssbuf->position = position;
-	return wpos;
+	return top;
 }
 
-void CleanSortBuff(SC_ssbuff *pssbuf)
+/** Bytes of segments allowed, the sort outputs early frames to stay under it */
+static inline unsigned int MaxSegmentSize(SC_ssbuff *ssbuf)
 {
-	SC_ssnode *p = pssbuf->phead;
-	SC_frameaddr *ar = pssbuf->frameaddr;
-	SC_frameaddr *nar;
-	SC_ssnode *n;
-	while(p && ar)
-	{
-		n = p->next;
-		bfree(p);
-		p = n;
-
-		nar = ar->next;
-		bfree(ar);
-		ar = nar;
-	}
-
-	pssbuf->phead = NULL;
-	pssbuf->frameaddr = NULL;
-	pssbuf->position = 0;
-	pssbuf->uiValidLen = 0;
-	pssbuf->uiPutFrameCount = 0;
-	pssbuf->maxtimestamp = 0;
-	pssbuf->mintimestamp = 0;
-	pssbuf->premintimestamp = 0;
-	pssbuf->u32PopFrameCount = 0;
-	pssbuf->u32LateFrameCount = 0;
-	pssbuf->u32EarlyFrameCount = 0;
-	pssbuf->uiAnalyTime = 0;
-	pssbuf->freesize = pssbuf->datasize;
-	pssbuf->freetime = time(NULL);
-	pssbuf->analytime = time(NULL);
-	pssbuf->uiSortTime = pssbuf->uiSortTimeBak;
-	pssbuf->uiMaxSortTime = pssbuf->uiMaxSortTime;
-	
-	return;
+	return ssbuf->datasize > MAX_SORT_BUFF_LEN ? ssbuf->datasize : MAX_SORT_BUFF_LEN;
 }
-void *RemallocSortBuff(SC_ssbuff *ssbuf, unsigned int uiSize)
+
+static SC_sssegment *AllocSortSegment(SC_ssbuff *ssbuf, unsigned int size)
 {
-	unsigned int uiSortTime = ssbuf->uiSortTime;
-	
-	RegisterSortInfo info = {};
-	info.Datacallback = ssbuf->Datacallback;
-	info.puser = ssbuf->puser;
-	info.uiSize = uiSize;
-	info.uiSortTime = uiSortTime;
-	info.uiMaxSortTime = ssbuf->uiMaxSortTime;
-	dstr_copy_dstr(&info.name, &ssbuf->name);
-	dstr_copy_dstr(&info.userid, &ssbuf->userid);
-	void *buff = pCreateStreamSort(&info);
-	if(!buff)
+	SC_sssegment *seg = NULL;
+	if(size <= SORT_SEGMENT_DATA && ssbuf->freesegment)
 	{
-		return NULL;
+		seg = ssbuf->freesegment;
+		ssbuf->freesegment = seg->next;
 	}
-	SC_ssbuff *newssbuf = (SC_ssbuff *)buff;
-	newssbuf->phead = ssbuf->phead;
-	char *newpdata = newssbuf->pdata;
-	unsigned int position = 0;
-	SC_ssnode *pnode = ssbuf->phead;
-	SC_frameaddr *frameaddr = ssbuf->frameaddr;
-	while(pnode && frameaddr)
+	else
 	{
-		char *end = ssbuf->pdata + ssbuf->datasize;
-		if(pnode->position + pnode->len > end)
+		if(size < SORT_SEGMENT_DATA)
 		{
-			int left = end - pnode->position;
-			int len = pnode->len - left;
-			memcpy(newpdata + position, pnode->position, left);
-			memcpy(newpdata + position+left, ssbuf->pdata, len);
+			size = SORT_SEGMENT_DATA;
 		}
-		else
+		if(ssbuf->uiSegmentSize + size > MaxSegmentSize(ssbuf))
 		{
-			memcpy(newpdata + position, pnode->position, pnode->len);
+			return NULL;
 		}
-		pnode->position = newpdata + position;
-
-		frameaddr->position = position;
-		frameaddr = frameaddr->next;
-		
-		position += pnode->len;
-		pnode = pnode->next;
+		/** Segments of a stream restarted come from the pool, already faulted in */
+		seg = (SC_sssegment *)AllocPoolBuff(sizeof(SC_sssegment) + size);
+		if(!seg)
+		{
+			return NULL;
+		}
+		seg->size = size;
+		ssbuf->uiSegmentSize += size;
 	}
-
-	newssbuf->position = position;
-	newssbuf->uiPutFrameCount = ssbuf->uiPutFrameCount;
-	newssbuf->uiValidLen = ssbuf->uiValidLen;
-	newssbuf->maxtimestamp = ssbuf->maxtimestamp;
-	newssbuf->mintimestamp = ssbuf->mintimestamp;
-	newssbuf->u32EarlyFrameCount = ssbuf->u32EarlyFrameCount;
-	newssbuf->u32LateFrameCount = ssbuf->u32LateFrameCount;
-	newssbuf->u32PopFrameCount = ssbuf->u32PopFrameCount;
-	newssbuf->uiPutFrameCount = ssbuf->uiPutFrameCount;
-	newssbuf->frameaddr = ssbuf->frameaddr;
-	newssbuf->uiAnalyTime = ssbuf->uiAnalyTime;
-	newssbuf->freesize = uiSize - position;
-	newssbuf->uiSortTimeBak = ssbuf->uiSortTimeBak;
-	newssbuf->freetime = time(NULL);
-	newssbuf->analytime = time(NULL);
-	bfree(ssbuf);
-	return buff;
+	seg->next = NULL;
+	seg->used = 0;
+	seg->refs = 0;
+	return seg;
 }
 
+/** Keep the segment for reuse while the sort holds no more than datasize */
+static void ReleaseSortSegment(SC_ssbuff *ssbuf, SC_sssegment *seg)
+{
+	if(seg->size == SORT_SEGMENT_DATA && ssbuf->uiSegmentSize <= ssbuf->datasize)
+	{
+		seg->next = ssbuf->freesegment;
+		ssbuf->freesegment = seg;
+		return;
+	}
+	ssbuf->uiSegmentSize -= seg->size;
+	FreePoolBuff((char *)seg, sizeof(SC_sssegment) + seg->size);
+}
 
-int CFrameaddrList(void **had, unsigned int iposition, unsigned int oposition, int type)
+/** The frame is output or dropped, free its segment if it was the last one */
+static void PutSortSegment(SC_ssbuff *ssbuf, SC_sssegment *seg)
 {
-	SC_frameaddr *h = (SC_frameaddr *)(*had);
-	SC_frameaddr *ad = h;
-	if(0 == type)//only add
+	if(0 == --seg->refs)
 	{
-		SC_frameaddr *fd = (SC_frameaddr *)calloc(1, sizeof(SC_frameaddr));
-		if(!fd)
+		if(seg == ssbuf->cursegment)
 		{
-			return -1;
+			/** Rewind, the segment is empty */
+			seg->used = 0;
 		}
-		fd->position = iposition;
-		if(!ad)
+		else
 		{
-			*had = fd;
-			fd->next = fd;
-			fd->prev = fd;
-			return 0;
+			ReleaseSortSegment(ssbuf, seg);
 		}
-		
-		ad = h->prev;
-		
-		fd->next = h;
-		h->prev = fd;
-		fd->prev = ad;
-		ad->next = fd;
 	}
-	else if(1 == type)//modify the node,and move to the end
-	{
-		SC_frameaddr *fd = NULL;
-		SC_frameaddr *node = ad;
-		do
-		{
-			if(node->position == oposition && !fd)
-			{
-				fd = node;
-				fd->position = iposition;
-				break;
-			}
-			node = node->next;
-		}while(h != node);
-		if(!fd)
-		{
-			return -2;
-		}
+}
 
-		if(fd == h)//head
-		{
-			*had = h = fd->next;
-		}
-		else if(h->prev != fd)//middle,so move the node to the end
-		{
-			node->prev->next = node->next;
-			node->next->prev = node->prev;
-			
-			h->prev->next = fd;
-			fd->prev = h->prev;
-			h->prev = fd;
-			fd->next = h;
-		}
-		else//If this is the last one, keep it
-		{
-		}
+/** Copy the frame to a segment, frames queued never move */
+static char *StoreSortFrame(SC_ssbuff *ssbuf, char *pframe, unsigned int frame_len, SC_sssegment **pseg)
+{
+	SC_sssegment *seg = ssbuf->cursegment;
+	if(frame_len > SORT_SEGMENT_DATA)
+	{
+		seg = AllocSortSegment(ssbuf, frame_len);
 	}
-	else//2 == type: only delete
+	else if(!seg || seg->size - seg->used < frame_len)
 	{
-		SC_frameaddr *fd = NULL;
-		SC_frameaddr *node = ad;
-		do
+		seg = AllocSortSegment(ssbuf, frame_len);
+		if(seg)
 		{
-			if(node->position == oposition && !fd)
+			/** Retire the full one, it is released after its frames are output */
+			if(ssbuf->cursegment && 0 == ssbuf->cursegment->refs)
 			{
-				fd = node;
-				node->prev->next = node->next;
-				node->next->prev = node->prev;
-				break;
+				ReleaseSortSegment(ssbuf, ssbuf->cursegment);
 			}
-			node = node->next;
-		}while(h != node);
-
-		if(!fd)
-		{
-			return -2;
-		}
-		if(fd == h)
-		{
-			*had = h = fd->next;
+			ssbuf->cursegment = seg;
 		}
-		
-		bfree(fd);
+	}
+	if(!seg)
+	{
+		return NULL;
 	}
 
-	return 0;
+	char *position = seg->data + seg->used;
+	memcpy(position, pframe, frame_len);
+	seg->used += frame_len;
+	seg->refs++;
+	*pseg = seg;
+	return position;
 }
 
-void printfsort(SC_ssbuff *ssbuf)
+static void FreeSortSegments(SC_ssbuff *ssbuf)
 {
-	_printd("buff_name=%s, userid=%s; \ndatasize=%u\n pdata=[%p]\n position=%u\n"
-			"maxtimestamp=%llu\n mintimestamp=%llu\n"
-			"uiPutFrameCount=%u\n u32PopFrameCount=%u\n"
-			"uiValidLen=%u\n uiSortTime=%u\n u32EarlyFrameCount=%u\n"
-			"u32LateFrameCount=%u\n freesize=%u\n",	
-	ssbuf->name.array, ssbuf->userid.array,		
-	ssbuf->datasize, ssbuf->pdata, ssbuf->position, 
-	ssbuf->maxtimestamp, ssbuf->mintimestamp,
-	ssbuf->uiPutFrameCount, ssbuf->u32PopFrameCount,
-	ssbuf->uiValidLen, ssbuf->uiSortTime, ssbuf->u32EarlyFrameCount,
-	ssbuf->u32LateFrameCount, ssbuf->freesize);
-
-#if 0
-	printf("\n#############################start###############################\n\n");
-	SC_ssnode *phead = ssbuf->phead;
-	while(phead)
+	SC_sssegment *seg = ssbuf->freesegment;
+	while(seg)
 	{
-		printf("position=%u timestamp=%llu len=%d\n", (unsigned int)(phead->position-ssbuf->pdata), phead->timestamp, phead->len);
-		phead = phead->next;
+		SC_sssegment *next = seg->next;
+		FreePoolBuff((char *)seg, sizeof(SC_sssegment) + seg->size);
+		seg = next;
 	}
-	printf("\n============================================================\n\n");
-	SC_frameaddr *frameaddr = ssbuf->frameaddr;
-	do
+	ssbuf->freesegment = NULL;
+	if(ssbuf->cursegment)
 	{
-		printf("position=%u\n", frameaddr->position);
-		frameaddr = frameaddr->next;
-	}while(ssbuf->frameaddr != frameaddr);
-	
-	printf("\n#############################end###############################\n\n");
-#endif
-
+		FreePoolBuff((char *)ssbuf->cursegment, sizeof(SC_sssegment) + ssbuf->cursegment->size);
+		ssbuf->cursegment = NULL;
+	}
+	ssbuf->uiSegmentSize = 0;
 }
 
-int CheckStreambuff(void **agrv, unsigned int frame_len)
+int DefaultStreamSortBuff(SC_ssbuff *pssbuf, unsigned int uiSize, unsigned int uiSortTime, unsigned int uiMaxSortTime)
 {
-	int ret = 0;
-	SC_ssbuff *ssbuf = (SC_ssbuff *)*agrv;
-	if(!ssbuf->frameaddr || ssbuf->uiPutFrameCount <= 2)
+	pssbuf->magic = 0x123456;
+	pssbuf->datasize = uiSize;
+	pssbuf->uiValidLen = 0;
+	pssbuf->uiPutFrameCount = 0;
+	pssbuf->uiSortTime = uiSortTime;
+	pssbuf->uiSortTimeBak = uiSortTime;
+	if(uiMaxSortTime < DEFAULT_SORT_TIME)
 	{
-		return 0;
+		pssbuf->uiMaxSortTime = DEFAULT_SORT_TIME;
+	}
+	else
+	{
+		pssbuf->uiMaxSortTime = uiMaxSortTime;
 	}
+	pssbuf->maxtimestamp = 0;
+	pssbuf->mintimestamp = 0;
+	pssbuf->u32PopFrameCount = 0;
+	pssbuf->u32LateFrameCount = 0;
+	pssbuf->u32EarlyFrameCount = 0;
+	pssbuf->analytime = os_gettime_ns();
+	return 0;
+}
 
-	unsigned int earliest = ssbuf->frameaddr->position;
-	unsigned int willposi_s = ssbuf->position;
-	unsigned int willposi_e = willposi_s + frame_len;
-	unsigned int datasize = 0, freesize = 0;
-	int tooloog = 0;
-	if(willposi_e <= ssbuf->datasize)
+void *pCreateStreamSort(RegisterSortInfo *info)
+{
+	if(!info || info->uiSize < MIM_SORT_BUFF_LEN || !info->Datacallback)
 	{
-		if(earliest >= willposi_s && earliest <= willposi_e)
-		{
-			_printd("earliest=%u willposi_s=%u willposi_e=%u", earliest, willposi_s, willposi_e);
-			blog(MGW_LOG_INFO, "earliest=%u willposi_s=%u willposi_e=%u", earliest, willposi_s, willposi_e);
-			tooloog = 1;//check buff too small
-		}
+		return NULL;
 	}
-	else
+	SC_ssbuff *pssbuf = (SC_ssbuff *)bzalloc(sizeof(SC_ssbuff));
+	DefaultStreamSortBuff(pssbuf, info->uiSize, info->uiSortTime, info->uiMaxSortTime);
+	pssbuf->puser = info->puser;
+	dstr_copy_dstr(&pssbuf->name, &info->name);
+	dstr_copy_dstr(&pssbuf->userid, &info->userid);
+	pssbuf->Datacallback = info->Datacallback;
+	pssbuf->pool = CreateSortPool(info->uiNodeCount > 0 ? info->uiNodeCount : SORT_NODE_POOL_SIZE);
+	if(!pssbuf->pool)
 	{
-#if 0
-		willposi_e -= ssbuf->datasize;
-		if(earliest >= willposi_s || earliest <= willposi_e)
-		{
-			_printd("===========earliest=%u willposi_s=%u willposi_e=%u", earliest, willposi_s, willposi_e);
-			tooloog = 1;
-		}
-#endif
-		willposi_e = frame_len;
-		if(earliest >= willposi_s || earliest <= willposi_e)
-		{
-			_printd("earliest=%u willposi_s=%u willposi_e=%u", earliest, willposi_s, willposi_e);
-			blog(MGW_LOG_INFO, "earliest=%u willposi_s=%u willposi_e=%u", earliest, willposi_s, willposi_e);
-			tooloog = 1;//check buff too small
-		}
-
-		unsigned long long tdef = time(NULL);
-		//check AnalyTime
-		if(tdef - ssbuf->analytime >= 5*60)
-		{
-			_printd("buff_name=%s, userid=%s; uiAnalyTime=====%u", ssbuf->name.array, ssbuf->userid.array, ssbuf->uiAnalyTime);
-			blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; uiAnalyTime=%u, now uiSortTime=%u", ssbuf->name.array, ssbuf->userid.array, ssbuf->uiAnalyTime, ssbuf->uiSortTime);
-			if(ssbuf->uiAnalyTime < ssbuf->uiSortTime && ssbuf->uiAnalyTime > 0)
-			{
-				unsigned int defTime = ssbuf->uiSortTime - ssbuf->uiAnalyTime;
-				if(defTime > 200000)
-				{
-					ssbuf->uiSortTime -= 200000;//һ������200ms 
-				}
-				if(defTime > 100000)
-				{
-					ssbuf->uiSortTime -= 100000;//һ������100ms 
-				}
-				else
-				{
-					ssbuf->uiSortTime = ssbuf->uiAnalyTime;
-				}
+		dstr_free(&pssbuf->name);
+		dstr_free(&pssbuf->userid);
+		bfree(pssbuf);
+		return NULL;
+	}
+	ResetSortPool(pssbuf->pool);
+	return (void *)pssbuf;
+}
 
-				if(ssbuf->uiSortTime < ssbuf->uiSortTimeBak)
-				{
-					ssbuf->uiSortTime = ssbuf->uiSortTimeBak;
-				}
-			}
-			ssbuf->uiAnalyTime = 0;
-			ssbuf->analytime = tdef;//���¼���ʱ��
-		}
+int FillTheNode(SC_ssnode *nd, char *position, unsigned int frame_len, unsigned long long timestamp, char frametype, int priority)
+{
+	nd->frametype = frametype;
+	nd->len = frame_len;
+	nd->position = position;
+	nd->timestamp = timestamp;
+    nd->priority = priority;
+	return 0;
+}
 
-		//check buff too big
-		if(!tooloog && tdef - ssbuf->analytime >= 15*60)
-		{
-			ssbuf->freetime = tdef;
-			unsigned int newsize = ssbuf->datasize/2;
-			if(MIM_SORT_BUFF_LEN < newsize && ssbuf->freesize > newsize)//һ�����
-			{
-				_printd("buff is too big, will remalloc, freesize=%u, %u", ssbuf->freesize, newsize);
-				blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; buff is too big, will remalloc, freesize=%u, %u",
-                            ssbuf->name.array, ssbuf->userid.array, ssbuf->freesize, newsize);
-				void *rf = RemallocSortBuff(ssbuf, newsize);
-				if(rf)
-				{
-					*agrv = rf;
-					ssbuf = (SC_ssbuff *)*agrv;
-					ret = 1;
-				}
-			}
-#if 0
-			unsigned int newsize = 0;
-			if(earliest < willposi_e)
-			{
-				datasize = ssbuf->datasize - willposi_e + earliest;
-				newsize = ssbuf->datasize/2;
-				if(MIM_SORT_BUFF_LEN < newsize && datasize > newsize)//һ�����
-				{
-					_printd("buff is too big, will remalloc, %u", newsize);
-					void *rf = RemallocSortBuff(ssbuf, newsize);
-					if(rf)
-					{
-						*agrv = rf;
-						ssbuf = (SC_ssbuff *)*agrv;
-						ret = 1;
-					}
-				}
-			}
-			else if(earliest > willposi_e)
-			{
-				datasize = earliest - willposi_e;
-				newsize = ssbuf->datasize/2;
-				if(MIM_SORT_BUFF_LEN < newsize && datasize > newsize)//һ�����
-				{
-					_printd("buff is too big, will remalloc, %u", newsize);
-					void *rf = RemallocSortBuff(ssbuf, newsize);
-					if(rf)
-					{
-						*agrv = rf;
-						ssbuf = (SC_ssbuff *)*agrv;
-						ret = 1;
-					}
-				}
-			}
-#endif
-		}
-	}
-	if(tooloog)//check buff too small
+void CleanSortBuff(SC_ssbuff *pssbuf)
+{
+	SC_sspool *pool = pssbuf->pool;
+	unsigned int i;
+	for(i = 0; i < pool->uiHeapSize; i++)
 	{
-		if(ssbuf->datasize > MAX_SORT_BUFF_LEN)
-		{
-			_printd("Address to repeat;will clean buff");
-			blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; Address to repeat;Valid data [%u], will clean buff",
-                        ssbuf->name.array, ssbuf->userid.array, ssbuf->uiValidLen);
-			printfsort(ssbuf);
-			CleanSortBuff(ssbuf);
-		}
-		else
-		{
-			datasize = ssbuf->datasize*3/2;
-			_printd("Address to repeat;Valid data [%u], will remalloc, %u:%u", ssbuf->uiValidLen, datasize, ssbuf->datasize);
-			blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; Address to repeat;Valid data [%u], will remalloc, %u:%u",
-                            ssbuf->name.array, ssbuf->userid.array, ssbuf->uiValidLen, datasize, ssbuf->datasize);
-			printfsort(ssbuf);
-			void *rf = RemallocSortBuff(ssbuf, datasize);
-			if(!rf)
-			{
-				_printd("Address to repeat, will clean buff");
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; Address to repeat, will clean buff", ssbuf->name.array, ssbuf->userid.array);
-				printfsort(ssbuf);
-				CleanSortBuff(ssbuf);
-			}
-			*agrv = rf;
-			ssbuf = (SC_ssbuff *)*agrv;
-			ret = 1;
-		}
+		PutSortSegment(pssbuf, pool->heap[i]->segment);
 	}
-	else
-	{
-		freesize = ssbuf->freesize;
-		if(earliest < willposi_e)
-		{
-			freesize = ssbuf->datasize - willposi_e + earliest;
-		}
-		else if(earliest > willposi_e)
-		{
-			freesize = earliest - willposi_e;
-		}
+	ResetSortPool(pool);
+	pssbuf->uiValidLen = 0;
+	pssbuf->uiPutFrameCount = 0;
+	pssbuf->maxtimestamp = 0;
+	pssbuf->mintimestamp = 0;
+	pssbuf->premintimestamp = 0;
+	pssbuf->u32PopFrameCount = 0;
+	pssbuf->u32LateFrameCount = 0;
+	pssbuf->u32EarlyFrameCount = 0;
+	pssbuf->uiAnalyTime = 0;
+	pssbuf->analytime = os_gettime_ns();
+	pssbuf->uiSortTime = pssbuf->uiSortTimeBak;
 
-		if(ssbuf->freesize > freesize)
-		{
-			ssbuf->freesize = freesize;
-		}
+	return;
+}
 
+void printfsort(SC_ssbuff *ssbuf)
+{
+	_printd("buff_name=%s, userid=%s; \ndatasize=%u\n segmentsize=%u\n"
+			"maxtimestamp=%llu\n mintimestamp=%llu\n"
+			"uiPutFrameCount=%u\n u32PopFrameCount=%u\n"
+			"uiValidLen=%u\n uiSortTime=%u\n u32EarlyFrameCount=%u\n"
+			"u32LateFrameCount=%u\n pending=%u\n poolpeak=%u/%u\n poolexhausted=%u\n",
+	ssbuf->name.array, ssbuf->userid.array,
+	ssbuf->datasize, ssbuf->uiSegmentSize,
+	ssbuf->maxtimestamp, ssbuf->mintimestamp,
+	ssbuf->uiPutFrameCount, ssbuf->u32PopFrameCount,
+	ssbuf->uiValidLen, ssbuf->uiSortTime, ssbuf->u32EarlyFrameCount,
+	ssbuf->u32LateFrameCount, ssbuf->pool->uiHeapSize,
+	ssbuf->pool->uiPeakUsed, ssbuf->pool->uiCapacity, ssbuf->pool->uiExhausted);
+}
+
+int GetStreamSortStats(void *agrv, SortStatsInfo *stats)
+{
+	SC_ssbuff *ssbuf = (SC_ssbuff *)agrv;
+	if(!ssbuf || !stats)
+	{
+		return -1;
 	}
-	return ret;
+	stats->uiPutFrameCount = ssbuf->uiPutFrameCount;
+	stats->uiPopFrameCount = ssbuf->u32PopFrameCount;
+	stats->uiLateFrameCount = ssbuf->u32LateFrameCount;
+	stats->uiEarlyFrameCount = ssbuf->u32EarlyFrameCount;
+	stats->uiPending = ssbuf->pool->uiHeapSize;
+	stats->uiSortTime = ssbuf->uiSortTime;
+	stats->uiSegmentSize = ssbuf->uiSegmentSize;
+	stats->uiPoolCapacity = ssbuf->pool->uiCapacity;
+	stats->uiPoolPeak = ssbuf->pool->uiPeakUsed;
+	stats->uiPoolExhausted = ssbuf->pool->uiExhausted;
+	return 0;
 }
 
 void DelectStreamSort(void *agrv)
 {
 	SC_ssbuff *ssbuf = (SC_ssbuff *)agrv;
 	CleanSortBuff(ssbuf);
+	FreeSortSegments(ssbuf);
+	DeleteSortPool(ssbuf->pool);
     dstr_free(&ssbuf->name);
     dstr_free(&ssbuf->userid);
-	
+
 	bfree(ssbuf);
 }
 
@@ -658,81 +488,152 @@ void CleanStreamSort(void *agrv)
 	CleanSortBuff(ssbuf);
 }
 
-int PopFrameStreamSort(SC_ssbuff *ssbuf)
+/** Output the earliest frame, it is dropped if callback failed, a frame kept
+ *  at the heap top would fail again and hold all later frames in sort */
+static int OutputSortFrame(SC_ssbuff *ssbuf)
 {
+	SC_sspool *pool = ssbuf->pool;
+	SC_ssnode *nd = pool->heap[0];
 	sc_sortframe oframe;
-	SC_ssnode *nd = NULL;
-	unsigned int timedef = 0;
-	unsigned int oposition = 0;
-	int i = 0, ret = 0;
-	while(i++ < 2)
+	oframe.frame = nd->position;
+	oframe.frame_len = nd->len;
+	oframe.frametype = nd->frametype;
+	oframe.timestamp = nd->timestamp;
+	oframe.priority  = nd->priority;
+	int ret = ssbuf->Datacallback(ssbuf->puser, &oframe);
+	if(ret < 0)
+	{
+		_printd("buff_name=%s, userid=%s; Datacallback return err:%d", ssbuf->name.array, ssbuf->userid.array,ret);
+		blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; Datacallback return err:%d, drop the frame of %llu",
+			ssbuf->name.array, ssbuf->userid.array, ret, nd->timestamp);
+	}
+
+	HeapPop(pool);
+	ssbuf->premintimestamp = nd->timestamp;
+	ssbuf->uiValidLen -= nd->len;
+	ssbuf->u32PopFrameCount++;
+	PutSortSegment(ssbuf, nd->segment);
+	FreeSortNode(pool, nd);
+	ssbuf->mintimestamp = pool->uiHeapSize ? pool->heap[0]->timestamp : ssbuf->maxtimestamp;
+	return ret < 0 ? ret : 0;
+}
+
+/** Output the frames which waited longer than sort time, return the last error of them */
+int PopFrameStreamSort(SC_ssbuff *ssbuf)
+{
+	SC_sspool *pool = ssbuf->pool;
+	int ret = 0;
+	while(pool->uiHeapSize > 0 &&
+		ssbuf->maxtimestamp - pool->heap[0]->timestamp > ssbuf->uiSortTime)
 	{
-		if(ssbuf->uiPutFrameCount - ssbuf->u32PopFrameCount <= 3)
+		int err = OutputSortFrame(ssbuf);
+		if(err < 0)
 		{
-			break;
+			ret = err;
+		}
+	}
+	return ret;
+}
+
+/** Output all waiting frames, used before passing a frame straight through */
+static void FlushStreamSort(SC_ssbuff *ssbuf)
+{
+	while(ssbuf->pool->uiHeapSize > 0)
+	{
+		OutputSortFrame(ssbuf);
+	}
+}
+
+/** Output a frame earlier than all waiting ones without copying it */
+static int PassFrameStreamSort(SC_ssbuff *ssbuf, sc_sortframe *iframe)
+{
+	int ret = ssbuf->Datacallback(ssbuf->puser, iframe);
+	if(ret < 0)
+	{
+		_printd("buff_name=%s, userid=%s; Datacallback return err:%d", ssbuf->name.array, ssbuf->userid.array,ret);
+		return ret;
+	}
+	ssbuf->uiPutFrameCount++;
+	ssbuf->u32PopFrameCount++;
+	ssbuf->premintimestamp = iframe->timestamp;
+	if(iframe->timestamp > ssbuf->maxtimestamp)
+	{
+		ssbuf->maxtimestamp = iframe->timestamp;
+	}
+	ssbuf->mintimestamp = ssbuf->pool->uiHeapSize ? ssbuf->pool->heap[0]->timestamp : ssbuf->maxtimestamp;
+	return 0;
+}
+
+/** Frames waiting are forced out to make room, never the ones later than the new frame */
+static inline bool SortFrameFirst(SC_ssbuff *ssbuf, sc_sortframe *iframe)
+{
+	return ssbuf->pool->uiHeapSize > 0 && iframe->timestamp < ssbuf->pool->heap[0]->timestamp;
+}
+
+/** Widen sort time just enough to reorder the disorder seen */
+static void WidenSortTime(SC_ssbuff *ssbuf, unsigned int disorder)
+{
+	if(ssbuf->uiAnalyTime < disorder)
+	{
+		ssbuf->uiAnalyTime = disorder;
+	}
+	if(disorder <= ssbuf->uiSortTime)
+	{
+		return;
+	}
+	if(disorder > ssbuf->uiMaxSortTime)
+	{
+		disorder = ssbuf->uiMaxSortTime;
+	}
+	_printd("buff_name=%s, userid=%s; Delay increase, uiSortTime %u -> %u us",
+		ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, disorder);
+	blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; Delay increase, uiSortTime %u -> %u us",
+		ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, disorder);
+	ssbuf->uiSortTime = disorder;
+}
+
+/** Shrink sort time towards the disorder seen in the last period */
+static void DecaySortTime(SC_ssbuff *ssbuf, unsigned long long now)
+{
+	if(now - ssbuf->analytime < SORT_DECAY_PERIOD*SORT_NSEC_PER_SEC)
+	{
+		return;
+	}
+	if(ssbuf->uiAnalyTime < ssbuf->uiSortTime)
+	{
+		unsigned int sorttime = ssbuf->uiSortTime / 2;
+		if(sorttime < ssbuf->uiAnalyTime)
+		{
+			sorttime = ssbuf->uiAnalyTime;
 		}
-		
-		timedef = ssbuf->maxtimestamp - ssbuf->mintimestamp;
-		if(timedef > ssbuf->uiSortTime)
+		if(sorttime < SORT_TIME_MIN)
 		{
-			nd = ssbuf->phead;
-			oposition = nd->position - ssbuf->pdata;
-			if((ret = CFrameaddrList((void **)&ssbuf->frameaddr, 0, oposition, 2)) < 0)//�����ַList��Ӧ�ڵ�
-			{
-				_printd("CFrameaddrList return err:%d", ret);
-				blog(MGW_LOG_INFO,"CFrameaddrList return err:%d", ret);
-				if(ret < 0)
-				{
-					break;
-				}
-			}
-			oframe.frame = nd->position;
-			oframe.frame_len = nd->len;
-			oframe.frametype = nd->frametype;
-			oframe.timestamp = nd->timestamp;
-            oframe.priority  = nd->priority;
-			ssbuf->premintimestamp = nd->timestamp;
-			ret = ssbuf->Datacallback(ssbuf->puser, &oframe);
-			if(ret < 0)
-			{
-				return ret;
-			}
-			ssbuf->uiValidLen -= nd->len;
-			ssbuf->phead = nd->next;
-			ssbuf->u32PopFrameCount++;
-			if(nd == nd->prev)
-			{
-				ssbuf->phead->prev = ssbuf->phead;
-			}
-			else
-			{
-				ssbuf->phead->prev = nd->prev;//ssbuf->phead;
-			}
-			//nd->prev->next = ssbuf->phead;
-			nd->position = NULL;
-			bfree(nd);
-			
-			ssbuf->mintimestamp = ssbuf->phead->timestamp;
+			sorttime = 0;
 		}
-		else
+		if(sorttime < ssbuf->uiSortTimeBak)
 		{
-			break;
+			sorttime = ssbuf->uiSortTimeBak;
+		}
+		if(sorttime != ssbuf->uiSortTime)
+		{
+			blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; Delay decrease, max disorder=%u us, uiSortTime %u -> %u us",
+				ssbuf->name.array, ssbuf->userid.array, ssbuf->uiAnalyTime, ssbuf->uiSortTime, sorttime);
+			ssbuf->uiSortTime = sorttime;
 		}
 	}
-
-	return 0;
+	ssbuf->uiAnalyTime = 0;
+	ssbuf->analytime = now;
 }
 
 int PutFrameStreamSort(void **agrv, sc_sortframe *piframe)
 {
 	SC_ssbuff *ssbuf = (SC_ssbuff *)*agrv;
-	sc_sortframe *iframe = piframe;	
-	int ret = 0, revl = 0;
+	sc_sortframe *iframe = piframe;
 	SC_ssnode *nd = NULL;
+	SC_sspool *pool = NULL;
 
-	unsigned int position = 0;
+	char *position = NULL;
 	unsigned int timedef = 0;
-	unsigned long long alatime = 0;
 	if(iframe->frame_len >= (ssbuf->datasize/2))
 	{
 		_printd("buff_name=%s, userid=%s; the frame is too big, len=%d/%d", ssbuf->name.array, ssbuf->userid.array, iframe->frame_len, ssbuf->datasize);
@@ -740,44 +641,14 @@ int PutFrameStreamSort(void **agrv, sc_sortframe *piframe)
 		return -1;
 	}
 
-	if(CheckStreambuff(agrv, iframe->frame_len))
-	{
-		ssbuf = (SC_ssbuff *)*agrv;
-	}
-	
-	if(!ssbuf->phead)
+	DecaySortTime(ssbuf, os_gettime_ns());
+	if(0 == ssbuf->uiPutFrameCount)
 	{
-		nd = (SC_ssnode*)calloc(1, sizeof(SC_ssnode));
-		if(!nd)
-		{
-			return -1;
-		}
-		//ssbuf->position = iframe->frame_len;
-		ssbuf->uiPutFrameCount = 1;
-		ssbuf->uiValidLen = iframe->frame_len;
 		ssbuf->maxtimestamp = iframe->timestamp;
 		ssbuf->mintimestamp = iframe->timestamp;
-		ssbuf->premintimestamp = ssbuf->mintimestamp;
-		ssbuf->phead = nd;
-		MemcpyToSortBuff(ssbuf, iframe->frame, iframe->frame_len);
-		FillTheNode(nd, ssbuf->pdata, iframe->frame_len, iframe->timestamp, iframe->frametype, iframe->priority);
-		nd->prev = nd;
-		nd->next = NULL;
-		if((revl = CFrameaddrList((void **)&ssbuf->frameaddr, 0, 0, 0)) < 0)
-		{
-			_printd("buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array, revl);
-			blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array, revl);
-			if(revl < 0)
-			{
-				ssbuf->phead = NULL;
-				bfree(nd);
-				return -1;
-			}
-		}
-		return 0;
+		ssbuf->premintimestamp = iframe->timestamp;
 	}
-
-	if(iframe->timestamp < ssbuf->maxtimestamp)
+	else if(iframe->timestamp < ssbuf->maxtimestamp)
 	{
 		timedef = ssbuf->maxtimestamp - iframe->timestamp;
  		if(timedef > ssbuf->uiMaxSortTime)
@@ -786,11 +657,11 @@ int PutFrameStreamSort(void **agrv, sc_sortframe *piframe)
 			ssbuf->u32LateFrameDrop++;
 			if(0 == (ssbuf->u32LateFrameCount % 50))
 			{
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; time:%llu is too late!! %llu -%llu=%u is larger than %d, drop %u", 
+				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; time:%llu is too late!! %llu -%llu=%u is larger than %d, drop %u",
 								ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, ssbuf->maxtimestamp,
 								iframe->timestamp, timedef, ssbuf->uiMaxSortTime, ssbuf->u32LateFrameCount);
 				_printd("buff_name=%s, userid=%s; time:%llu is too late!! %llu -%llu=%u is larger than %d, drop %u",
-								ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, ssbuf->maxtimestamp, 
+								ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, ssbuf->maxtimestamp,
 								iframe->timestamp, timedef, ssbuf->uiMaxSortTime, ssbuf->u32LateFrameCount);
 			}
 			if(ssbuf->u32LateFrameDrop > 60)
@@ -803,226 +674,118 @@ int PutFrameStreamSort(void **agrv, sc_sortframe *piframe)
 		{
 			ssbuf->u32LateFrameDrop = 0;
 		}
-		//��ֹʱ�䷴ת
+
+		WidenSortTime(ssbuf, timedef);
+		/** A later frame has been output, the order can not be kept */
 		if(ssbuf->premintimestamp > iframe->timestamp)
 		{
 			ssbuf->u32LateFrameCount++;
 			ssbuf->u32LateFrameDrop++;
  			_printd("buff_name=%s, userid=%s; time:%llu is too late!! premin=%llu;, drop %u",
                     ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, ssbuf->premintimestamp, ssbuf->u32LateFrameCount);
-#if 0
-			tlog(TMGW_LOG_ERROR, "buff_name=%s, userid=%s; time:%llu is too late!! premin=%llu;, drop %u", ssbuf->name, ssbuf->userid, iframe->timestamp, ssbuf->premintimestamp, \
-				ssbuf->u32LateFrameCount);
-#endif
-
-			if(iframe->timestamp < ssbuf->mintimestamp)
-			{
-				//��������ʱ��
-				timedef = ssbuf->mintimestamp - iframe->timestamp;
-				if(ssbuf->uiSortTime + timedef < ssbuf->uiMaxSortTime)
-				{
-					if(timedef > 60000)
-					{
-						timedef = 20000;
-					}
-					ssbuf->uiSortTime += timedef;
-					//ssbuf->uiAnalyTime = ssbuf->uiSortTime;
-					unsigned long long nowtime = time(NULL);
-					_printd("buff_name=%s, userid=%s; Delay increase,now uiSortTime=%u us, will add %u us", 
-						ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, timedef);
-					if(nowtime - ssbuf->analytime >= 2)//��ֹ��־����
-					{
-						blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; Delay increase,now uiSortTime=%u us, will add %u us", 
-							ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, timedef);
-					}
-					ssbuf->analytime = nowtime;//���¼���ʱ��
-					ssbuf->uiAnalyTime = 0;
-				}
-			}
-			else
-			{
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s;the sort err, premin=%llu, nowmin=%llu, recvtime=%llu", \
-					ssbuf->name.array, ssbuf->userid.array, ssbuf->premintimestamp, ssbuf->mintimestamp, iframe->timestamp);
-			}
 			return -1;
 		}
-		
-		nd = (SC_ssnode*)calloc(1, sizeof(SC_ssnode));
-		if(!nd)
-		{
-			return -1;
-		}
-		position = MemcpyToSortBuff(ssbuf, iframe->frame, iframe->frame_len);		
-		FillTheNode(nd, ssbuf->pdata + position, iframe->frame_len, iframe->timestamp, iframe->frametype, iframe->priority);
-		if((revl = CFrameaddrList((void **)&ssbuf->frameaddr, position, 0, 0)) < 0)
-		{
-			_printd("buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array, revl);
-			blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array, revl);
-			if(revl < 0)
-			{
-				bfree(nd);
-				return -1;
-			}
-		}	
-		
-		ssbuf->uiValidLen += iframe->frame_len;
-		ssbuf->uiPutFrameCount++;
-		if(iframe->timestamp < ssbuf->mintimestamp)
-		{
-			//��������ʱ��
-			timedef = ssbuf->mintimestamp - iframe->timestamp;
-			if(ssbuf->uiSortTime + timedef < ssbuf->uiMaxSortTime)
-			{
-				if(timedef > 60000)
-				{
-					timedef = 20000;
-				}
-				ssbuf->uiSortTime += timedef;
-				//ssbuf->uiAnalyTime = ssbuf->uiSortTime;
-				unsigned long long nowtime = time(NULL);
-				_printd("buff_name=%s, userid=%s; Delay increase,uiSortTime=%u us, timedef=%u us", 
-					ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, timedef);
-				if(nowtime - ssbuf->analytime >= 2)//��ֹ��־����
-				{
-					blog(MGW_LOG_INFO, "buff_name=%s, userid=%s; Delay increase,now uiSortTime=%u us, will add timedef=%u us", 
-						ssbuf->name.array, ssbuf->userid.array, ssbuf->uiSortTime, timedef);
-				}
-				ssbuf->analytime = nowtime;//���¼���ʱ��
-				ssbuf->uiAnalyTime = 0;
-			}
-			
-			nd->prev = ssbuf->phead->prev;
-			nd->next = ssbuf->phead;
-			ssbuf->phead->prev = nd;
-			ssbuf->phead = nd;
-			ssbuf->mintimestamp = iframe->timestamp;
-		}
-		else
-		{
-			//mintimestamp < timestamp < maxtimestamp
-			nd->timestamp = iframe->timestamp;
-			alatime = InsertSortMiddle(ssbuf->phead, nd);
-			if(alatime)
-			{
-				timedef = ssbuf->maxtimestamp - alatime;
-				if(ssbuf->uiAnalyTime < timedef)
-				{
-					ssbuf->uiAnalyTime = timedef;
-				}
-			}
-		}
-
-//		_printd("max-min=%llu", ssbuf->maxtimestamp-ssbuf->mintimestamp);
-		//printfsort(ssbuf);
-		return 0;
 	}
 	else
 	{
 		timedef = iframe->timestamp - ssbuf->maxtimestamp;
- 		if(timedef >= ssbuf->uiMaxSortTime)//ʱ����������
+ 		if(timedef >= ssbuf->uiMaxSortTime)
  		{
 			ssbuf->u32EarlyFrameCount++;
 			ssbuf->u32EarlyFrameDrop++;
-			
+
 			if(0 == (ssbuf->u32EarlyFrameCount % 50))
 			{
-	 			_printd("buff_name=%s, userid=%s; time:%llu is too early !! %llu - %llu=%u, drop %u", 
+	 			_printd("buff_name=%s, userid=%s; time:%llu is too early !! %llu - %llu=%u, drop %u",
 					ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, iframe->timestamp, ssbuf->mintimestamp, \
 					timedef, ssbuf->u32EarlyFrameCount);
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; time:%llu is too early !! %llu - %llu=%u, drop %u", 
+				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; time:%llu is too early !! %llu - %llu=%u, drop %u",
 					ssbuf->name.array, ssbuf->userid.array, iframe->timestamp, iframe->timestamp, ssbuf->mintimestamp, \
 					timedef, ssbuf->u32EarlyFrameCount);
 			}
-			//printfsort(ssbuf);
 			if(ssbuf->u32EarlyFrameDrop > 60 || timedef > 10000000)
 			{
 				CleanStreamSort(ssbuf);
 				ssbuf->u32EarlyFrameDrop = 0;
 				return -1;
 			}
-//			return -1;
 		}
 		else
 		{
 			ssbuf->u32EarlyFrameDrop = 0;
 		}
-		position = MemcpyToSortBuff(ssbuf, iframe->frame, iframe->frame_len);//��Ҫ����ƶ�λ��
-		nd = ssbuf->phead;
-		timedef = iframe->timestamp - ssbuf->mintimestamp;//Ŀǰ���������ʱ���
-		if(timedef > ssbuf->uiSortTime && nd && nd->next)//�������Ҫ��
-		{
-//			_printd("max-min=%llu", timedef);
-			unsigned int oposition = nd->position - ssbuf->pdata;
-			if((revl = CFrameaddrList((void **)&ssbuf->frameaddr, position, oposition, 1)) < 0)
-			{
-				_printd("buff_name=%s, userid=%s; oposition=%u; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array,oposition, revl);
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; oposition=%u; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array,oposition, revl);
-				if(revl < 0)
-				{
-					return -1;
-				}
-			}
+	}
 
-			sc_sortframe oframe;
-			oframe.frame = nd->position;
-			oframe.frame_len = nd->len;
-			oframe.frametype = nd->frametype;
-			oframe.timestamp = nd->timestamp;
-            oframe.priority  = nd->priority;
-			ssbuf->premintimestamp = nd->timestamp;
-			ret = ssbuf->Datacallback(ssbuf->puser, &oframe);
-			if(ret < 0)
-			{
-				_printd("buff_name=%s, userid=%s; Datacallback return err:%d", ssbuf->name.array, ssbuf->userid.array,ret);
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; Datacallback return err:%d", ssbuf->name.array, ssbuf->userid.array,ret);
-				//return ret;
-			}
-			
-			ssbuf->uiValidLen -= nd->len;
-			ssbuf->phead = nd->next;
-			ssbuf->u32PopFrameCount++;
+	/** Ordered with sort time closed, nothing to wait for */
+	if(0 == ssbuf->uiSortTime && iframe->timestamp >= ssbuf->maxtimestamp)
+	{
+		FlushStreamSort(ssbuf);
+		return PassFrameStreamSort(ssbuf, iframe);
+	}
 
-			nd->position = NULL;
-			ssbuf->mintimestamp = ssbuf->phead->timestamp;
-			
-			ret = 1;
-		}
-		else
+	pool = ssbuf->pool;
+
+	/** Pool exhausted, output the earliest frames to make room */
+	if(!pool->uiFreeCount)
+	{
+		pool->uiExhausted++;
+		if(1 == (pool->uiExhausted % 100))
 		{
-			nd = (SC_ssnode*)calloc(1, sizeof(SC_ssnode));
-			if(!nd)
-			{
-				return -1;
-			}
-			ret = 0;
-			if((revl = CFrameaddrList((void **)&ssbuf->frameaddr, position, 0, 0)) < 0)
-			{
-				_printd("buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array,revl);
-				blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; CFrameaddrList return err:%d", ssbuf->name.array, ssbuf->userid.array,revl);
-				if(revl < 0)
-				{
-					bfree(nd);
-					return -1;
-				}
-			}
+			blog(MGW_LOG_WARNING, "buff_name=%s, userid=%s; sort node pool exhausted %u times, capacity=%u, uiSortTime=%u",
+				ssbuf->name.array, ssbuf->userid.array, pool->uiExhausted, pool->uiCapacity, ssbuf->uiSortTime);
 		}
-		ssbuf->uiValidLen += iframe->frame_len;
-		//position = ssbuf->position - iframe->frame_len;
-		FillTheNode(nd, ssbuf->pdata + position, iframe->frame_len, iframe->timestamp, iframe->frametype, iframe->priority);
-		InsertSortEnd(ssbuf->phead, nd);
-		ssbuf->uiPutFrameCount++;
-		ssbuf->maxtimestamp = iframe->timestamp;
-		
-		if(0 == ssbuf->uiPutFrameCount%1000)
+	}
+	while(!pool->uiFreeCount && pool->uiHeapSize > 0)
+	{
+		if(SortFrameFirst(ssbuf, iframe))
 		{
-			printfsort(ssbuf);
+			return PassFrameStreamSort(ssbuf, iframe);
 		}
+		OutputSortFrame(ssbuf);
+	}
+	nd = AllocSortNode(pool);
+	if(!nd)
+	{
+		_printd("buff_name=%s, userid=%s; sort node pool exhausted, drop frame", ssbuf->name.array, ssbuf->userid.array);
+		return -1;
+	}
 
-		if(ret > 0)
-		{
-			ret = PopFrameStreamSort(ssbuf);
-		}
-		return ret;
+	/** Segments used up, output the earliest frames until one is free */
+	while(!(position = StoreSortFrame(ssbuf, iframe->frame, iframe->frame_len, &nd->segment)) &&
+		pool->uiHeapSize > 0 && !SortFrameFirst(ssbuf, iframe))
+	{
+		OutputSortFrame(ssbuf);
+	}
+	if(!position && SortFrameFirst(ssbuf, iframe))
+	{
+		FreeSortNode(pool, nd);
+		return PassFrameStreamSort(ssbuf, iframe);
 	}
-	
+	if(!position)
+	{
+		_printd("buff_name=%s, userid=%s; no segment for the frame, len=%u, segmentsize=%u",
+			ssbuf->name.array, ssbuf->userid.array, iframe->frame_len, ssbuf->uiSegmentSize);
+		blog(MGW_LOG_ERROR, "buff_name=%s, userid=%s; no segment for the frame, len=%u, segmentsize=%u",
+			ssbuf->name.array, ssbuf->userid.array, iframe->frame_len, ssbuf->uiSegmentSize);
+		FreeSortNode(pool, nd);
+		return -1;
+	}
+	FillTheNode(nd, position, iframe->frame_len, iframe->timestamp, iframe->frametype, iframe->priority);
+	nd->seq = ssbuf->uiPutFrameCount;
+	HeapPush(pool, nd);
+
+	ssbuf->uiValidLen += iframe->frame_len;
+	ssbuf->uiPutFrameCount++;
+	if(iframe->timestamp > ssbuf->maxtimestamp)
+	{
+		ssbuf->maxtimestamp = iframe->timestamp;
+	}
+	ssbuf->mintimestamp = pool->heap[0]->timestamp;
+
+	if(0 == ssbuf->uiPutFrameCount%1000)
+	{
+		printfsort(ssbuf);
+	}
+
+	return PopFrameStreamSort(ssbuf);
 }
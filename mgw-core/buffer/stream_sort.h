@@ -11,7 +11,6 @@ extern "C"{
 #define _printd(fmt, ...)	printf ("[%s][%d]"fmt"\n", (char *)strrchr(__FILE__, '\\')?(strrchr(__FILE__, '/') + 1):__FILE__, __LINE__, ##__VA_ARGS__)
 
 #define SORT_SIZE_DEF	4*1024*1024
-#define SORT_TIME_DEF	20*1000
 
 typedef struct _sc_sortframe_
 {
@@ -27,18 +26,42 @@ typedef int (*SortDataCallback)(void *puser, sc_sortframe *oframe);
 typedef struct
 {
 	unsigned int uiSize;
+	/** Floor of sort time in us, it widens with the disorder seen and decays
+	 *  back, 0 passes ordered frames straight through */
 	unsigned int uiSortTime;
 	unsigned int uiMaxSortTime;
+	/** Max frames waiting in sort, 0 for the default */
+	unsigned int uiNodeCount;
 	struct dstr name;
 	struct dstr userid;
 	void *puser;
 	SortDataCallback Datacallback;
 }RegisterSortInfo;
 
+typedef struct
+{
+	unsigned int uiPutFrameCount;
+	unsigned int uiPopFrameCount;
+	unsigned int uiLateFrameCount;
+	unsigned int uiEarlyFrameCount;
+	/** Frames waiting in sort */
+	unsigned int uiPending;
+	unsigned int uiSortTime;
+	/** Bytes of segments the frames stored in */
+	unsigned int uiSegmentSize;
+	unsigned int uiPoolCapacity;
+	/** Most frames waiting at the same time */
+	unsigned int uiPoolPeak;
+	/** Count frames found the node pool exhausted, each of them forced
+	 *  the earliest frame out before its sort time */
+	unsigned int uiPoolExhausted;
+}SortStatsInfo;
+
 void *pCreateStreamSort(RegisterSortInfo *info);
 void DelectStreamSort(void *agrv);
 void CleanStreamSort(void *agrv);
 int PutFrameStreamSort(void **agrv, sc_sortframe *iframe);
+int GetStreamSortStats(void *agrv, SortStatsInfo *stats);
 
 #ifdef __cplusplus
 }
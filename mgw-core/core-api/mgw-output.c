@@ -57,6 +57,12 @@ static proc_handler_t *output_get_source_proc_handler(mgw_output_t *output)
 			output->parent_stream->source->context.procs : NULL;
 }
 
+static long output_get_source_header_version(mgw_output_t *output)
+{
+	return !!output && !!output->parent_stream && !!output->parent_stream->source ?
+			os_atomic_load_long(&output->parent_stream->source->header_version) : 0;
+}
+
 static inline int output_proc_handler(mgw_output_t *output,
 					const char *func, call_params_t *params)
 {
@@ -249,6 +255,62 @@ static int output_get_encoder_packet(
 	return mgw_rb_read_packet(output->buffer, packet);
 }
 
+static int output_get_encoder_packet_ref(
+		mgw_output_t *output, struct encoder_packet *packet)
+{
+	if (!output || !packet || !output->buffer)
+		return FRAME_CONSUME_PERR;
+
+	return mgw_rb_read_packet_ref(output->buffer, packet);
+}
+
+static int output_get_encoder_packets(mgw_output_t *output,
+		struct encoder_packet *packets, int max_packets,
+		uint8_t *buf, size_t max_bytes, bool copy)
+{
+	if (!output || !packets || !output->buffer)
+		return FRAME_CONSUME_PERR;
+
+	return mgw_rb_read_packets(output->buffer, packets,
+			max_packets, buf, max_bytes, copy);
+}
+
+static int output_release_encoder_packet(mgw_output_t *output)
+{
+	if (!output || !output->buffer)
+		return FRAME_CONSUME_PERR;
+
+	return mgw_rb_read_commit(output->buffer);
+}
+
+static int output_wait_encoder_packet(mgw_output_t *output, uint32_t timeout_ms)
+{
+	if (!output || !output->buffer)
+		return FRAME_CONSUME_PERR;
+
+	return mgw_rb_wait_packet(output->buffer, timeout_ms);
+}
+
+static void output_cancel_wait_packet(mgw_output_t *output)
+{
+	if (output && output->buffer)
+		mgw_rb_cancel_wait(output->buffer);
+}
+
+static int output_arm_packet_notify(mgw_output_t *output, int fd)
+{
+	if (!output || !output->buffer)
+		return FRAME_CONSUME_PERR;
+
+	return mgw_rb_arm_notify(output->buffer, fd);
+}
+
+static void output_disarm_packet_notify(mgw_output_t *output)
+{
+	if (output && output->buffer)
+		mgw_rb_disarm_notify(output->buffer);
+}
+
 static const char *get_output_id(const char *protocol)
 {
 	if (!strncasecmp(protocol, "rtmp", 4) ||
@@ -303,7 +365,15 @@ static bool mgw_output_init(struct mgw_output *output)
 	proc_handler_add(output->context.procs, "source_ready",		output_source_ready);
 
 	output->get_encoder_packet		= output_get_encoder_packet;
+	output->get_encoder_packet_ref	= output_get_encoder_packet_ref;
+	output->get_encoder_packets		= output_get_encoder_packets;
+	output->release_encoder_packet	= output_release_encoder_packet;
+	output->wait_encoder_packet		= output_wait_encoder_packet;
+	output->cancel_wait_packet		= output_cancel_wait_packet;
+	output->arm_packet_notify		= output_arm_packet_notify;
+	output->disarm_packet_notify	= output_disarm_packet_notify;
 	output->get_source_proc_handler	= output_get_source_proc_handler;
+	output->get_source_header_version	= output_get_source_header_version;
 
 	if (mgw_stream_has_source(output->parent_stream)) {
 		mgw_context_data_insert(&output->context,
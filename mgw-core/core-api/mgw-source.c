@@ -102,8 +102,10 @@ static inline int source_proc_handler(mgw_source_t *source,
 	return ret;
 }
 
+/**< The plugin source has opened its input, the headers are of it now */
 static int signal_started(void *source, call_params_t *params)
 {
+	os_atomic_inc_long(&((mgw_source_t*)source)->header_version);
 	return source_proc_handler((mgw_source_t*)source, "signal_started", params);
 }
 
@@ -251,8 +253,12 @@ void mgw_source_set_video_extra_data(mgw_source_t *source,
 	if (source->context.info_impl && !source->is_private)
 		return;
 
-	if (source->is_private)
+	/** Set by every key frame, only a change is counted */
+	if (source->is_private && (size != source->video_header.len ||
+		(size && memcmp(source->video_header.array, extra_data, size)))) {
 		bmem_copy(&source->video_header, (const char*)extra_data, size);
+		os_atomic_inc_long(&source->header_version);
+	}
 }
 
 void mgw_source_set_audio_extra_data(mgw_source_t *source,
@@ -269,6 +275,7 @@ void mgw_source_set_audio_extra_data(mgw_source_t *source,
 							channels, samplesize, samplerate, &header);
 		bmem_copy(&source->audio_header, (const char *)header, header_size);
         bfree(header);
+		os_atomic_inc_long(&source->header_version);
 	}
 }
 
@@ -286,12 +293,20 @@ static bool mgw_source_init(struct mgw_source *source)
 			mgw_data_set_string(buf_settings, "stream_name",
 						source->parent_stream->context.obj_name);
 			mgw_data_set_string(buf_settings, "user_id", source->context.obj_name);
+
+			/** Size the buffer by the meta of private source */
+			mgw_data_t *meta = mgw_data_get_obj(source->context.settings, "meta");
+			if (meta) {
+				mgw_data_set_obj(buf_settings, "meta", meta);
+				mgw_data_release(meta);
+			}
 		}
 
 		if (!(source->buffer = mgw_rb_create(buf_settings, source))) {
 			mgw_data_release(buf_settings);
 			return false;
 		}
+		mgw_data_erase(buf_settings, "meta");
 
 		mgw_data_set_obj(source->context.settings, "buffer", buf_settings);
         mgw_data_release(buf_settings);
@@ -366,6 +381,7 @@ static mgw_source_t *mgw_source_create_internal(
 			mgw_data_erase(source->context.settings, "meta");
 
 		mgw_data_set_obj(source->context.settings, "meta", meta_settings);
+		mgw_rb_update_meta(source->buffer, meta_settings);
 		mgw_data_release(meta_settings);
 
 		uint8_t *header = NULL;
@@ -7,6 +7,7 @@
 #include "util/mgw-data.h"
 #include "util/platform.h"
 #include "util/threading.h"
+#include "buffer/buffer_pool.h"
 
 #include <stdio.h>
 #include <assert.h>
@@ -119,6 +120,17 @@ failed:
 	return data->valid;
 }
 
+/** Memory of stream buffers is kept for restarts of streams */
+#define MGW_BUFFER_POOL_MB_DEF	256
+
+static void mgw_init_buffer_pool(mgw_data_t *settings)
+{
+	mgw_data_set_default_int(settings, "buffer_pool_mb", MGW_BUFFER_POOL_MB_DEF);
+	mgw_data_set_default_bool(settings, "buffer_pool_mlock", false);
+	SetBuffPool((size_t)mgw_data_get_int(settings, "buffer_pool_mb") << 20,
+			mgw_data_get_bool(settings, "buffer_pool_mlock"));
+}
+
 static bool mgw_init(mgw_data_t *data)
 {
 	mgw = bzalloc(sizeof(struct mgw_core));
@@ -129,6 +141,8 @@ static bool mgw_init(mgw_data_t *data)
 
 	if (mgw->data.valid && data)
 		mgw_data_apply(mgw->data.private_data, data);
+	if (mgw->data.valid)
+		mgw_init_buffer_pool(mgw->data.private_data);
 
 	mgw_load_all_modules(mgw);
 
@@ -233,6 +247,7 @@ void mgw_shutdown(void)
 	mgw_stream_release_all(mgw->data.priv_streams_list);
 	mgw_device_release_all(mgw->data.devices_list);
 	free_mgw_data();
+	ClearBuffPool();
 	bfree(mgw);
 }
 
@@ -154,6 +154,9 @@ struct mgw_source {
 
 	struct bmem					audio_header, video_header;
 	enum encoder_id				audio_payload, video_payload;
+	/**< Counted up when the headers or settings may have changed, what
+	 *   outputs made of them is rebuilt after */
+	volatile long				header_version;
 
 	bool	(*active)(mgw_source_t *source);
 	void	(*output_packet)(mgw_source_t *source, struct encoder_packet *pkt);
@@ -192,7 +195,25 @@ struct mgw_output {
 	int							last_error_status;
 
 	proc_handler_t		*(*get_source_proc_handler)(mgw_output_t *output);
+	/**< header_version of the source, no proc handler call */
+	long				(*get_source_header_version)(mgw_output_t *output);
 	int					(*get_encoder_packet)(mgw_output_t *output, encoder_packet_t *packet);
+	/**< Zero copy, the packet data is valid until release_encoder_packet */
+	int					(*get_encoder_packet_ref)(mgw_output_t *output, encoder_packet_t *packet);
+	/**< Get the packets available at once, buf of max_bytes holds the copies,
+	 *   or only wrapped frames if zero copy, which are valid until release_encoder_packet */
+	int					(*get_encoder_packets)(mgw_output_t *output, encoder_packet_t *packets,
+								int max_packets, uint8_t *buf, size_t max_bytes, bool copy);
+	/**< FRAME_CONSUME_SLOW if a zero copy packet was covered by the writer before
+	 *   released, the packets got since the last release must be dropped */
+	int					(*release_encoder_packet)(mgw_output_t *output);
+	/**< Block until there is packet to get, interrupted by cancel_wait_packet */
+	int					(*wait_encoder_packet)(mgw_output_t *output, uint32_t timeout_ms);
+	void				(*cancel_wait_packet)(mgw_output_t *output);
+	/**< Wait by an event loop, the eventfd fd is written when a packet comes until
+	 *   disarmed. 0 if there is packet to get and not armed, EAGAIN if armed */
+	int					(*arm_packet_notify)(mgw_output_t *output, int fd);
+	void				(*disarm_packet_notify)(mgw_output_t *output);
 };
 
 extern const struct mgw_output_info *find_output_info(const char *id);
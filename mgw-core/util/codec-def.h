@@ -174,6 +174,7 @@ struct raw_audio_frame {
 
 int8_t mgw_avc_get_startcode_len(const uint8_t *data);
 bool mgw_avc_keyframe(const uint8_t *data, size_t size);
+bool mgw_avc_disposable(const uint8_t *data, size_t size);
 const uint8_t *mgw_avc_find_startcode(const uint8_t *p, const uint8_t *end);
 
 size_t mgw_avc_get_sps(const uint8_t *data, size_t size, uint8_t **sps);
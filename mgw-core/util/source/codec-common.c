@@ -229,6 +229,32 @@ bool mgw_avc_keyframe(const uint8_t *data, size_t size)
 	return false;
 }
 
+/** The first slice is not referenced by other frames, nal_ref_idc is 0 */
+bool mgw_avc_disposable(const uint8_t *data, size_t size)
+{
+	const uint8_t *nal_start, *nal_end;
+	const uint8_t *end = data + size;
+	int type;
+
+	nal_start = mgw_avc_find_startcode(data, end);
+	while (true) {
+		while (nal_start < end && !*(nal_start++));
+
+		if (nal_start == end)
+			break;
+
+		type = nal_start[0] & 0x1F;
+
+		if (type == 0x5 || type == 0x1)
+			return !(nal_start[0] & 0x60);
+
+		nal_end = mgw_avc_find_startcode(nal_start, end);
+		nal_start = nal_end;
+	}
+
+	return false;
+}
+
 static inline bool has_start_code(const uint8_t *data)
 {
 	if (data[0] != 0 || data[1] != 0)
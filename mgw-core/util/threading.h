@@ -96,6 +96,9 @@ EXPORT void os_set_thread_name(const char *name);
 #define os_atomic_load_bool(ptr) \
 			__atomic_load_n(ptr, __ATOMIC_SEQ_CST)
 
+#define os_atomic_compare_swap_bool(val, old_val, new_val) \
+			__sync_bool_compare_and_swap(val, old_val, new_val)
+
 #ifdef _MSC_VER
 #define THREAD_LOCAL __declspec(thread)
 #else
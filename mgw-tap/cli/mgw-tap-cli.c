@@ -0,0 +1,169 @@
+#include "mgw-tap.h"
+#include "util/codec-def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+
+#define TAP_WAIT_MS		100
+#define TAP_BUFF_DEF	(1024*1024)
+
+static volatile bool g_stop = false;
+
+static void on_signal(int sig)
+{
+	g_stop = true;
+}
+
+static const char *frame_type_name(int type)
+{
+	switch(type) {
+	case FRAME_I:	return "I";
+	case FRAME_B:	return "B";
+	case FRAME_P:	return "P";
+	case FRAME_IDR:	return "IDR";
+	case FRAME_SEI:	return "SEI";
+	case FRAME_SPS:	return "SPS";
+	case FRAME_PPS:	return "PPS";
+	case FRAME_AAC:	return "AAC";
+	default:		return "?";
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-i] [-a] [-q] [-t video|audio] [-n frames] [-o file] name\n"
+		"  Read the stream buffer of name from the share memory of mgw, read only\n"
+		"  -i  print the buffer and exit\n"
+		"  -a  start from the oldest key frame instead of the newest one\n"
+		"  -q  do not print a line per frame\n"
+		"  -t  only the video or audio frames\n"
+		"  -n  exit after frames read\n"
+		"  -o  write the frames to file, - for stdout, e.g.\n"
+		"      %s -q -t video -o - name | ffmpeg -f h264 -i - ...\n", prog, prog);
+}
+
+static void print_info(mgw_tap_t *tap, const char *name)
+{
+	struct mgw_tap_info info;
+	mgw_tap_get_info(tap, &info);
+	printf("name:       %s\n", name);
+	printf("layout:     %u\n", info.version);
+	printf("data size:  %u%s\n", info.data_size, info.mirror ? " (mirror)" : "");
+	printf("frames:     %u\n", info.max_frames);
+	printf("written:    %u frames, %u key frames\n", info.write_count, info.key_frame_count);
+	printf("writer:     %d\n", info.writer_pid);
+	printf("readers:    %u\n", info.readers);
+	printf("retired:    %s\n", info.retired ? "yes" : "no");
+}
+
+int main(int argc, char *argv[])
+{
+	bool only_info = false, from_oldest = false, quiet = false;
+	int only_type = 0;
+	long max_frames = -1;
+	const char *output = NULL;
+	int opt, err = 0;
+
+	while((opt = getopt(argc, argv, "iaqt:n:o:h")) != -1) {
+		switch(opt) {
+		case 'i': only_info = true; break;
+		case 'a': from_oldest = true; break;
+		case 'q': quiet = true; break;
+		case 't':
+			if(!strcmp(optarg, "video"))
+				only_type = 1;
+			else if(!strcmp(optarg, "audio"))
+				only_type = 2;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n': max_frames = strtol(optarg, NULL, 10); break;
+		case 'o': output = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *name = argv[optind];
+
+	mgw_tap_t *tap = mgw_tap_open(name, from_oldest, &err);
+	if(!tap) {
+		fprintf(stderr, "open %s failed:%s\n", name,
+			MGW_TAP_EVERSION == err ? "layout version mismatch" : "no such stream buffer");
+		return 1;
+	}
+	if(only_info) {
+		print_info(tap, name);
+		mgw_tap_close(tap);
+		return 0;
+	}
+
+	FILE *out = NULL;
+	if(output) {
+		out = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+		if(!out) {
+			fprintf(stderr, "open %s failed\n", output);
+			mgw_tap_close(tap);
+			return 1;
+		}
+	}
+	/** Frame lines go to stderr while the frames go to stdout */
+	FILE *log = out == stdout ? stderr : stdout;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, on_signal);
+
+	size_t buf_size = TAP_BUFF_DEF;
+	uint8_t *buf = out ? (uint8_t *)malloc(buf_size) : NULL;
+	unsigned long long count = 0, dropped = 0;
+	int ret = 0;
+	while(!g_stop && (max_frames < 0 || count < max_frames)) {
+		struct mgw_tap_frame frame;
+		/** Frames written out are copied first, the writer is not waiting for the disk or pipe */
+		ret = out ? mgw_tap_copy(tap, &frame, buf, buf_size) : mgw_tap_read(tap, &frame);
+		if(MGW_TAP_ENOBUFS == ret) {
+			buf_size = frame.size * 2;
+			buf = (uint8_t *)realloc(buf, buf_size);
+			if(!buf)
+				break;
+			continue;
+		}
+		if(ret < 0)
+			break;
+		if(0 == ret) {
+			mgw_tap_wait(tap, TAP_WAIT_MS);
+			continue;
+		}
+
+		dropped += frame.dropped;
+		bool audio = FRAME_AAC == frame.type;
+		if((1 == only_type && audio) || (2 == only_type && !audio))
+			continue;
+		count++;
+		if(!quiet)
+			fprintf(log, "%u\t%lld\t%s\t%u\tprio=%d%s\n", frame.frame_no, (long long)frame.timestamp,
+				frame_type_name(frame.type), frame.size, frame.priority,
+				frame.dropped ? "\tdropped before" : "");
+		if(out && fwrite(frame.data[0], 1, frame.size, out) != frame.size)
+			break;
+	}
+	if(MGW_TAP_EOS == ret)
+		fprintf(log, "the writer of %s has left\n", name);
+	fprintf(log, "%llu frames read, %llu dropped\n", count, dropped);
+
+	if(out && out != stdout)
+		fclose(out);
+	free(buf);
+	mgw_tap_close(tap);
+	return 0;
+}
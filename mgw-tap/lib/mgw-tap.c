@@ -0,0 +1,388 @@
+#include "mgw-tap.h"
+#include "stream_buff.h"
+#include "share_memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define TAP_POLL_MS		2
+
+struct mgw_tap {
+	char			name[64];
+	int				fd;
+	char			*mem;
+	size_t			maplen;
+	SmemoryHead		*head;
+	SmemoryFrame	*frames;
+	const uint8_t	*data;
+	/* Write count of the next frame to read */
+	unsigned int	rcount;
+	bool			from_oldest;
+	/* Locate the first frame before the next read */
+	bool			start;
+	uint32_t		dropped;
+};
+
+static void tap_shm_name(char *shm_name, size_t len, const char *name)
+{
+	char *p;
+	snprintf(shm_name, len, SHM_NAME_PREFIX"%s", name);
+	for(p = shm_name + 1; *p; p++) {
+		if('/' == *p)
+			*p = '_';
+	}
+}
+
+static bool tap_unlinked(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) < 0 || 0 == st.st_nlink;
+}
+
+/** Check the head of the segment, return the size to map or MGW_TAP_* error */
+static int tap_check_head(int fd, size_t *plen)
+{
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(SmemoryHead))
+		return MGW_TAP_EINVAL;
+
+	SmemoryHead *h = (SmemoryHead *)mmap(NULL, sizeof(SmemoryHead), PROT_READ, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == (void *)h)
+		return MGW_TAP_EINVAL;
+	int ret = 0;
+	if(SMEMORY_MAGIC != h->magic || 0 == h->uiDataOffset ||
+		st.st_size < (off_t)h->uiDataOffset + h->datasize) {
+		ret = MGW_TAP_EINVAL;
+	} else if(SMEMORY_VERSION != h->usVersion || sizeof(SmemoryHead) != h->usHeadSize ||
+		sizeof(SmemoryFrame) != h->usFrameSize) {
+		ret = MGW_TAP_EVERSION;
+	} else {
+		*plen = (size_t)h->uiDataOffset + h->datasize;
+	}
+	munmap(h, sizeof(SmemoryHead));
+	return ret;
+}
+
+/** Map the segment of name read only. Like the processes of gateway the tap holds a shared
+ *  flock while attached, so a creator never initializes the segment again under it */
+static int tap_attach(struct mgw_tap *tap)
+{
+	char shm_name[NAME_MAX];
+	size_t maplen = 0;
+	int fd, ret;
+
+	tap_shm_name(shm_name, sizeof(shm_name), tap->name);
+	while(1) {
+		fd = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+		if(fd < 0)
+			return MGW_TAP_EINVAL;
+		/** Do not take the lock of a segment not initialized, its creator would take it as attached */
+		ret = tap_check_head(fd, &maplen);
+		if(ret < 0) {
+			close(fd);
+			return ret;
+		}
+		if(0 == flock(fd, LOCK_SH) && !tap_unlinked(fd))
+			break;
+		close(fd);
+	}
+
+	char *mem = (char *)mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == mem) {
+		fprintf(stderr, "mmap %s error:%s\n", shm_name, strerror(errno));
+		close(fd);
+		return MGW_TAP_EINVAL;
+	}
+
+	tap->fd = fd;
+	tap->mem = mem;
+	tap->maplen = maplen;
+	tap->head = (SmemoryHead *)mem;
+	tap->frames = (SmemoryFrame *)(mem + sizeof(SmemoryHead));
+	tap->data = (const uint8_t *)mem + tap->head->uiDataOffset;
+	return 0;
+}
+
+/** Unlink the segment if the tap is the last one attached, as DeleteShareMemory() does */
+static void tap_detach(struct mgw_tap *tap)
+{
+	if(tap->fd < 0)
+		return;
+	munmap(tap->mem, tap->maplen);
+	if(!tap_unlinked(tap->fd) && 0 == flock(tap->fd, LOCK_EX | LOCK_NB)) {
+		char shm_name[NAME_MAX];
+		tap_shm_name(shm_name, sizeof(shm_name), tap->name);
+		shm_unlink(shm_name);
+	}
+	close(tap->fd);
+	tap->fd = -1;
+	tap->mem = NULL;
+}
+
+mgw_tap_t *mgw_tap_open(const char *name, bool from_oldest, int *err)
+{
+	int ret = MGW_TAP_EINVAL;
+	struct mgw_tap *tap = NULL;
+	if(!name || !*name)
+		goto error;
+
+	tap = (struct mgw_tap *)calloc(1, sizeof(struct mgw_tap));
+	if(!tap)
+		goto error;
+	snprintf(tap->name, sizeof(tap->name), "%s", name);
+	tap->fd = -1;
+	tap->from_oldest = from_oldest;
+	tap->start = true;
+	ret = tap_attach(tap);
+	if(ret < 0)
+		goto error;
+	return tap;
+
+error:
+	free(tap);
+	if(err)
+		*err = ret;
+	return NULL;
+}
+
+void mgw_tap_close(mgw_tap_t *tap)
+{
+	if(!tap)
+		return;
+	tap_detach(tap);
+	free(tap);
+}
+
+void mgw_tap_get_info(mgw_tap_t *tap, struct mgw_tap_info *info)
+{
+	SmemoryHead *h = tap->head;
+	info->version = h->usVersion;
+	info->data_size = h->datasize;
+	info->max_frames = h->uiMaxValidFrames;
+	info->write_count = __atomic_load_n(&h->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	info->key_frame_count = __atomic_load_n(&h->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	info->readers = h->ucReaderCount;
+	info->writer_pid = h->n32WriterPid;
+	info->mirror = h->ucMirror;
+	info->retired = h->ucRetired;
+}
+
+/** The slot is published and holds the frame of write count frameno, return its seq */
+static bool tap_slot_holds(struct mgw_tap *tap, unsigned int frameno, unsigned int *pseq)
+{
+	SmemoryFrame *f = &tap->frames[frameno % tap->head->uiMaxValidFrames];
+	unsigned int seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+	if((seq & 1) || f->uiFrameNo != frameno)
+		return false;
+	if(pseq)
+		*pseq = seq;
+	return true;
+}
+
+static bool tap_key_frame(struct mgw_tap *tap, unsigned int k, unsigned int *pframeno)
+{
+	unsigned int frameno = tap->head->stuKeyFrames[k % KEY_FRAME_INDEX_SIZE].uiFrameNo;
+	SmemoryFrame *f = &tap->frames[frameno % tap->head->uiMaxValidFrames];
+	if(!tap_slot_holds(tap, frameno, NULL) ||
+		(f->stuFrameInfo.frametype != FRAME_I && f->stuFrameInfo.frametype != FRAME_IDR))
+		return false;
+	*pframeno = frameno;
+	return true;
+}
+
+/** Move to a key frame in the index, the newest or the oldest one not behind the tap.
+ *  A stream without key frames is read from the oldest frame, or the next one if newest */
+static void tap_jump(struct mgw_tap *tap, bool newest)
+{
+	SmemoryHead *h = tap->head;
+	unsigned int kcount = __atomic_load_n(&h->uiKeyFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int wcount = __atomic_load_n(&h->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	unsigned int lo = kcount > KEY_FRAME_INDEX_SIZE ? kcount - KEY_FRAME_INDEX_SIZE : 0;
+	unsigned int k, n, frameno;
+
+	for(n = 0; n < kcount - lo; n++) {
+		k = newest ? kcount - 1 - n : lo + n;
+		if(!tap_key_frame(tap, k, &frameno))
+			continue;
+		if(!tap->start && (int)(frameno - tap->rcount) < 0)
+			continue;
+		tap->rcount = frameno;
+		return;
+	}
+
+	if(newest) {
+		tap->rcount = wcount;
+		return;
+	}
+	n = wcount > h->uiMaxValidFrames ? wcount - h->uiMaxValidFrames : 0;
+	if(!tap->start && (int)(n - tap->rcount) < 0)
+		n = tap->rcount;
+	for(; n != wcount && !tap_slot_holds(tap, n, NULL); n++)
+		;
+	tap->rcount = n;
+}
+
+/** The writer has moved to a new buffer of the same name, follow it from its first frame */
+static int tap_reattach(struct mgw_tap *tap)
+{
+	struct mgw_tap next = *tap;
+	if(tap_attach(&next) < 0)
+		return -1;
+	tap_detach(tap);
+	*tap = next;
+	tap->rcount = 0;
+	return 0;
+}
+
+/** The writer may crash without detaching */
+static bool tap_writer_alive(SmemoryHead *h)
+{
+	if(0 == h->ucWriterCount)
+		return false;
+	return h->n32WriterPid <= 0 || 0 == kill(h->n32WriterPid, 0) || EPERM == errno;
+}
+
+/** Fill frame by the next one without moving on */
+static int tap_locate(struct mgw_tap *tap, struct mgw_tap_frame *frame)
+{
+	SmemoryHead *h = tap->head;
+	if(SMEMORY_MAGIC != h->magic)
+		return 0;
+
+	unsigned int wcount = __atomic_load_n(&h->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	if(tap->start || (int)(wcount - tap->rcount) < 0) {
+		/** Started or the segment has been initialized again */
+		tap->start = true;
+		tap_jump(tap, !tap->from_oldest);
+		tap->start = false;
+	}
+
+	while(tap->rcount != wcount) {
+		unsigned int seq;
+		if(wcount - tap->rcount <= h->uiMaxValidFrames && tap_slot_holds(tap, tap->rcount, &seq)) {
+			SmemoryFrame *f = &tap->frames[tap->rcount % h->uiMaxValidFrames];
+			unsigned int position = f->position;
+			unsigned int len = f->len;
+			frame->timestamp = f->stuFrameInfo.timestamp;
+			frame->type = f->stuFrameInfo.frametype;
+			frame->priority = f->stuFrameInfo.priority;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq && position < h->datasize && len < h->datasize) {
+				frame->frame_no = tap->rcount;
+				frame->slot = tap->rcount % h->uiMaxValidFrames;
+				frame->seq = seq;
+				frame->size = len;
+				frame->data[0] = tap->data + position;
+				frame->len[0] = position + len <= h->datasize ? len : h->datasize - position;
+				frame->data[1] = tap->data;
+				frame->len[1] = len - frame->len[0];
+				frame->dropped = tap->dropped;
+				return len;
+			}
+		}
+		/** Covered before it is read */
+		unsigned int from = tap->rcount;
+		tap_jump(tap, false);
+		if(tap->rcount == from)
+			tap->rcount++;
+		tap->dropped += tap->rcount - from;
+		wcount = __atomic_load_n(&h->uiWritFrameCount, __ATOMIC_ACQUIRE);
+	}
+
+	if(__atomic_load_n(&h->ucRetired, __ATOMIC_ACQUIRE) && 0 == tap_reattach(tap))
+		return tap_locate(tap, frame);
+	if(!tap_writer_alive(h))
+		return MGW_TAP_EOS;
+	return 0;
+}
+
+int mgw_tap_read(mgw_tap_t *tap, struct mgw_tap_frame *frame)
+{
+	if(!tap || !frame)
+		return MGW_TAP_EINVAL;
+	int ret = tap_locate(tap, frame);
+	if(ret > 0) {
+		tap->rcount++;
+		tap->dropped = 0;
+	}
+	return ret;
+}
+
+bool mgw_tap_valid(mgw_tap_t *tap, const struct mgw_tap_frame *frame)
+{
+	/** Keep the reads of data before the check */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&tap->frames[frame->slot].seq, __ATOMIC_RELAXED) == frame->seq;
+}
+
+int mgw_tap_copy(mgw_tap_t *tap, struct mgw_tap_frame *frame, uint8_t *buf, size_t size)
+{
+	if(!tap || !frame || !buf)
+		return MGW_TAP_EINVAL;
+	while(1) {
+		int ret = tap_locate(tap, frame);
+		if(ret <= 0)
+			return ret;
+		if(frame->size > size)
+			return MGW_TAP_ENOBUFS;
+
+		memcpy(buf, frame->data[0], frame->len[0]);
+		memcpy(buf + frame->len[0], frame->data[1], frame->len[1]);
+		tap->rcount++;
+		if(mgw_tap_valid(tap, frame)) {
+			tap->dropped = 0;
+			frame->data[0] = buf;
+			frame->len[0] = frame->size;
+			frame->data[1] = NULL;
+			frame->len[1] = 0;
+			return ret;
+		}
+		tap->dropped++;
+	}
+}
+
+/** Wait on uiWritFrameCount like WaitFrameFromBuff(), the writer wakes it on every frame and
+ *  FUTEX_WAIT needs only a readable mapping. Poll if the futex can't be waited on */
+bool mgw_tap_wait(mgw_tap_t *tap, unsigned int timeout_ms)
+{
+	struct timespec poll = {0, TAP_POLL_MS * 1000000L};
+	struct timespec deadline, now, timeout;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while(1) {
+		unsigned int wcount = __atomic_load_n(&tap->head->uiWritFrameCount, __ATOMIC_ACQUIRE);
+		bool ready = tap->start || wcount != tap->rcount || tap->head->ucRetired;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+		timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if(timeout.tv_nsec < 0) {
+			timeout.tv_sec--;
+			timeout.tv_nsec += 1000000000L;
+		}
+		if(ready || timeout.tv_sec < 0)
+			return ready;
+
+		/** Not FUTEX_PRIVATE_FLAG, the writer is another process */
+		if(syscall(SYS_futex, &tap->head->uiWritFrameCount, FUTEX_WAIT, wcount, &timeout, NULL, 0) < 0 &&
+				errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+			nanosleep(timeout.tv_sec > 0 || timeout.tv_nsec > poll.tv_nsec ? &poll : &timeout, NULL);
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef __MGW_TAP_H__
+#define __MGW_TAP_H__
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Read only tap of a MEM_SHARED stream buffer from another process. The segment is mapped
+ *  read only and the tap never writes to it, the writer and readers of the gateway do not
+ *  know it is there. A frame is read in place, check mgw_tap_valid() after using it since
+ *  the writer may cover it any time, or copy it by mgw_tap_copy() which does the check */
+
+#define MGW_TAP_EINVAL		-1
+/* The layout of the segment is another version */
+#define MGW_TAP_EVERSION	-2
+/* The writer has left and all frames are read */
+#define MGW_TAP_EOS			-3
+/* The buffer given to mgw_tap_copy() is too small, frame->size is the size needed */
+#define MGW_TAP_ENOBUFS		-4
+
+typedef struct mgw_tap mgw_tap_t;
+
+struct mgw_tap_frame {
+	/* The frame may wrap around the end of data region */
+	const uint8_t	*data[2];
+	uint32_t		len[2];
+	uint32_t		size;
+	/* Write count of the frame, the slot and seq it is checked by */
+	uint32_t		frame_no;
+	uint32_t		slot;
+	uint32_t		seq;
+	/* Frames covered by the writer before they were read */
+	uint32_t		dropped;
+	int64_t			timestamp;
+	/* frame_t of util/codec-def.h */
+	int				type;
+	int				priority;
+};
+
+struct mgw_tap_info {
+	unsigned int	version;
+	unsigned int	data_size;
+	unsigned int	max_frames;
+	unsigned int	write_count;
+	unsigned int	key_frame_count;
+	unsigned int	readers;
+	int				writer_pid;
+	bool			mirror;
+	bool			retired;
+};
+
+/* Attach to the stream buffer of name, start from the newest key frame or the oldest one */
+mgw_tap_t *mgw_tap_open(const char *name, bool from_oldest, int *err);
+void mgw_tap_close(mgw_tap_t *tap);
+void mgw_tap_get_info(mgw_tap_t *tap, struct mgw_tap_info *info);
+
+/* No copy, return the size, 0 if no frame or MGW_TAP_* error */
+int mgw_tap_read(mgw_tap_t *tap, struct mgw_tap_frame *frame);
+/* The frame of the last read has not been covered, so what was read of it is not torn */
+bool mgw_tap_valid(mgw_tap_t *tap, const struct mgw_tap_frame *frame);
+/* Read a frame into buf of size, a frame covered while copying is dropped */
+int mgw_tap_copy(mgw_tap_t *tap, struct mgw_tap_frame *frame, uint8_t *buf, size_t size);
+/* Return true if there is a frame to read in timeout_ms, waits on the futex the writer wakes
+ * on every frame */
+bool mgw_tap_wait(mgw_tap_t *tap, unsigned int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
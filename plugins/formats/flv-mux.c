@@ -12,6 +12,7 @@
 #define SEND_VIDEO
 #define SEND_AUDIO
 #define VIDEO_HEADER_SIZE 5
+#define AUDIO_HEADER_SIZE 2
 #define FLV_INFO_SIZE_OFFSET 42
 #define MILLISECOND_DEN   1000
 
@@ -130,26 +131,44 @@ bool flv_meta_data(mgw_data_t *settings, uint8_t **output, size_t *size,
 	return true;
 }
 
+size_t flv_packet_body_header(struct encoder_packet *packet, bool is_header,
+		uint8_t *output)
+{
+	if (packet->type == ENCODER_VIDEO) {
+		output[0] = packet->keyframe ? 0x17 : 0x27;
+		output[1] = is_header ? 0 : 1;
+		/* composition time */
+		output[2] = output[3] = output[4] = 0;
+		return VIDEO_HEADER_SIZE;
+	}
+
+	/* the audio header is 0xaf 0x00 and AudioSpecificConfig already */
+	if (is_header)
+		return 0;
+	output[0] = 0xaf;
+	output[1] = 1;
+	return AUDIO_HEADER_SIZE;
+}
+
 static void flv_video(struct serializer *s, int32_t dts_offset,
 		struct encoder_packet *packet, bool is_header)
 {
 	//int64_t offset  = packet->pts - packet->dts;
 	int32_t time_ms;// = get_ms_time(packet, packet->dts) - dts_offset;
+	uint8_t header[FLV_BODY_HEADER_MAX];
 	if (!packet->data || !packet->size)
 		return;
 
 	s_w8(s, RTMP_PACKET_TYPE_VIDEO);
 
 	time_ms = packet->pts;
-	s_wb24(s, (uint32_t)packet->size + 5);
+	s_wb24(s, (uint32_t)packet->size + VIDEO_HEADER_SIZE);
 	s_wb24(s, time_ms);
 	s_w8(s, (time_ms >> 24) & 0x7F);
 	s_wb24(s, 0);
 
 	/* these are the 5 extra bytes mentioned above */
-	s_w8(s, packet->keyframe ? 0x17 : 0x27);
-	s_w8(s, is_header ? 0 : 1);
-	s_wb24(s, 0/*get_ms_time(packet, offset)*/);
+	s_write(s, header, flv_packet_body_header(packet, is_header, header));
 	s_write(s, packet->data, packet->size);
 
 	/* write tag size (starting byte doesn't count) */
@@ -160,7 +179,8 @@ static void flv_audio(struct serializer *s, int32_t dts_offset,
 		struct encoder_packet *packet, bool is_header)
 {
 	int32_t time_ms;// = get_ms_time(packet, packet->dts) - dts_offset;
-	int extra_byte = is_header ? 0 : 2;
+	uint8_t header[FLV_BODY_HEADER_MAX];
+	size_t extra_byte = flv_packet_body_header(packet, is_header, header);
 	if (!packet->data || !packet->size)
 		return;
 	
@@ -173,10 +193,7 @@ static void flv_audio(struct serializer *s, int32_t dts_offset,
 	s_wb24(s, 0);
 
 	/* these are the two extra bytes mentioned above */
-	if (!is_header) {
-		s_w8(s, 0xaf);
-		s_w8(s, /*is_header ? 0 : */1);
-	}
+	s_write(s, header, extra_byte);
 	s_write(s, packet->data, packet->size);
 
 	/* write tag size (starting byte doesn't count) */
@@ -20,6 +20,12 @@ bool flv_meta_data(mgw_data_t *settings, uint8_t **output, size_t *size,
 void flv_packet_mux(struct encoder_packet *packet, int32_t dts_offset,
 		uint8_t **output, size_t *size, bool is_header);
 
+#define FLV_BODY_HEADER_MAX	5
+/* Bytes of the FLV tag body before the data of packet, which is also the body of
+ * RTMP message. Put them to output of FLV_BODY_HEADER_MAX, return the size */
+size_t flv_packet_body_header(struct encoder_packet *packet, bool is_header,
+		uint8_t *output);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,224 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "util/base.h"
+#include "util/bmem.h"
+#include "util/threading.h"
+#include "flv-cache.h"
+
+/**< Tags of the frames an output may be behind the first one, a slower output
+ *   finds its tag again instead of the slot overwritten */
+#define FLV_CACHE_SLOTS		128
+
+struct flv_cache_slot {
+	/**< Frame of the tag, the key is 0 if empty */
+	int64_t			pts;
+	size_t			size;
+	uint32_t		key;
+	struct flv_tag	tag;
+};
+
+struct flv_cache {
+	const void			*key;
+	long				refs;
+	struct flv_cache	*next;
+
+	pthread_mutex_t		mutex;
+	struct flv_cache_slot	slots[FLV_CACHE_SLOTS];
+	struct flv_headers	*headers;
+};
+
+static pthread_mutex_t flv_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct flv_cache *flv_caches;
+
+struct flv_cache *flv_cache_get(const void *key)
+{
+	struct flv_cache *cache;
+
+	pthread_mutex_lock(&flv_caches_mutex);
+	for (cache = flv_caches; cache; cache = cache->next) {
+		if (cache->key == key)
+			break;
+	}
+	if (!cache) {
+		cache = bzalloc(sizeof(struct flv_cache));
+		cache->key = key;
+		pthread_mutex_init(&cache->mutex, NULL);
+		cache->next = flv_caches;
+		flv_caches = cache;
+	}
+	cache->refs++;
+	pthread_mutex_unlock(&flv_caches_mutex);
+	return cache;
+}
+
+void flv_cache_release(struct flv_cache *cache)
+{
+	struct flv_cache **link;
+
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&flv_caches_mutex);
+	if (--cache->refs > 0) {
+		pthread_mutex_unlock(&flv_caches_mutex);
+		return;
+	}
+	for (link = &flv_caches; *link; link = &(*link)->next) {
+		if (*link == cache) {
+			*link = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&flv_caches_mutex);
+
+	flv_headers_release(cache->headers);
+	pthread_mutex_destroy(&cache->mutex);
+	bfree(cache);
+}
+
+static inline uint32_t tag_key(const struct encoder_packet *packet)
+{
+	return 1 + (uint32_t)packet->type * 2 + (packet->keyframe ? 1 : 0);
+}
+
+/**< Audio without the ADTS header, video of AVCC, the start code is replaced by
+ *   the length, and a key frame starts from its IDR */
+static bool build_tag(const struct encoder_packet *packet, struct flv_tag *tag)
+{
+	const uint8_t *data = packet->data;
+	uint8_t *payload = NULL;
+	size_t offset = 0, size;
+	bool avcc = false;
+
+	if (packet->type == ENCODER_AUDIO) {
+		if (!(data[1] & 0x01)) {
+			size_t packet_len = ((data[3]&0x03) << 11) +
+							(data[4] << 3) + ((data[5] & 0xe0) >> 5);
+			if (packet->size == packet_len)
+				offset = 9;
+		} else {
+			offset = 7;
+		}
+	} else if (packet->type == ENCODER_VIDEO && packet->keyframe) {
+		size = mgw_avc_get_keyframe(data, packet->size, &payload);
+		if (!size) {
+			blog(MGW_LOG_ERROR, "Couldn't find key frame!, size = %zu", packet->size);
+			return false;
+		}
+		offset = payload - data;
+		avcc = true;
+	} else if (packet->type == ENCODER_VIDEO) {
+		int start_code = mgw_avc_get_startcode_len(data);
+		if (start_code <= 0) {
+			blog(MGW_LOG_ERROR, "Couldn't find the NALU start code, "
+						"data[0]:%02x, data[1]:%02x, data[2]:%02x, data[3]:%02x, data[3]:%02x",
+						data[0], data[1], data[2], data[3], data[4]);
+			return false;
+		}
+		offset = start_code;
+		avcc = true;
+	}
+
+	if (offset >= packet->size)
+		return false;
+	size = packet->size - offset;
+
+	tag->offset = (uint32_t)offset;
+	tag->size = (uint32_t)size;
+	tag->header_size = (uint8_t)flv_packet_body_header(
+					(struct encoder_packet *)packet, false, tag->header);
+	if (avcc) {
+		uint8_t *len = tag->header + tag->header_size;
+		len[0] = (uint8_t)(size >> 24);
+		len[1] = (uint8_t)(size >> 16);
+		len[2] = (uint8_t)(size >> 8);
+		len[3] = (uint8_t)size;
+		tag->header_size += 4;
+	}
+	return true;
+}
+
+/**< A frame of the same pts, size and type is taken as the same one, the payload
+ *   of video is also checked to follow a start code */
+static inline bool slot_matches(const struct flv_cache_slot *slot,
+		const struct encoder_packet *packet)
+{
+	const uint8_t *p;
+
+	if (slot->key != tag_key(packet) || slot->pts != packet->pts ||
+		slot->size != packet->size)
+		return false;
+	if (packet->type != ENCODER_VIDEO)
+		return true;
+
+	p = packet->data + slot->tag.offset;
+	return slot->tag.offset >= 3 && !p[-3] && !p[-2] && 1 == p[-1];
+}
+
+bool flv_cache_get_tag(struct flv_cache *cache,
+		const struct encoder_packet *packet, struct flv_tag *tag)
+{
+	struct flv_cache_slot *slot;
+	uint64_t hash;
+	bool ret = true;
+
+	if (!cache)
+		return build_tag(packet, tag);
+
+	hash = ((uint64_t)packet->pts ^ (uint64_t)tag_key(packet) << 56) * 0x9e3779b97f4a7c15ULL;
+	slot = &cache->slots[(hash >> 32) % FLV_CACHE_SLOTS];
+
+	pthread_mutex_lock(&cache->mutex);
+	if (slot_matches(slot, packet)) {
+		*tag = slot->tag;
+	} else if ((ret = build_tag(packet, tag))) {
+		slot->key = tag_key(packet);
+		slot->pts = packet->pts;
+		slot->size = packet->size;
+		slot->tag = *tag;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return ret;
+}
+
+void flv_headers_addref(struct flv_headers *headers)
+{
+	if (headers)
+		os_atomic_inc_long(&headers->refs);
+}
+
+void flv_headers_release(struct flv_headers *headers)
+{
+	if (!headers || os_atomic_dec_long(&headers->refs) > 0)
+		return;
+
+	bfree(headers->meta);
+	bfree(headers->audio);
+	bfree(headers->video);
+	bfree(headers);
+}
+
+struct flv_headers *flv_cache_get_headers(struct flv_cache *cache, long version,
+		flv_headers_build_t build, void *param)
+{
+	struct flv_headers *headers;
+
+	pthread_mutex_lock(&cache->mutex);
+	headers = cache->headers;
+	if (!headers || headers->version != version) {
+		headers = bzalloc(sizeof(struct flv_headers));
+		headers->refs = 1;
+		headers->version = version;
+		if (!build(param, headers)) {
+			flv_headers_release(headers);
+			pthread_mutex_unlock(&cache->mutex);
+			return NULL;
+		}
+		flv_headers_release(cache->headers);
+		cache->headers = headers;
+	}
+	flv_headers_addref(headers);
+	pthread_mutex_unlock(&cache->mutex);
+	return headers;
+}
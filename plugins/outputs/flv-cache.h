@@ -0,0 +1,70 @@
+#ifndef _OUTPUTS_FLV_CACHE_H_
+#define _OUTPUTS_FLV_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/codec-def.h"
+#include "formats/flv-mux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**< FLV tags of a stream shared by all its RTMP outputs. The first output reaching
+ *   a frame finds its payload in the AnnexB or ADTS data and builds the tag body
+ *   header, the others take them from the cache. A tag has no timestamp, that is
+ *   put in the RTMP chunk header of each output, and the payload stays in the ring
+ *   buffer, so only where it is in the frame is kept */
+
+struct flv_tag {
+	/**< Payload in the frame data after the start code or ADTS header */
+	uint32_t	offset;
+	uint32_t	size;
+	/**< FLV tag body header and the AVCC length of the NALU */
+	uint8_t		header[FLV_BODY_HEADER_MAX + 4];
+	uint8_t		header_size;
+};
+
+/**< Sequence headers and onMetaData of the stream, built once for a header
+ *   version of the source and read only after, an output keeps a reference
+ *   while they are queued to its socket */
+struct flv_headers {
+	volatile long	refs;
+	long			version;
+	/**< FLV tag of onMetaData */
+	uint8_t			*meta;
+	size_t			meta_size;
+	/**< 0xaf 0x00 and the AudioSpecificConfig */
+	uint8_t			*audio;
+	size_t			audio_size;
+	/**< AVCDecoderConfigurationRecord */
+	uint8_t			*video;
+	size_t			video_size;
+};
+
+/**< Fill headers of bmalloc'ed data, they are freed by the last release */
+typedef bool (*flv_headers_build_t)(void *param, struct flv_headers *headers);
+
+struct flv_cache;
+
+/**< Cache of the stream key, created by the first output of it */
+struct flv_cache *flv_cache_get(const void *key);
+void flv_cache_release(struct flv_cache *cache);
+
+/**< Tag of packet, false if the frame has no payload to send */
+bool flv_cache_get_tag(struct flv_cache *cache,
+		const struct encoder_packet *packet, struct flv_tag *tag);
+
+/**< Headers of version with a reference, built by build if the ones cached are
+ *   of another version. NULL if build fails */
+struct flv_headers *flv_cache_get_headers(struct flv_cache *cache, long version,
+		flv_headers_build_t build, void *param);
+void flv_headers_addref(struct flv_headers *headers);
+void flv_headers_release(struct flv_headers *headers);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
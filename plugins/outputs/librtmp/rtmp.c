@@ -36,6 +36,7 @@
 #include <time.h>
 #include <net/if.h>
 #include <fcntl.h>
+#include <poll.h>
 
 
 #include "rtmp_sys.h"
@@ -101,7 +102,6 @@ TLS_CTX RTMP_TLS_ctx = NULL;
 
 #endif
 
-#define RTMP_SIG_SIZE 1536
 #define RTMP_LARGE_HEADER_SIZE 12
 
 static const int packetSize[] = { 12, 8, 4, 1 };
@@ -988,10 +988,11 @@ static int RTMP_Socket_BindToTun(int sb_socket, int clustering_network, char *ne
 }
 
 
-int
-RTMP_Connect0(RTMP *r, struct sockaddr * service, socklen_t addrlen)
+/* Non-blocking socket of the family, bound as the options of r say */
+static int
+OpenSocket(RTMP *r, struct sockaddr *service)
 {
-    int on = 1, flag, ret;
+    int flag;
     r->m_sb.sb_timedout = FALSE;
     r->m_pausing = 0;
     r->m_fDuration = 0.0;
@@ -1003,39 +1004,94 @@ RTMP_Connect0(RTMP *r, struct sockaddr * service, socklen_t addrlen)
     r->m_sb.sb_socket = socket(service->sa_family, SOCK_STREAM, IPPROTO_TCP);
 #endif
 
-    if (r->m_sb.sb_socket != INVALID_SOCKET)
+    if (r->m_sb.sb_socket == INVALID_SOCKET)
+    {
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
+        GetSockError());
+        return FALSE;
+    }
+
+    if(r->m_bindIP.addrLen && r->set_netopt == 2)
     {
-        if(r->m_bindIP.addrLen && r->set_netopt == 2)
+        if (bind(r->m_sb.sb_socket, (const struct sockaddr *)&r->m_bindIP.addr, r->m_bindIP.addrLen) < 0)
         {
-            if (bind(r->m_sb.sb_socket, (const struct sockaddr *)&r->m_bindIP.addr, r->m_bindIP.addrLen) < 0)
-            {
-                int err = GetSockError();
-                RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to bind socket: %s (%d)",
-                         __FUNCTION__, socketerror(err), err);
-                r->last_error_code = err;
-                RTMP_Close(r);
-                return FALSE;
-            }
-        } else if (r->set_netopt == 1) {
-			RTMP_Socket_BindToTun(r->m_sb.sb_socket, r->set_netopt, r->netcard_name);  
-		}
-
-        //set the socket fd to non-block
-		flag = fcntl(r->m_sb.sb_socket, F_GETFL, 0);
-        if (flag < 0) {
-            r->last_error_code = GetSockError();
+            int err = GetSockError();
+            RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to bind socket: %s (%d)",
+                     __FUNCTION__, socketerror(err), err);
+            r->last_error_code = err;
             RTMP_Close(r);
             return FALSE;
         }
+    } else if (r->set_netopt == 1) {
+        RTMP_Socket_BindToTun(r->m_sb.sb_socket, r->set_netopt, r->netcard_name);
+    }
 
-        flag |= O_NONBLOCK;
-        flag = fcntl(r->m_sb.sb_socket, F_SETFL, flag);
-        if (flag < 0) {
-            r->last_error_code = GetSockError();
-            RTMP_Close(r);
-            return FALSE;
-        }
+    //set the socket fd to non-block
+    flag = fcntl(r->m_sb.sb_socket, F_GETFL, 0);
+    if (flag < 0) {
+        r->last_error_code = GetSockError();
+        RTMP_Close(r);
+        return FALSE;
+    }
+
+    flag |= O_NONBLOCK;
+    flag = fcntl(r->m_sb.sb_socket, F_SETFL, flag);
+    if (flag < 0) {
+        r->last_error_code = GetSockError();
+        RTMP_Close(r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+LogConnectError(RTMP *r, int err)
+{
+    if (err == E_CONNREFUSED)
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s is offline. Try a different server (ECONNREFUSED).", r->Link.hostname.av_val);
+    else if (err == E_ACCES)
+        RTMP_Log_Fl(RTMP_LOGERROR, "The connection is being blocked by a firewall or other security software (EACCES).");
+    else if (err == E_TIMEDOUT)
+        RTMP_Log_Fl(RTMP_LOGERROR, "The connection timed out. Try a different server, or check that the connection is not being blocked by a firewall or other security software (ETIMEDOUT).");
+    else
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to connect socket: %s (%d)",
+                 __FUNCTION__, socketerror(err), err);
+}
+
+/* Timeouts and Nagle of the connected socket */
+static void
+SetSocketOptions(RTMP *r)
+{
+    int on = 1;
+    struct timeval snd_timeout = {3, 0};
 
+    SET_RCVTIMEO(tv, r->Link.timeout);
+    if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
+    {
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
+                 __FUNCTION__, r->Link.timeout);
+    }
+
+    if(setsockopt(r->m_sb.sb_socket, SOL_SOCKET,SO_SNDTIMEO, (char*)&snd_timeout, sizeof(snd_timeout)) == -1) {
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!", __FUNCTION__, (int)snd_timeout.tv_sec);
+    }
+
+    unsigned int user_timeout = 15000;
+    if (-1 == setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout))) {
+        RTMP_Log_Fl(RTMP_LOGERROR, "set TCP_USER_TIMEOUT option error: %s", strerror(errno));
+    }
+
+    if(!r->m_bUseNagle)
+        setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+}
+
+int
+RTMP_Connect0(RTMP *r, struct sockaddr * service, socklen_t addrlen)
+{
+    int flag, ret;
+
+    if (OpenSocket(r, service))
+    {
         uint64_t connect_start = os_gettime_ns();
 
         if ((ret = connect(r->m_sb.sb_socket, service, addrlen)) != 0)
@@ -1059,15 +1115,7 @@ RTMP_Connect0(RTMP *r, struct sockaddr * service, socklen_t addrlen)
                 }
             } else {
                 int err = GetSockError();
-                if (err == E_CONNREFUSED)
-                    RTMP_Log_Fl(RTMP_LOGERROR, "%s is offline. Try a different server (ECONNREFUSED).", r->Link.hostname.av_val);
-                else if (err == E_ACCES)
-                    RTMP_Log_Fl(RTMP_LOGERROR, "The connection is being blocked by a firewall or other security software (EACCES).");
-                else if (err == E_TIMEDOUT)
-                    RTMP_Log_Fl(RTMP_LOGERROR, "The connection timed out. Try a different server, or check that the connection is not being blocked by a firewall or other security software (ETIMEDOUT).");
-                else
-                    RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to connect socket: %s (%d)",
-                         __FUNCTION__, socketerror(err), err);
+                LogConnectError(r, err);
                 r->last_error_code = err;
                 RTMP_Close(r);
                 return FALSE;
@@ -1097,35 +1145,10 @@ RTMP_Connect0(RTMP *r, struct sockaddr * service, socklen_t addrlen)
     }
     else
     {
-        RTMP_Log_Fl(RTMP_LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
-        GetSockError());
         return FALSE;
     }
 
-    /* set timeout */
-    {
-		struct timeval snd_timeout = {3, 0};
-		
-        SET_RCVTIMEO(tv, r->Link.timeout);
-        if (setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
-        {
-            RTMP_Log_Fl(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!",
-                     __FUNCTION__, r->Link.timeout);
-        }
-
-		if(setsockopt(r->m_sb.sb_socket, SOL_SOCKET,SO_SNDTIMEO, (char*)&snd_timeout, sizeof(snd_timeout)) == -1) {
-			RTMP_Log_Fl(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!", __FUNCTION__, (int)snd_timeout.tv_sec);
-		}
-
-        unsigned int user_timeout = 15000;
-        if (-1 == setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout))) {
-            RTMP_Log_Fl(RTMP_LOGERROR, "set TCP_USER_TIMEOUT option error: %s", strerror(errno));
-        }
-    }
-
-    if(!r->m_bUseNagle)
-        setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
-
+    SetSocketOptions(r);
     return TRUE;
 }
 
@@ -1262,33 +1285,15 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
     return TRUE;
 }
 
-int
-RTMP_Connect(RTMP *r, RTMPPacket *cp)
+/* Address to connect, the SOCKS server, the IP given for the domain or the host */
+static int
+ResolveService(RTMP *r, struct sockaddr_storage *service, socklen_t *paddrlen)
 {
-#ifdef _WIN32
-    HOSTENT *h;
-#endif
-    struct sockaddr_storage service;
-    socklen_t addrlen = 0;
     socklen_t addrlen_hint = 0;
     int socket_error = 0;
-    static AVal ip_domain = {0};
+    AVal ip_domain;
 
-    if (!r->Link.hostname.av_len)
-        return FALSE;
-
-#ifdef _WIN32
-    //COMODO security software sandbox blocks all DNS by returning "host not found"
-    h = gethostbyname("localhost");
-    if (!h && GetLastError() == WSAHOST_NOT_FOUND)
-    {
-        r->last_error_code = WSAHOST_NOT_FOUND;
-        RTMP_Log_Fl(RTMP_LOGERROR, "RTMP_Connect: Connection test failed. This error is likely caused by Comodo Internet Security running OBS in sandbox mode. Please add OBS to the Comodo automatic sandbox exclusion list, restart OBS and try again (11001).");
-        return FALSE;
-    }
-#endif
-
-    memset(&service, 0, sizeof(service));
+    memset(service, 0, sizeof(*service));
 
     if (r->m_bindIP.addrLen)
         addrlen_hint = r->m_bindIP.addrLen;
@@ -1296,7 +1301,7 @@ RTMP_Connect(RTMP *r, RTMPPacket *cp)
     if (r->Link.socksport)
     {
         /* Connect via SOCKS */
-        if (!add_addr_info(&service, &addrlen, &r->Link.sockshost, r->Link.socksport, addrlen_hint, &socket_error))
+        if (!add_addr_info(service, paddrlen, &r->Link.sockshost, r->Link.socksport, addrlen_hint, &socket_error))
         {
             r->last_error_code = socket_error;
             return FALSE;
@@ -1308,19 +1313,47 @@ RTMP_Connect(RTMP *r, RTMPPacket *cp)
         if (r->en_ip_domain && strlen(r->ip_domain) > 0 && r->set_netopt == 1) {
             ip_domain.av_val = r->ip_domain;
             ip_domain.av_len = strlen(r->ip_domain);
-            if (!add_addr_info(&service, &addrlen, &ip_domain, r->Link.port, addrlen_hint, &socket_error))
+            if (!add_addr_info(service, paddrlen, &ip_domain, r->Link.port, addrlen_hint, &socket_error))
             {
                 r->last_error_code = socket_error;
                 return FALSE;
             }
         } else {
-            if (!add_addr_info(&service, &addrlen, &r->Link.hostname, r->Link.port, addrlen_hint, &socket_error))
+            if (!add_addr_info(service, paddrlen, &r->Link.hostname, r->Link.port, addrlen_hint, &socket_error))
             {
                 r->last_error_code = socket_error;
                 return FALSE;
             }
         }
     }
+    return TRUE;
+}
+
+int
+RTMP_Connect(RTMP *r, RTMPPacket *cp)
+{
+#ifdef _WIN32
+    HOSTENT *h;
+#endif
+    struct sockaddr_storage service;
+    socklen_t addrlen = 0;
+
+    if (!r->Link.hostname.av_len)
+        return FALSE;
+
+#ifdef _WIN32
+    //COMODO security software sandbox blocks all DNS by returning "host not found"
+    h = gethostbyname("localhost");
+    if (!h && GetLastError() == WSAHOST_NOT_FOUND)
+    {
+        r->last_error_code = WSAHOST_NOT_FOUND;
+        RTMP_Log_Fl(RTMP_LOGERROR, "RTMP_Connect: Connection test failed. This error is likely caused by Comodo Internet Security running OBS in sandbox mode. Please add OBS to the Comodo automatic sandbox exclusion list, restart OBS and try again (11001).");
+        return FALSE;
+    }
+#endif
+
+    if (!ResolveService(r, &service, &addrlen))
+        return FALSE;
 
     if (!RTMP_Connect0(r, (struct sockaddr *)&service, addrlen))
         return FALSE;
@@ -1330,6 +1363,294 @@ RTMP_Connect(RTMP *r, RTMPPacket *cp)
     return RTMP_Connect1(r, cp);
 }
 
+int
+RTMP_CanConnectAsync(RTMP *r)
+{
+    /* TLS, HTTP and SOCKS have their own blocking exchanges, and the publish
+     * authentication reconnects inside RTMP_ClientPacket() */
+    return !((r->Link.protocol & (RTMP_FEATURE_SSL | RTMP_FEATURE_HTTP)) ||
+             r->Link.socksport || r->Link.pubUser.av_len
+#ifdef CRYPTO
+             || (r->Link.protocol & RTMP_FEATURE_ENC)
+#endif
+            );
+}
+
+/* C0 and C1 of the plain handshake, as HandShake() sends */
+static void
+StartHandShake(RTMP *r, RTMPConnectState *cs)
+{
+    uint32_t uptime;
+    int i;
+
+    cs->phase = RTMP_CONNECT_HANDSHAKE;
+    cs->out[0] = 0x03;		/* not encrypted */
+    uptime = htonl(RTMP_GetTime());
+    memcpy(cs->out + 1, &uptime, 4);
+    memset(cs->out + 5, 0, 4);
+    for (i = 9; i < RTMP_SIG_SIZE + 1; i++)
+        cs->out[i] = (char)(rand() % 256);
+    memcpy(cs->clientsig, cs->out + 1, RTMP_SIG_SIZE);
+    cs->outLen = RTMP_SIG_SIZE + 1;
+    cs->outPos = 0;
+    cs->inLen = 0;
+    cs->sentC2 = FALSE;
+}
+
+int
+RTMP_ConnectStart(RTMP *r, RTMPConnectState *cs)
+{
+    struct sockaddr_storage service;
+    socklen_t addrlen = 0;
+
+    memset(cs, 0, sizeof(*cs));
+    if (!r->Link.hostname.av_len || !ResolveService(r, &service, &addrlen))
+        return FALSE;
+    if (!OpenSocket(r, (struct sockaddr *)&service))
+        return FALSE;
+
+    cs->phase = RTMP_CONNECT_TCP;
+    cs->connectStart = os_gettime_ns();
+    if (connect(r->m_sb.sb_socket, (struct sockaddr *)&service, addrlen) != 0)
+    {
+        int err = GetSockError();
+        if (err != EINPROGRESS)
+        {
+            LogConnectError(r, err);
+            r->last_error_code = err;
+            RTMP_Close(r);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Read what the socket has without blocking, FALSE if it is closed or failed */
+static int
+FillSockBuf(RTMP *r)
+{
+    RTMPSockBuf *sb = &r->m_sb;
+
+    if (sb->sb_size && sb->sb_start != sb->sb_buf)
+        memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
+    sb->sb_start = sb->sb_buf;
+    if (sb->sb_size >= (int)sizeof(sb->sb_buf) - 1)
+        return TRUE;
+
+    sb->sb_timedout = FALSE;
+    if (RTMPSockBuf_Fill(sb) > 0)
+        return TRUE;
+    if (!sb->sb_timedout)
+        r->last_error_code = GetSockError();
+    return sb->sb_timedout;
+}
+
+/* Size of the next chunk if all of it is in the socket buffer, the header is
+ * parsed as RTMP_ReadPacket() reads it. 0 if more is to come */
+static int
+BufferedChunkSize(RTMP *r)
+{
+    const uint8_t *p = (const uint8_t *)r->m_sb.sb_start;
+    int avail = r->m_sb.sb_size;
+    int hSize = 1, nSize, channel, nChunk;
+    uint32_t bodySize = 0, bytesRead = 0;
+    RTMPPacket *prev;
+
+    if (avail < 1)
+        return 0;
+    channel = p[0] & 0x3f;
+    if (channel == 0)
+        hSize = 2;
+    else if (channel == 1)
+        hSize = 3;
+    if (avail < hSize)
+        return 0;
+    if (channel == 0)
+        channel = p[1] + 64;
+    else if (channel == 1)
+        channel = (p[2] << 8) + p[1] + 64;
+
+    nSize = packetSize[(p[0] & 0xc0) >> 6] - 1;
+    if (avail < hSize + nSize)
+        return 0;
+
+    prev = channel < r->m_channelsAllocatedIn ? r->m_vecChannelsIn[channel] : NULL;
+    if (prev && nSize < RTMP_LARGE_HEADER_SIZE - 1)
+    {
+        bodySize = prev->m_nBodySize;
+        bytesRead = prev->m_nBytesRead;
+    }
+    if (nSize >= 3)
+    {
+        if (AMF_DecodeInt24((const char *)p + hSize) == 0xffffff)
+            hSize += 4;
+        if (nSize >= 6)
+        {
+            bodySize = AMF_DecodeInt24((const char *)p + hSize + 3);
+            bytesRead = 0;
+        }
+    }
+    hSize += nSize;
+
+    nChunk = bodySize - bytesRead;
+    if (nChunk > r->m_inChunkSize)
+        nChunk = r->m_inChunkSize;
+    return avail >= hSize + nChunk ? hSize + nChunk : 0;
+}
+
+static int
+StepHandShake(RTMP *r, RTMPConnectState *cs)
+{
+    RTMPSockBuf *sb = &r->m_sb;
+
+    for (;;)
+    {
+        if (cs->outPos < cs->outLen)
+        {
+            int n = send(sb->sb_socket, cs->out + cs->outPos, cs->outLen - cs->outPos, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                int err = GetSockError();
+                if (err == EINTR)
+                    continue;
+                if (err == EAGAIN || err == EWOULDBLOCK)
+                    return RTMP_WAIT_WRITE;
+                r->last_error_code = err;
+                return -1;
+            }
+            cs->outPos += n;
+            continue;
+        }
+
+        /* S0 and S1 are here, C2 echoes S1 */
+        if (!cs->sentC2 && cs->inLen >= RTMP_SIG_SIZE + 1)
+        {
+            if (cs->in[0] != 0x03)
+                RTMP_Log_Fl(RTMP_LOGWARNING, "%s: Type mismatch: client sent %d, server answered %d",
+                         __FUNCTION__, 0x03, cs->in[0]);
+            memcpy(cs->out, cs->in + 1, RTMP_SIG_SIZE);
+            cs->outLen = RTMP_SIG_SIZE;
+            cs->outPos = 0;
+            cs->sentC2 = TRUE;
+            continue;
+        }
+
+        if (cs->inLen == (int)sizeof(cs->in))
+            break;
+
+        if (!sb->sb_size)
+        {
+            if (!FillSockBuf(r))
+                return -1;
+            if (!sb->sb_size)
+                return RTMP_WAIT_READ;
+        }
+        {
+            int n = (int)sizeof(cs->in) - cs->inLen;
+            if (n > sb->sb_size)
+                n = sb->sb_size;
+            memcpy(cs->in + cs->inLen, sb->sb_start, n);
+            sb->sb_start += n;
+            sb->sb_size -= n;
+            cs->inLen += n;
+            r->m_nBytesIn += n;
+        }
+    }
+
+    if (memcmp(cs->in + RTMP_SIG_SIZE + 1, cs->clientsig, RTMP_SIG_SIZE) != 0)
+        RTMP_Log_Fl(RTMP_LOGWARNING, "%s, client signature does not match!", __FUNCTION__);
+
+    if (!SendConnectPacket(r, NULL))
+    {
+        RTMP_Log_Fl(RTMP_LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
+        return -1;
+    }
+    cs->phase = RTMP_CONNECT_PUBLISH;
+    return 0;
+}
+
+/* connect, releaseStream, FCPublish, createStream and publish are answered by
+ * RTMP_ClientPacket() as in RTMP_ConnectStream(), a chunk is read only when all
+ * of it has arrived */
+static int
+StepPublish(RTMP *r, RTMPConnectState *cs)
+{
+    for (;;)
+    {
+        int before;
+
+        while (BufferedChunkSize(r) > 0)
+        {
+            RTMPPacket packet = { 0 };
+            if (!RTMP_ReadPacket(r, &packet))
+                return -1;
+            if (!RTMPPacket_IsReady(&packet))
+                continue;
+            if (packet.m_nBodySize &&
+                    packet.m_packetType != RTMP_PACKET_TYPE_AUDIO &&
+                    packet.m_packetType != RTMP_PACKET_TYPE_VIDEO &&
+                    packet.m_packetType != RTMP_PACKET_TYPE_INFO)
+                RTMP_ClientPacket(r, &packet);
+            RTMPPacket_Free(&packet);
+
+            if (!RTMP_IsConnected(r))
+                return -1;
+            if (r->m_bPlaying)
+            {
+                cs->phase = RTMP_CONNECT_DONE;
+                return 0;
+            }
+        }
+
+        before = r->m_sb.sb_size;
+        if (!FillSockBuf(r))
+            return -1;
+        if (r->m_sb.sb_size == before)
+            return RTMP_WAIT_READ;
+    }
+}
+
+int
+RTMP_ConnectStep(RTMP *r, RTMPConnectState *cs)
+{
+    int ret = 0;
+
+    if (cs->phase == RTMP_CONNECT_TCP)
+    {
+        struct pollfd pfd = { r->m_sb.sb_socket, POLLOUT, 0 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (poll(&pfd, 1, 0) == 0)
+            return RTMP_WAIT_WRITE;
+        if (getsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = GetSockError();
+        if (err)
+        {
+            LogConnectError(r, err);
+            r->last_error_code = err;
+            ret = -1;
+            goto fail;
+        }
+
+        r->connect_time_ms = (int)((os_gettime_ns() - cs->connectStart) / 1000000);
+        SetSocketOptions(r);
+        r->m_bSendCounter = TRUE;
+        StartHandShake(r, cs);
+    }
+
+    if (cs->phase == RTMP_CONNECT_HANDSHAKE && (ret = StepHandShake(r, cs)) != 0)
+        goto fail;
+    if (cs->phase == RTMP_CONNECT_PUBLISH && (ret = StepPublish(r, cs)) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    if (ret < 0)
+        RTMP_Close(r);
+    return ret;
+}
+
 static int
 SocksNegotiate(RTMP *r)
 {
@@ -4350,18 +4671,18 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
     return wrote;
 }
 
-int
-RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+/* Compress the header of packet by the last one sent on its channel and encode it to end at
+ * hend. Return the header size and its first byte in *pc, the basic header of the following
+ * chunks, and the size of channel id extension in *pcSize. Return 0 on failure */
+static int
+EncodePacketHeader(RTMP *r, RTMPPacket *packet, char *hend, char **pheader, char *pc, int *pcSize)
 {
     const RTMPPacket *prevPacket;
     uint32_t last = 0;
     int nSize;
     int hSize, cSize;
-    char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+    char *header, *hptr, c;
     uint32_t t;
-    char *buffer, *tbuf = NULL, *toff = NULL;
-    int nChunkSize;
-    int tlen;
 
     if (packet->m_nChannel >= r->m_channelsAllocatedOut)
     {
@@ -4372,7 +4693,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             free(r->m_vecChannelsOut);
             r->m_vecChannelsOut = NULL;
             r->m_channelsAllocatedOut = 0;
-            return FALSE;
+            return 0;
         }
         r->m_vecChannelsOut = packets;
         memset(r->m_vecChannelsOut + r->m_channelsAllocatedOut, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedOut));
@@ -4398,7 +4719,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     {
         RTMP_Log_Fl(RTMP_LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
                  (unsigned char)packet->m_headerType);
-        return FALSE;
+        return 0;
     }
 
     nSize = packetSize[packet->m_headerType];
@@ -4406,33 +4727,17 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     cSize = 0;
     t = packet->m_nTimeStamp - last;
 
-    if (packet->m_body)
-    {
-        header = packet->m_body - nSize;
-        hend = packet->m_body;
-    }
-    else
-    {
-        header = hbuf + 6;
-        hend = hbuf + sizeof(hbuf);
-    }
-
     if (packet->m_nChannel > 319)
         cSize = 2;
     else if (packet->m_nChannel > 63)
         cSize = 1;
     if (cSize)
-    {
-        header -= cSize;
         hSize += cSize;
-    }
 
     if (nSize > 1 && t >= 0xffffff)
-    {
-        header -= 4;
         hSize += 4;
-    }
 
+    header = hend - hSize;
     hptr = header;
     c = packet->m_headerType << 6;
     switch (cSize)
@@ -4472,6 +4777,40 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     if (nSize > 1 && t >= 0xffffff)
         hptr = AMF_EncodeInt32(hptr, hend, t);
 
+    *pheader = header;
+    *pc = c;
+    *pcSize = cSize;
+    return hSize;
+}
+
+/* Keep the packet sent as the last one of its channel, the next header is compressed by it */
+static void
+KeepSentPacket(RTMP *r, RTMPPacket *packet)
+{
+    if (!r->m_vecChannelsOut[packet->m_nChannel])
+        r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
+    memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+}
+
+int
+RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+{
+    int nSize;
+    int hSize, cSize;
+    char *header, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+    char *buffer, *tbuf = NULL, *toff = NULL;
+    int nChunkSize;
+    int tlen;
+
+    if (packet->m_body)
+        hend = packet->m_body;
+    else
+        hend = hbuf + sizeof(hbuf);
+
+    hSize = EncodePacketHeader(r, packet, hend, &header, &c, &cSize);
+    if (!hSize)
+        return FALSE;
+
     nSize = packet->m_nBodySize;
     buffer = packet->m_body;
     nChunkSize = r->m_outChunkSize;
@@ -4561,12 +4900,191 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
         }
     }
 
-    if (!r->m_vecChannelsOut[packet->m_nChannel])
-        r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-    memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+    KeepSentPacket(r, packet);
+    return TRUE;
+}
+
+/* Chunks gathered by one sendmsg() of RTMP_SendPacketV() */
+#define RTMP_IOV_MAX	256
+
+/* WriteN() of iovecs for a plain socket, a partial write goes on from where it stopped */
+static int
+WriteV(RTMP *r, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0)
+    {
+        ssize_t nBytes;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        nBytes = sendmsg(r->m_sb.sb_socket, &msg, MSG_NOSIGNAL);
+        if (nBytes < 0)
+        {
+            int sockerr = GetSockError();
+            RTMP_Log_Fl(RTMP_LOGERROR, "%s, RTMP send error %d (%d iovecs)", __FUNCTION__,
+                     sockerr, iovcnt);
+
+            if (sockerr == EINTR && !RTMP_ctrlC)
+                continue;
+
+            r->last_error_code = sockerr;
+
+            RTMP_Close(r);
+            return FALSE;
+        }
+        if (nBytes == 0)
+            return FALSE;
+
+        while (iovcnt > 0 && nBytes >= (ssize_t)iov->iov_len)
+        {
+            nBytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + nBytes;
+            iov->iov_len -= nBytes;
+        }
+    }
+    return TRUE;
+}
+
+/* RTMP_SendPacketV() for the transports which need the chunks in one buffer */
+static int
+SendPacketCopy(RTMP *r, RTMPPacket *packet, const struct iovec *body, int bodycnt)
+{
+    char *enc;
+    int i, ret;
+
+    if (!RTMPPacket_Alloc(packet, packet->m_nBodySize))
+        return FALSE;
+    enc = packet->m_body;
+    for (i = 0; i < bodycnt; i++)
+    {
+        memcpy(enc, body[i].iov_base, body[i].iov_len);
+        enc += body[i].iov_len;
+    }
+    ret = RTMP_SendPacket(r, packet, FALSE);
+    RTMPPacket_Free(packet);
+    return ret;
+}
+
+int
+RTMP_CanSendV(RTMP *r)
+{
+    return !((r->Link.protocol & RTMP_FEATURE_HTTP) || r->m_bCustomSend || r->m_sb.sb_ssl
+#ifdef CRYPTO
+             || r->Link.rc4keyOut
+#endif
+            );
+}
+
+int
+RTMP_ChunkIovInit(RTMP *r, RTMPPacket *packet, const struct iovec *body, int bodycnt, RTMPChunkIov *ci)
+{
+    char c;
+
+    ci->hSize = EncodePacketHeader(r, packet, ci->hbuf + sizeof(ci->hbuf), &ci->header, &c, &ci->cSize);
+    if (!ci->hSize)
+        return FALSE;
+
+    /* basic header of the following chunks */
+    ci->chunk[0] = 0xc0 | c;
+    if (ci->cSize)
+    {
+        int tmp = packet->m_nChannel - 64;
+        ci->chunk[1] = tmp & 0xff;
+        if (ci->cSize == 2)
+            ci->chunk[2] = tmp >> 8;
+    }
+    ci->chunkSize = r->m_outChunkSize;
+    ci->left = ci->chunkSize;
+    ci->body = body;
+    ci->bodycnt = bodycnt;
+    ci->idx = 0;
+    ci->off = 0;
+
+    KeepSentPacket(r, packet);
     return TRUE;
 }
 
+int
+RTMP_ChunkIovFill(RTMPChunkIov *ci, struct iovec *iov, int maxiov)
+{
+    int n = 0;
+    size_t len;
+
+    if (ci->hSize && maxiov > 0)
+    {
+        iov[n].iov_base = ci->header;
+        iov[n++].iov_len = ci->hSize;
+        ci->hSize = 0;
+    }
+    /* a chunk header and a piece of body at most each time */
+    while (ci->idx < ci->bodycnt && n < maxiov - 1)
+    {
+        const struct iovec *b = &ci->body[ci->idx];
+        if (ci->off >= b->iov_len)
+        {
+            ci->idx++;
+            ci->off = 0;
+            continue;
+        }
+        if (!ci->left)
+        {
+            iov[n].iov_base = ci->chunk;
+            iov[n++].iov_len = 1 + ci->cSize;
+            ci->left = ci->chunkSize;
+        }
+        len = b->iov_len - ci->off;
+        if (len > (size_t)ci->left)
+            len = ci->left;
+        iov[n].iov_base = (char *)b->iov_base + ci->off;
+        iov[n++].iov_len = len;
+        ci->off += len;
+        ci->left -= len;
+    }
+    return n;
+}
+
+int
+RTMP_SendPacketV(RTMP *r, RTMPPacket *packet, const struct iovec *body, int bodycnt)
+{
+    struct iovec iov[RTMP_IOV_MAX];
+    RTMPChunkIov ci;
+    int n;
+
+    if (!RTMP_CanSendV(r))
+        return SendPacketCopy(r, packet, body, bodycnt);
+
+    if (!RTMP_ChunkIovInit(r, packet, body, bodycnt, &ci))
+        return FALSE;
+    while ((n = RTMP_ChunkIovFill(&ci, iov, RTMP_IOV_MAX)) > 0)
+    {
+        if (!WriteV(r, iov, n))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+void
+RTMP_InitFramePacket(RTMP *r, RTMPPacket *packet, int packetType, uint32_t timestamp,
+                     uint32_t bodySize, int streamIdx)
+{
+    memset(packet, 0, sizeof(*packet));
+    packet->m_nChannel = 0x04;	/* source channel */
+    packet->m_nInfoField2 = r->Link.streams[streamIdx].id;
+    packet->m_packetType = packetType;
+    packet->m_nTimeStamp = timestamp;
+    packet->m_nBodySize = bodySize;
+    /* as RTMP_Write() does for a FLV tag */
+    packet->m_headerType = timestamp ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+}
+
 int
 RTMP_Serve(RTMP *r)
 {
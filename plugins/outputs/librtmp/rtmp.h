@@ -45,6 +45,7 @@
 #include <ws2tcpip.h>
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #define SOCKET int
 #endif
@@ -112,6 +113,34 @@ extern "C"
 #define RTMP_PACKET_TYPE_FLASH_VIDEO        0x16
 
 #define RTMP_MAX_HEADER_SIZE 18
+#define RTMP_SIG_SIZE 1536
+
+    /* Phases of RTMP_ConnectStep() */
+#define RTMP_CONNECT_TCP        1
+#define RTMP_CONNECT_HANDSHAKE  2
+#define RTMP_CONNECT_PUBLISH    3
+#define RTMP_CONNECT_DONE       4
+
+    /* What RTMP_ConnectStep() waits for */
+#define RTMP_WAIT_READ          1
+#define RTMP_WAIT_WRITE         2
+
+    /* A connect driven by readiness of the non-blocking socket */
+    typedef struct RTMPConnectState
+    {
+        int phase;
+        uint64_t connectStart;
+        /* C0+C1, then C2 */
+        char out[RTMP_SIG_SIZE + 1];
+        int outLen;
+        int outPos;
+        int sentC2;
+        char clientsig[RTMP_SIG_SIZE];
+        /* S0+S1+S2 */
+        char in[RTMP_SIG_SIZE * 2 + 1];
+        int inLen;
+    } RTMPConnectState;
+
 
 #define RTMP_PACKET_SIZE_LARGE    0
 #define RTMP_PACKET_SIZE_MEDIUM   1
@@ -146,6 +175,22 @@ extern "C"
         char *m_body;
     } RTMPPacket;
 
+    /* A packet being sent by iovecs, the headers of its chunks are kept here */
+    typedef struct RTMPChunkIov
+    {
+        char hbuf[RTMP_MAX_HEADER_SIZE];
+        char *header;
+        int hSize;
+        char chunk[3];
+        int cSize;
+        int chunkSize;
+        int left;		/* room left in the current chunk */
+        const struct iovec *body;
+        int bodycnt;
+        int idx;
+        size_t off;
+    } RTMPChunkIov;
+
     typedef struct RTMPSockBuf
     {
         SOCKET sb_socket;
@@ -373,11 +418,29 @@ extern "C"
     struct sockaddr;
     int RTMP_Connect0(RTMP *r, struct sockaddr *svc, socklen_t addrlen);
     int RTMP_Connect1(RTMP *r, RTMPPacket *cp);
+    /* Connect and publish without blocking, only resolving the host blocks. Start the
+     * TCP connect, then call RTMP_ConnectStep() when the socket is ready for what it
+     * returned, RTMP_WAIT_READ or RTMP_WAIT_WRITE, until it returns 0 with phase
+     * RTMP_CONNECT_DONE. It returns -1 and closes r on failure. The caller times the
+     * phases out */
+    int RTMP_CanConnectAsync(RTMP *r);
+    int RTMP_ConnectStart(RTMP *r, RTMPConnectState *cs);
+    int RTMP_ConnectStep(RTMP *r, RTMPConnectState *cs);
     int RTMP_Serve(RTMP *r);
     int RTMP_TLS_Accept(RTMP *r, void *ctx);
 
     int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet);
     int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue);
+    /* Send packet of body gathered from iovecs without copying it, the chunk headers
+     * are put between the pieces of body by sendmsg(). m_nBodySize is the total of body */
+    int RTMP_SendPacketV(RTMP *r, RTMPPacket *packet, const struct iovec *body, int bodycnt);
+    /* The chunks can be gathered straight to the socket, not by HTTP, TLS or RC4 */
+    int RTMP_CanSendV(RTMP *r);
+    /* Send packet by the caller: encode its header and fill the iovecs of its chunks by
+     * RTMP_ChunkIovFill() until it returns 0. body stays valid until then */
+    int RTMP_ChunkIovInit(RTMP *r, RTMPPacket *packet, const struct iovec *body, int bodycnt,
+                          RTMPChunkIov *ci);
+    int RTMP_ChunkIovFill(RTMPChunkIov *ci, struct iovec *iov, int maxiov);
     int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk);
     int RTMP_IsConnected(RTMP *r);
     SOCKET RTMP_Socket(RTMP *r);
@@ -426,6 +489,10 @@ extern "C"
     void RTMP_DropRequest(RTMP *r, int i, int freeit);
     int RTMP_Read(RTMP *r, char *buf, int size);
     int RTMP_Write(RTMP *r, const char *buf, int size, int streamIdx);
+    /* The packet of an audio or video message, the body is of a FLV tag without the
+     * tag header that RTMP_Write() parses. timestamp is in ms */
+    void RTMP_InitFramePacket(RTMP *r, RTMPPacket *packet, int packetType, uint32_t timestamp,
+                              uint32_t bodySize, int streamIdx);
 
     /* hashswf.c */
     int RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
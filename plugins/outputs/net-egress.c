@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "util/base.h"
+#include "util/bmem.h"
+#include "util/darray.h"
+#include "util/threading.h"
+#include "util/platform.h"
+#include "net-egress.h"
+
+#define EGRESS_MAX_WORKERS		16
+#define EGRESS_MAX_EVENTS		64
+/**< Set in the epoll data of a notify_fd, a connection is aligned so the bit is free */
+#define EGRESS_NOTIFY_TAG		((uintptr_t)1)
+
+/**< Add or remove of a connection posted by another thread */
+struct egress_cmd {
+	struct egress_conn	*conn;
+	bool				add;
+	bool				done;
+	struct egress_cmd	*next;
+};
+
+struct egress_worker {
+	pthread_t			thread;
+	int					epfd;
+	int					evfd;
+	volatile long		load;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	struct egress_cmd	*cmds;
+
+	/**< Only touched by the worker thread */
+	DARRAY(struct egress_conn *)	conns;
+};
+
+static pthread_once_t egress_once = PTHREAD_ONCE_INIT;
+static struct egress_worker *egress_workers;
+static int egress_worker_num;
+/**< worker of a connection is changed and read by other threads under it */
+static pthread_mutex_t egress_conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool apply_add(struct egress_worker *worker, struct egress_conn *conn)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+	struct epoll_event nev = {
+		.events = EPOLLIN,
+		.data.ptr = (void *)((uintptr_t)conn | EGRESS_NOTIFY_TAG)
+	};
+
+	if (conn->fd >= 0 && epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+		blog(MGW_LOG_ERROR, "egress add fd:%d failed:%s", conn->fd, strerror(errno));
+		return false;
+	}
+	if (conn->notify_fd >= 0 &&
+		epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->notify_fd, &nev) < 0) {
+		blog(MGW_LOG_ERROR, "egress add notify fd:%d failed:%s", conn->notify_fd,
+				strerror(errno));
+		if (conn->fd >= 0)
+			epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		return false;
+	}
+	conn->out_armed = false;
+	conn->due_ns = (int64_t)os_gettime_ns();
+	da_push_back(worker->conns, &conn);
+	return true;
+}
+
+static void apply_remove(struct egress_worker *worker, struct egress_conn *conn)
+{
+	if (conn->worker != worker)
+		return;
+	if (conn->fd >= 0)
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	if (conn->notify_fd >= 0)
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->notify_fd, NULL);
+	da_erase_item(worker->conns, &conn);
+	os_atomic_dec_long(&worker->load);
+	pthread_mutex_lock(&egress_conn_mutex);
+	conn->worker = NULL;
+	pthread_mutex_unlock(&egress_conn_mutex);
+}
+
+/**< Apply on the worker and wait, or directly if already there */
+static bool post_cmd(struct egress_worker *worker, struct egress_conn *conn, bool add)
+{
+	struct egress_cmd cmd = { .conn = conn, .add = add };
+	uint64_t one = 1;
+
+	if (pthread_equal(pthread_self(), worker->thread)) {
+		if (add)
+			return apply_add(worker, conn);
+		apply_remove(worker, conn);
+		return true;
+	}
+
+	pthread_mutex_lock(&worker->mutex);
+	cmd.next = worker->cmds;
+	worker->cmds = &cmd;
+	if (write(worker->evfd, &one, sizeof(one)) < 0)
+		blog(MGW_LOG_ERROR, "egress wake worker failed:%s", strerror(errno));
+	while (!cmd.done)
+		pthread_cond_wait(&worker->cond, &worker->mutex);
+	pthread_mutex_unlock(&worker->mutex);
+	return !add || cmd.add;
+}
+
+static void run_cmds(struct egress_worker *worker)
+{
+	struct egress_cmd *cmds;
+	uint64_t count;
+
+	if (read(worker->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		blog(MGW_LOG_ERROR, "egress read eventfd failed:%s", strerror(errno));
+
+	pthread_mutex_lock(&worker->mutex);
+	cmds = worker->cmds;
+	worker->cmds = NULL;
+	pthread_mutex_unlock(&worker->mutex);
+
+	for (struct egress_cmd *cmd = cmds; cmd; cmd = cmd->next) {
+		if (cmd->add)
+			cmd->add = apply_add(worker, cmd->conn);
+		else
+			apply_remove(worker, cmd->conn);
+	}
+
+	pthread_mutex_lock(&worker->mutex);
+	while (cmds) {
+		struct egress_cmd *next = cmds->next;
+		cmds->done = true;
+		cmds = next;
+	}
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/**< Return false if conn has left the worker */
+static bool run_conn(struct egress_worker *worker, struct egress_conn *conn, uint32_t events)
+{
+	conn->want_out = false;
+	int64_t due = conn->run(conn, events);
+	if (conn->worker != worker)
+		return false;
+
+	if (EGRESS_DONE == due) {
+		apply_remove(worker, conn);
+		return false;
+	}
+
+	bool want_out = conn->fd >= 0 && (EGRESS_WAIT_OUT == due || conn->want_out);
+	if (want_out != conn->out_armed) {
+		struct epoll_event ev = {
+			.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+			.data.ptr = conn
+		};
+		epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+		conn->out_armed = want_out;
+	}
+	conn->due_ns = EGRESS_WAIT_OUT == due ? INT64_MAX : due;
+	return true;
+}
+
+/**< The notify_fd of conn is written, it may have left the worker by an earlier
+ *   event of the same epoll_wait */
+static void run_notify(struct egress_worker *worker, struct egress_conn *conn)
+{
+	uint64_t count;
+
+	if (conn->worker != worker)
+		return;
+	if (read(conn->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		blog(MGW_LOG_ERROR, "egress read notify fd failed:%s", strerror(errno));
+	run_conn(worker, conn, 0);
+}
+
+static int next_timeout(struct egress_worker *worker)
+{
+	int64_t due = INT64_MAX;
+	for (size_t i = 0; i < worker->conns.num; i++) {
+		if (worker->conns.array[i]->due_ns < due)
+			due = worker->conns.array[i]->due_ns;
+	}
+	if (INT64_MAX == due)
+		return -1;
+
+	int64_t wait = due - (int64_t)os_gettime_ns();
+	return wait > 0 ? (int)((wait + 999999) / 1000000) : 0;
+}
+
+static void *egress_thread(void *data)
+{
+	struct egress_worker *worker = data;
+	struct epoll_event events[EGRESS_MAX_EVENTS];
+
+	os_set_thread_name("net-egress: worker");
+	for (;;) {
+		bool has_cmd = false;
+		int n = epoll_wait(worker->epfd, events, EGRESS_MAX_EVENTS, next_timeout(worker));
+		if (n < 0 && errno != EINTR) {
+			blog(MGW_LOG_ERROR, "egress epoll_wait failed:%s", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uintptr_t data = (uintptr_t)events[i].data.ptr;
+			if (!data)
+				has_cmd = true;
+			else if (data & EGRESS_NOTIFY_TAG)
+				run_notify(worker, (struct egress_conn *)(data & ~EGRESS_NOTIFY_TAG));
+			else
+				run_conn(worker, events[i].data.ptr, events[i].events);
+		}
+
+		int64_t now = (int64_t)os_gettime_ns();
+		for (size_t i = 0; i < worker->conns.num;) {
+			struct egress_conn *conn = worker->conns.array[i];
+			if (conn->due_ns > now || run_conn(worker, conn, 0))
+				i++;
+		}
+
+		/**< After the events, none of them is of a connection removed */
+		if (has_cmd)
+			run_cmds(worker);
+	}
+	return NULL;
+}
+
+static void egress_init_once(void)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int num = cores < 1 ? 1 : (cores > EGRESS_MAX_WORKERS ? EGRESS_MAX_WORKERS : (int)cores);
+
+	egress_workers = bzalloc(sizeof(struct egress_worker) * num);
+	for (int i = 0; i < num; i++) {
+		struct egress_worker *worker = &egress_workers[egress_worker_num];
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		worker->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->epfd < 0 || worker->evfd < 0 ||
+			epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->evfd, &ev) < 0)
+			goto fail;
+
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		da_init(worker->conns);
+		if (pthread_create(&worker->thread, NULL, egress_thread, worker) != 0) {
+			pthread_mutex_destroy(&worker->mutex);
+			pthread_cond_destroy(&worker->cond);
+			goto fail;
+		}
+		egress_worker_num++;
+		continue;
+fail:
+		blog(MGW_LOG_ERROR, "egress create worker failed:%s", strerror(errno));
+		if (worker->epfd >= 0)
+			close(worker->epfd);
+		if (worker->evfd >= 0)
+			close(worker->evfd);
+		break;
+	}
+	blog(MGW_LOG_INFO, "egress %d workers running", egress_worker_num);
+}
+
+bool egress_add(struct egress_conn *conn)
+{
+	struct egress_worker *worker = NULL;
+
+	pthread_once(&egress_once, egress_init_once);
+	if (!conn || !conn->run)
+		return false;
+
+	for (int i = 0; i < egress_worker_num; i++) {
+		if (!worker || os_atomic_load_long(&egress_workers[i].load) <
+				os_atomic_load_long(&worker->load))
+			worker = &egress_workers[i];
+	}
+	if (!worker)
+		return false;
+
+	pthread_mutex_lock(&egress_conn_mutex);
+	if (conn->worker) {
+		pthread_mutex_unlock(&egress_conn_mutex);
+		return false;
+	}
+	conn->worker = worker;
+	pthread_mutex_unlock(&egress_conn_mutex);
+
+	os_atomic_inc_long(&worker->load);
+	if (!post_cmd(worker, conn, true)) {
+		pthread_mutex_lock(&egress_conn_mutex);
+		conn->worker = NULL;
+		pthread_mutex_unlock(&egress_conn_mutex);
+		os_atomic_dec_long(&worker->load);
+		return false;
+	}
+	return true;
+}
+
+void egress_remove(struct egress_conn *conn)
+{
+	struct egress_worker *worker;
+
+	if (!conn)
+		return;
+	pthread_mutex_lock(&egress_conn_mutex);
+	worker = conn->worker;
+	pthread_mutex_unlock(&egress_conn_mutex);
+	if (worker)
+		post_cmd(worker, conn, false);
+}
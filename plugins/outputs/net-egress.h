@@ -0,0 +1,51 @@
+#ifndef _OUTPUTS_NET_EGRESS_H_
+#define _OUTPUTS_NET_EGRESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**< Event loops shared by the network outputs, one worker per core instead of a
+ *   thread per output. A connection is a non-blocking socket with a run callback,
+ *   called on its worker when the socket is readable, writable if it asked for
+ *   that, its notify_fd is written or its due time comes. An idle connection
+ *   arms its notify_fd on the ring buffer instead of polling it */
+
+/**< Returned by run, wait for the socket writable instead of a time */
+#define EGRESS_WAIT_OUT		-1
+/**< Returned by run, the worker forgets the connection */
+#define EGRESS_DONE			-2
+
+struct egress_worker;
+
+struct egress_conn {
+	/**< -1 for a connection only run by its due time */
+	int			fd;
+	/**< Eventfd of the owner, -1 if none. Drained by the worker, which runs conn
+	 *   after it is written. Closed by the owner after egress_remove() */
+	int			notify_fd;
+	/**< events of epoll, 0 if called by the due time. Return the next due time
+	 *   of os_gettime_ns(), EGRESS_WAIT_OUT or EGRESS_DONE */
+	int64_t		(*run)(struct egress_conn *conn, uint32_t events);
+	/**< Set by run to wait for the socket writable until the due time returned */
+	bool		want_out;
+
+	/**< Used by the worker */
+	struct egress_worker	*worker;
+	int64_t		due_ns;
+	bool		out_armed;
+};
+
+/**< Run conn on the least loaded worker from now */
+bool egress_add(struct egress_conn *conn);
+/**< Return after run of conn will not be called again, nothing if it is not added.
+ *   May be called by run of conn itself */
+void egress_remove(struct egress_conn *conn);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
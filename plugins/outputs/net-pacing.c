@@ -0,0 +1,77 @@
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "util/platform.h"
+#include "net-pacing.h"
+
+/**< The bucket fills faster than the stream by this, a backlog is drained */
+#define PACING_HEADROOM			1.25
+#define PACING_INTERVAL_MS		100
+/**< Media time of a bitrate measure, the rate is smoothed over the windows */
+#define PACING_WINDOW_US		1000000
+#define PACING_CONGESTED_NS		5000000ULL
+
+void net_pacing_init(struct net_pacing *pacing, bool enabled, double burst)
+{
+	pacing->enabled = enabled;
+	pacing->burst = burst > 0 ? burst : PACING_BURST_DEF;
+	pacing->rate = 0;
+	pacing->tokens = 0;
+	pacing->last_ns = 0;
+	pacing->window_pts = -1;
+	pacing->window_bytes = 0;
+}
+
+void net_pacing_measure(struct net_pacing *pacing, size_t bytes, int64_t pts)
+{
+	if (pacing->window_pts < 0 || pts < pacing->window_pts) {
+		pacing->window_pts = pts;
+		pacing->window_bytes = 0;
+	}
+
+	pacing->window_bytes += bytes;
+	int64_t span = pts - pacing->window_pts;
+	if (span < PACING_WINDOW_US)
+		return;
+
+	uint64_t rate = pacing->window_bytes * 1000000 / span;
+	pacing->rate = pacing->rate ? (pacing->rate * 3 + rate) / 4 : rate;
+	pacing->window_pts = pts;
+	pacing->window_bytes = 0;
+}
+
+static inline int socket_outq(int fd)
+{
+	int outq = 0;
+	if (ioctl(fd, SIOCOUTQ, &outq) < 0)
+		return 0;
+	return outq;
+}
+
+uint64_t net_pacing_delay(struct net_pacing *pacing, int fd)
+{
+	if (!pacing->enabled || !pacing->rate)
+		return 0;
+
+	uint64_t now = os_gettime_ns();
+	double rate = pacing->rate * PACING_HEADROOM;
+	int64_t depth = (int64_t)(pacing->rate * pacing->burst * PACING_INTERVAL_MS / 1000);
+	if (pacing->last_ns)
+		pacing->tokens += (int64_t)(rate * (now - pacing->last_ns) / 1000000000);
+	if (!pacing->last_ns || pacing->tokens > depth)
+		pacing->tokens = depth;
+	pacing->last_ns = now;
+
+	if (fd >= 0 && socket_outq(fd) > depth)
+		return PACING_CONGESTED_NS;
+
+	if (pacing->tokens < 0)
+		return (uint64_t)(-pacing->tokens * 1000000000.0 / rate) + 1;
+	return 0;
+}
+
+void net_pacing_take(struct net_pacing *pacing, size_t bytes)
+{
+	if (pacing->enabled && pacing->rate)
+		pacing->tokens -= bytes;
+}
@@ -0,0 +1,44 @@
+#ifndef _OUTPUTS_NET_PACING_H_
+#define _OUTPUTS_NET_PACING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**< Token bucket pacing of egress. The bucket fills a little faster than the
+ *   bitrate measured from the timestamps of packets, so the sender never falls
+ *   behind the stream, and holds "burst" times PACING_INTERVAL_MS of it. The
+ *   unsent bytes of socket (SIOCOUTQ) beyond the bucket mean the path is
+ *   congested, packets then wait in the ring buffer instead of the kernel */
+#define PACING_BURST_DEF		2.0
+
+struct net_pacing {
+	bool		enabled;
+	double		burst;
+	/**< Bytes per second, 0 until the first window is measured */
+	uint64_t	rate;
+	int64_t		tokens;
+	uint64_t	last_ns;
+
+	int64_t		window_pts;
+	uint64_t	window_bytes;
+};
+
+void net_pacing_init(struct net_pacing *pacing, bool enabled, double burst);
+/**< Count the packet of bytes at pts in us to the bitrate */
+void net_pacing_measure(struct net_pacing *pacing, size_t bytes, int64_t pts);
+/**< Return the ns to wait before reading the next packets if the bucket is in
+ *   debt or the socket fd is congested, 0 to read and send them now */
+uint64_t net_pacing_delay(struct net_pacing *pacing, int fd);
+/**< Take the tokens of bytes read to send, a frame bigger than the bucket is
+ *   sent and the debt delays the next ones */
+void net_pacing_take(struct net_pacing *pacing, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,5 +1,9 @@
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -9,10 +13,14 @@
 #include "util/base.h"
 #include "util/tlog.h"
 #include "util/dstr.h"
+#include "util/darray.h"
 #include "util/platform.h"
 #include "util/callback-handle.h"
 
 #include "formats/flv-mux.h"
+#include "net-pacing.h"
+#include "net-egress.h"
+#include "flv-cache.h"
 #include "librtmp/log.h"
 #include "librtmp/rtmp.h"
 
@@ -26,10 +34,51 @@
 #define NETIF_TYPE_DEF  "default"
 #define NETIF_NAME_DEF  ""
 
+/**< The egress worker looks at the empty ring buffer this often if the output
+ *   has no packet notify */
+#define RTMP_PACKET_POLL_NS     5000000LL
+/**< The send thread of a blocking socket, or the egress worker armed on the ring
+ *   buffer, waits a packet at most this */
+#define RTMP_PACKET_WAIT_MS     100
+/**< The pacing holds the next read for the congested socket at most this, then a
+ *   packet is sent anyway and the error of a dead connection comes out */
+#define RTMP_CONGESTED_WAIT_NS  1000000000LL
+/**< Packets sent by one run of the worker before other streams of it get a turn */
+#define RTMP_EGRESS_BATCH       8
+/**< Frames read at once if aggregate, runs of their tags which fit in a chunk are
+ *   sent as aggregate messages of RTMP_AGGREGATE_MAX_SIZE at most */
+#define RTMP_AGGREGATE_FRAMES   16
+#define RTMP_AGGREGATE_MAX_SIZE 65536
+/**< Previous tag size, FLV tag header and the tag body header of a tag in an
+ *   aggregate message */
+#define RTMP_AGGREGATE_HEAD     (4 + 11 + FLV_BODY_HEADER_MAX + 4)
+/**< The audio and video headers and the frame after them, of each frame read */
+#define RTMP_MAX_MESSAGES       (3 * RTMP_AGGREGATE_FRAMES)
+#define RTMP_EGRESS_IOV         64
+
+/**< Outbound chunk size told to the server by Set Chunk Size */
+#define RTMP_CHUNK_SIZE_DEF     4096
+#define RTMP_CHUNK_SIZE_MAX     65536
+
+/**< Timeouts of the connect phases, TCP connect, handshake and the commands
+ *   from connect to publish */
+#define RTMP_CONNECT_TIMEOUT_DEF    5000
+#define RTMP_HANDSHAKE_TIMEOUT_DEF  5000
+#define RTMP_PUBLISH_TIMEOUT_DEF    10000
+
 //#define TEST_STREAM_TIMESTAMP	1
 
 static pthread_once_t rtmp_context_once = PTHREAD_ONCE_INIT;
 
+/**< A message being written to the socket, its chunks are made by librtmp */
+struct rtmp_message {
+	RTMPChunkIov    ci;
+	uint8_t         header[FLV_BODY_HEADER_MAX + 4];
+	struct iovec    body[2];
+	/**< Headers the data of a header is in, released after sent */
+	struct flv_headers	*headers;
+};
+
 struct rtmp_stream {
     mgw_output_t    *output;
 
@@ -45,12 +94,23 @@ struct rtmp_stream {
 
     volatile bool   connecting;
     pthread_t       connect_thread;
+	/**< Connected by the egress worker, not connect_thread */
+	bool            connect_async;
+	int             connect_error;
+	RTMPConnectState	connect;
+	int64_t         phase_since;
+	uint32_t        connect_timeout_ms, handshake_timeout_ms, publish_timeout_ms;
 
     volatile bool    active;
 	volatile bool    disconnected;
+	/**< Taken by the first of the egress worker and the user stop to finish */
+	volatile bool    finishing;
+	struct egress_conn	conn;
+	/**< TLS and HTTP block in librtmp, they are sent by send_thread instead of the
+	 *   egress worker, joined by the user stop or the next start */
+	bool             send_joinable;
 	pthread_t        send_thread;
 
-    os_sem_t         *send_sem;
 	os_event_t       *stop_event;
 
     uint32_t        netif_mtu;
@@ -62,6 +122,34 @@ struct rtmp_stream {
     struct dstr     username, password;
     struct dstr     encoder_name;
 	uint8_t			*frame_buffer;
+	struct net_pacing	pacing;
+	/**< Tags of the frames shared by the outputs of the same stream */
+	struct flv_cache	*tag_cache;
+
+	/**< State of the egress worker: the packets got from the ring buffer, released
+	 *   after their messages are written, and the iovecs left of the current one.
+	 *   pace_since is when the pacing began to hold the next read, 0 if it is not */
+	struct encoder_packet	packets[RTMP_AGGREGATE_FRAMES];
+	int				packet_num;
+	bool			release_pending;
+	/**< Armed on the ring buffer by the notify_fd of conn */
+	bool			notify_armed;
+	int64_t			pace_since;
+	struct rtmp_message	messages[RTMP_MAX_MESSAGES];
+	int				message_num, message_cur;
+	struct iovec	iov[RTMP_EGRESS_IOV];
+	int				iov_num, iov_cur;
+	/**< What is left of the messages when the socket is full, copied so the packets
+	 *   are released at once instead of pinned until the socket drains */
+	DARRAY(uint8_t)	unsent;
+
+	/**< Small tags of the packets read are bundled to aggregate messages, the
+	 *   heads and iovecs of a tag are at the index of its packet */
+	bool			aggregate;
+	uint32_t		chunk_size;
+	uint8_t			agg_heads[RTMP_AGGREGATE_FRAMES][RTMP_AGGREGATE_HEAD];
+	uint8_t			agg_tails[RTMP_AGGREGATE_FRAMES][4];
+	struct iovec	agg_body[RTMP_AGGREGATE_FRAMES * 3];
 
     RTMP            rtmp;
 
@@ -115,6 +203,13 @@ static mgw_data_t *rtmp_stream_get_default(void)
     mgw_data_set_int(def_settings, "netif_mtu", NETIF_MTU_DEF);
     mgw_data_set_string(def_settings, "netif_type", NETIF_TYPE_DEF);
     mgw_data_set_string(def_settings, "netif_name", NETIF_NAME_DEF);
+	mgw_data_set_bool(def_settings, "pacing", true);
+	mgw_data_set_double(def_settings, "pacing_burst", PACING_BURST_DEF);
+	mgw_data_set_int(def_settings, "connect_timeout_ms", RTMP_CONNECT_TIMEOUT_DEF);
+	mgw_data_set_int(def_settings, "handshake_timeout_ms", RTMP_HANDSHAKE_TIMEOUT_DEF);
+	mgw_data_set_int(def_settings, "publish_timeout_ms", RTMP_PUBLISH_TIMEOUT_DEF);
+	mgw_data_set_int(def_settings, "chunk_size", RTMP_CHUNK_SIZE_DEF);
+	mgw_data_set_bool(def_settings, "aggregate", false);
 
 	return def_settings;
 }
@@ -130,9 +225,12 @@ static mgw_data_t *rtmp_stream_get_settings(void *data)
     mgw_data_set_int(settings, "drop_frames", 
             stream->audio_drop_frames + stream->video_drop_frames);
 	mgw_data_set_int(settings, "total_bytes_sent", stream->total_bytes_sent);
+	mgw_data_set_int(settings, "pacing_kbps", stream->pacing.rate * 8 / 1000);
     mgw_data_set_int(settings, "start_time", stream->start_time);
     mgw_data_set_int(settings, "stop_time", stream->stop_time);
 
+	mgw_data_set_int(settings, "chunk_size", stream->chunk_size);
+	mgw_data_set_bool(settings, "aggregate", stream->aggregate);
     mgw_data_set_int(settings, "netif_mtu", stream->netif_mtu);
     mgw_data_set_string(settings, "netif_type", stream->netif_type.array);
     mgw_data_set_string(settings, "netif_name", stream->netif_name.array);
@@ -165,6 +263,10 @@ static inline int do_output_proc_handler(struct rtmp_stream *stream,
 	return proc_handler_do(handler, name, params);
 }
 
+static void finish_send(struct rtmp_stream *stream);
+static void stop_send(struct rtmp_stream *stream);
+static void abort_connect(struct rtmp_stream *stream);
+
 static void rtmp_stream_destroy(void *data)
 {
     struct rtmp_stream *stream = data;
@@ -174,17 +276,19 @@ static void rtmp_stream_destroy(void *data)
     tlog(TLOG_INFO, "stop and release rtmp stream:%s/%s\n", stream->path.array, stream->key.array);
     if (connecting(stream) || active(stream)) {
         if (stream->connecting)
-            pthread_join(stream->connect_thread, NULL);
+            abort_connect(stream);
 
         stream->stop_time = (uint64_t)time(NULL);
         os_event_signal(stream->stop_event);
+        stream->output->cancel_wait_packet(stream->output);
 
         if(active(stream)) {
-            os_sem_post(stream->send_sem);
-			os_atomic_set_bool(&stream->active, false);
-            pthread_join(stream->send_thread, NULL);
+			stop_send(stream);
+			finish_send(stream);
         }
     }
+	/**< The send thread of a disconnected stream is not joined yet */
+	stop_send(stream);
 
     dstr_free(&stream->path);
     dstr_free(&stream->key);
@@ -195,8 +299,11 @@ static void rtmp_stream_destroy(void *data)
 	dstr_free(&stream->encoder_name);
 
     os_event_destroy(stream->stop_event);
-	os_sem_destroy(stream->send_sem);
+	if (stream->conn.notify_fd >= 0)
+		close(stream->conn.notify_fd);
+	flv_cache_release(stream->tag_cache);
 	bfree(stream->frame_buffer);
+	da_free(stream->unsent);
     bfree(stream);
 }
 
@@ -208,12 +315,12 @@ static void *rtmp_stream_create(mgw_data_t *setting, mgw_output_t *output)
     pthread_once(&rtmp_context_once, rtmp_stream_init_once);
     RTMP_Init(&stream->rtmp);
 
+    stream->conn.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     if (os_event_init(&stream->stop_event, OS_EVENT_TYPE_MANUAL) != 0)
 		goto rtmp_fail;
-    if (os_sem_init(&stream->send_sem, 0) != 0)
-        goto rtmp_fail;
 
 	stream->frame_buffer = bzalloc(MGW_MAX_PACKET_SIZE + MGW_AVCC_HEADER_SIZE);
+	stream->tag_cache = flv_cache_get(output->parent_stream);
 	//os_event_signal(stream->stop_event);
 
     //UNUSED_PARAMETER(setting);
@@ -276,276 +383,523 @@ static inline void set_rtmp_dstr(AVal *val, struct dstr *str)
 	val->av_len = valid ? (int)str->len : 0;
 }
 
-static bool discard_recv_data(struct rtmp_stream *stream, size_t size)
+/**< Drain what the server sends, return false if it has closed */
+static bool discard_recv_data(struct rtmp_stream *stream)
 {
     RTMP *rtmp = (RTMP*)&stream->rtmp;
     uint8_t buf[512];
-    size_t ret;
- 
-    do
-    {
-        size_t bytes = size > 512 ? 512 : size;
-        size -= bytes;
-        ret = recv(rtmp->m_sb.sb_socket, buf, bytes, 0);
-        if (ret <= 0)
-        {
-            int error = errno;
-            blog(MGW_LOG_ERROR, "rtmp socket recv error: %d (%d bytes)", error, (int)size);
-            return false;
-        }
+    ssize_t ret;
+
+    for (;;) {
+        ret = recv(rtmp->m_sb.sb_socket, buf, sizeof(buf), MSG_DONTWAIT);
+        if (ret > 0 || (ret < 0 && EINTR == errno))
+            continue;
+        if (ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return true;
+
+        blog(MGW_LOG_ERROR, "rtmp socket recv error: %d", ret < 0 ? errno : 0);
+        return false;
     }
-    while (size > 0);
-    return true;
 }
 
-static bool send_packet_internal(struct rtmp_stream *stream,
-		struct encoder_packet *packet, bool is_header, size_t idx)
+/**< Bigend */
+static inline uint8_t *put_be32(uint8_t **output, uint32_t nVal)
 {
-	uint8_t *data;
-	size_t  size;
-	int     recv_size = 0;
-	bool    ret = false;
+    (*output)[3] = nVal & 0xff;
+    (*output)[2] = nVal >> 8;
+    (*output)[1] = nVal >> 16;
+    (*output)[0] = nVal >> 24;
+    return (*output)+4;
+}
 
+/**< pts of packet to ms from the first video frame, false if it is before that */
+static bool rebase_packet(struct rtmp_stream *stream,
+		struct encoder_packet *packet, bool is_header)
+{
 	uint64_t tick = packet->pts / 1000;
 
 	if (!stream->start_dts_offset && !is_header) {
 		if (ENCODER_VIDEO == packet->type)
 			stream->start_dts_offset = tick;
 		else
-			return true;
-	}
-
-	if (!stream->new_socket_loop) {
-		ret = ioctl(stream->rtmp.m_sb.sb_socket, FIONREAD, &recv_size);
-		if (ret >= 0 && recv_size > 0) {
-			if (!discard_recv_data(stream, (size_t)recv_size)) {
-                ret = false;
-                goto error;
-            }
-		}
+			return false;
 	}
 
 	packet->dts = packet->pts = tick - stream->start_dts_offset;
 	if (packet->dts < stream->last_dts) {
 		tlog(TLOG_ERROR, "current dst:%"PRId64" is small than last:%"PRId64"\n", packet->dts, stream->last_dts);
 	}
+	return true;
+}
 
-	flv_packet_mux(packet, is_header ? 0 : stream->start_dts_offset,
-			&data, &size, is_header);
+/**< Queue the next message of rtmp_packet with body, which stays valid until it is
+ *   written. headers are kept until then if the body is in them */
+static bool queue_message(struct rtmp_stream *stream, RTMPPacket *rtmp_packet,
+		const struct iovec *body, int bodycnt, struct flv_headers *headers)
+{
+	struct rtmp_message *msg = &stream->messages[stream->message_num];
+
+	/**< TLS or HTTP, the worker writes it blocking */
+	if (!RTMP_CanSendV(&stream->rtmp))
+		return RTMP_SendPacketV(&stream->rtmp, rtmp_packet, body, bodycnt) > 0;
+
+	if (!RTMP_ChunkIovInit(&stream->rtmp, rtmp_packet, body, bodycnt, &msg->ci))
+		return false;
+	msg->headers = headers;
+	flv_headers_addref(headers);
+	stream->message_num++;
+	return true;
+}
+
+/**< Queue packet to the socket, its data is sent from where it is by iovecs, only the
+ *   FLV tag body header of tag, or built for a header, is put in front of it. The
+ *   packet of a header is in headers, which is kept until it is sent */
+static bool send_packet_internal(struct rtmp_stream *stream,
+		struct encoder_packet *packet, struct flv_headers *headers, size_t idx,
+		const struct flv_tag *tag)
+{
+	struct rtmp_message *msg = &stream->messages[stream->message_num];
+	RTMPPacket rtmp_packet;
+	size_t  header_size;
+	bool    is_header = !!headers;
+	bool    ret = false;
+
+	if (!rebase_packet(stream, packet, is_header))
+		return true;
+	if (!packet->data || !packet->size)
+		return true;
+
+	if (tag) {
+		/**< Copied, the slot of the cache may be taken by another frame while queued */
+		header_size = tag->header_size;
+		memcpy(msg->header, tag->header, header_size);
+	} else {
+		header_size = flv_packet_body_header(packet, is_header, msg->header);
+	}
+	msg->body[0].iov_base = msg->header;
+	msg->body[0].iov_len  = header_size;
+	msg->body[1].iov_base = packet->data;
+	msg->body[1].iov_len  = packet->size;
+	RTMP_InitFramePacket(&stream->rtmp, &rtmp_packet, ENCODER_VIDEO == packet->type ?
+			RTMP_PACKET_TYPE_VIDEO : RTMP_PACKET_TYPE_AUDIO, (uint32_t)packet->pts,
+			(uint32_t)(header_size + packet->size), (int)idx);
+	ret = queue_message(stream, &rtmp_packet, msg->body, 2, headers);
 
-	ret = (RTMP_Write(&stream->rtmp, (char*)data, (int)size, (int)idx) > 0);
-	bfree(data);
-	
 	stream->last_dts = packet->dts;
-	stream->total_bytes_sent += size;
-error:
-    if (is_header)
-		bfree(packet->data);
+	stream->total_bytes_sent += header_size + packet->size;
 	return ret;
 }
 
-static bool send_meta_data(struct rtmp_stream *stream, size_t idx)
+/**< The socket is full with packets of the ring buffer in the messages, copy the
+ *   rest of the messages and send it from the copy, so the packets are released now.
+ *   The writer may cover a frame pinned while a slow socket drains */
+static void copy_unsent(struct rtmp_stream *stream)
 {
-	uint8_t *meta_data = NULL;
-	size_t  meta_data_size = 0;
+	da_resize(stream->unsent, 0);
+	for (;;) {
+		for (int i = stream->iov_cur; i < stream->iov_num; i++)
+			da_push_back_array(stream->unsent, stream->iov[i].iov_base,
+					stream->iov[i].iov_len);
+		stream->iov_num = stream->iov_cur = 0;
+		if (stream->message_cur == stream->message_num)
+			break;
 
-	call_params_t params = {};
-	if (0 != do_source_proc_handler(stream, "get_encoder_settings", &params)) {
-		tlog(TLOG_ERROR, "Couldn't get encoder settings!\n");
-		return false;
+		struct rtmp_message *msg = &stream->messages[stream->message_cur];
+		stream->iov_num = RTMP_ChunkIovFill(&msg->ci, stream->iov, RTMP_EGRESS_IOV);
+		if (!stream->iov_num) {
+			flv_headers_release(msg->headers);
+			msg->headers = NULL;
+			stream->message_cur++;
+		}
 	}
 
-	bool success = flv_meta_data((mgw_data_t*)params.out,
-						&meta_data, &meta_data_size, false, idx);
-	if (success) {
-		success = RTMP_Write(&stream->rtmp, (char*)meta_data,
-				(int)meta_data_size, (int)idx) >= 0;
-		mgw_data_release((mgw_data_t*)params.out);
-		bfree(meta_data);
+	stream->message_num = stream->message_cur = 0;
+	stream->iov[0].iov_base = stream->unsent.array;
+	stream->iov[0].iov_len = stream->unsent.num;
+	stream->iov_num = 1;
+}
+
+/**< Release the packets of the messages, false if the writer covered one meanwhile.
+ *   What is sent or copied of it may be torn, so the connection is dropped */
+static bool release_packets(struct rtmp_stream *stream)
+{
+	stream->release_pending = false;
+	if (stream->output->release_encoder_packet(stream->output) >= 0)
+		return true;
+	blog(MGW_LOG_ERROR, "rtmp packet covered by the writer while sending");
+	return false;
+}
+
+/**< Write the queued messages without blocking, return 1 if the socket is full, 0
+ *   after all are written and their packet is released, -1 on error */
+static int send_messages(struct rtmp_stream *stream)
+{
+	for (;;) {
+		if (stream->iov_cur == stream->iov_num) {
+			if (stream->message_cur == stream->message_num)
+				break;
+			struct rtmp_message *msg = &stream->messages[stream->message_cur];
+			stream->iov_num = RTMP_ChunkIovFill(&msg->ci, stream->iov, RTMP_EGRESS_IOV);
+			stream->iov_cur = 0;
+			if (!stream->iov_num) {
+				flv_headers_release(msg->headers);
+				msg->headers = NULL;
+				stream->message_cur++;
+				continue;
+			}
+		}
+
+		struct msghdr mh = {
+			.msg_iov    = stream->iov + stream->iov_cur,
+			.msg_iovlen = stream->iov_num - stream->iov_cur
+		};
+		ssize_t n = sendmsg(stream->rtmp.m_sb.sb_socket, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				if (stream->release_pending) {
+					copy_unsent(stream);
+					if (!release_packets(stream))
+						return -1;
+				}
+				return 1;
+			}
+			blog(MGW_LOG_ERROR, "rtmp socket send error: %d", errno);
+			return -1;
+		}
+
+		while (n > 0) {
+			struct iovec *iov = &stream->iov[stream->iov_cur];
+			if ((size_t)n < iov->iov_len) {
+				iov->iov_base = (uint8_t *)iov->iov_base + n;
+				iov->iov_len -= n;
+				break;
+			}
+			n -= iov->iov_len;
+			stream->iov_cur++;
+		}
 	}
 
-	return success;
+	stream->message_num = stream->message_cur = 0;
+	stream->iov_num = stream->iov_cur = 0;
+	if (stream->release_pending && !release_packets(stream))
+		return -1;
+	return 0;
+}
+
+static void drop_messages(struct rtmp_stream *stream)
+{
+	for (int i = stream->message_cur; i < stream->message_num; i++) {
+		flv_headers_release(stream->messages[i].headers);
+		stream->messages[i].headers = NULL;
+	}
+	stream->message_num = stream->message_cur = 0;
+	stream->iov_num = stream->iov_cur = 0;
+	da_resize(stream->unsent, 0);
 }
 
-static bool send_audio_header(struct rtmp_stream *stream, size_t idx,
-		bool *next, int64_t ts)
+/**< Build the headers of the stream from the source, done by the first output
+ *   after the source changed them, the others share the ones built */
+static bool build_headers(void *param, struct flv_headers *headers)
 {
+	struct rtmp_stream *stream = param;
+	mgw_data_t *settings;
 	call_params_t params = {};
-	char header[8] = {0xaf, 0x00};
-	struct encoder_packet packet   = {
-		.type         = ENCODER_AUDIO,
-		.timebase_den = 1,
-		.pts		  = ts,
-		.dts		  = ts
-	};
 
 	if (0 != do_source_proc_handler(stream, "get_encoder_settings", &params)) {
-		tlog(TLOG_ERROR, "Couldn't get source settings!\n");
+		tlog(TLOG_ERROR, "Couldn't get encoder settings!\n");
 		return false;
 	}
-	int channels = mgw_data_get_int((mgw_data_t*)params.out, "channels");
-	int samplesize = mgw_data_get_int((mgw_data_t*)params.out, "samplesize");
-	if (samplesize == 8) header[0] &= 0xfd;
-	if (channels == 1) header[0] &= 0xfe;
-	mgw_data_release((mgw_data_t*)params.out);
+	settings = (mgw_data_t*)params.out;
+	bool success = flv_meta_data(settings, &headers->meta,
+						&headers->meta_size, false, 0);
+	int channels = mgw_data_get_int(settings, "channels");
+	int samplesize = mgw_data_get_int(settings, "samplesize");
+	mgw_data_release(settings);
+	if (!success)
+		return false;
 
+	memset(&params, 0, sizeof(params));
 	if (0 != do_source_proc_handler(stream, "get_audio_header", &params)) {
 		tlog(TLOG_ERROR, "Couldn't get audio header!\n");
 		return false;
 	}
 	//must be flv header + AudioSpecificConfig -- aac
-	packet.size = params.out_size + 2;
-	memcpy(header + 2, params.out, params.out_size);
-	packet.data = bmemdup(header, packet.size);
+	headers->audio_size = params.out_size + 2;
+	headers->audio = bmalloc(headers->audio_size);
+	headers->audio[0] = 0xaf;
+	headers->audio[1] = 0x00;
+	if (samplesize == 8) headers->audio[0] &= 0xfd;
+	if (channels == 1) headers->audio[0] &= 0xfe;
+	if (params.out_size)
+		memcpy(headers->audio + 2, params.out, params.out_size);
 	bfree(params.out);
-	return send_packet_internal(stream, &packet, true, idx);
+
+	memset(&params, 0, sizeof(params));
+	if (0 != do_source_proc_handler(stream, "get_video_header", &params)) {
+		tlog(TLOG_ERROR, "Couldn't get video header!\n");
+		return false;
+	}
+	// must be AVCDecoderConfigurationRecord -- avc
+	headers->video = params.out;
+	headers->video_size = params.out_size;
+	return true;
 }
 
-static bool send_video_header(struct rtmp_stream *stream, int64_t ts)
+/**< The headers of the source now, shared with the other outputs of the stream */
+static inline struct flv_headers *get_headers(struct rtmp_stream *stream)
+{
+	return flv_cache_get_headers(stream->tag_cache,
+			stream->output->get_source_header_version(stream->output),
+			build_headers, stream);
+}
+
+static bool send_meta_data(struct rtmp_stream *stream, size_t idx)
+{
+	struct flv_headers *headers = get_headers(stream);
+	if (!headers)
+		return false;
+
+	bool success = RTMP_Write(&stream->rtmp, (char*)headers->meta,
+				(int)headers->meta_size, (int)idx) >= 0;
+	flv_headers_release(headers);
+	return success;
+}
+
+static bool send_audio_header(struct rtmp_stream *stream,
+		struct flv_headers *headers, size_t idx, int64_t ts)
+{
+	struct encoder_packet packet   = {
+		.type         = ENCODER_AUDIO,
+		.timebase_den = 1,
+		.pts		  = ts,
+		.dts		  = ts,
+		.data         = headers->audio,
+		.size         = headers->audio_size
+	};
+	return send_packet_internal(stream, &packet, headers, idx, NULL);
+}
+
+static bool send_video_header(struct rtmp_stream *stream,
+		struct flv_headers *headers, int64_t ts)
 {
-	call_params_t params = {};
 	struct encoder_packet packet   = {
 		.type         = ENCODER_VIDEO,
 		.timebase_den = 1,
 		.keyframe     = true,
 		.pts		  = ts,
-		.dts		  = ts
+		.dts		  = ts,
+		.data         = headers->video,
+		.size         = headers->video_size
 	};
-
-	if (0 != do_source_proc_handler(stream, "get_video_header", &params)) {
-		tlog(TLOG_ERROR, "Couldn't get audio header!\n");
-		return false;
-	}
-	// must be AVCDecoderConfigurationRecord -- avc
-	packet.size = params.out_size;
-	packet.data = params.out;
-	return send_packet_internal(stream, &packet, true, 0);
+	return send_packet_internal(stream, &packet, headers, 0, NULL);
 }
 
+/**< Queued by reference, resending them on a key frame allocates nothing */
 static inline bool send_headers(struct rtmp_stream *stream, int64_t ts)
 {
-	stream->sent_headers = true;
-	size_t i = 0;
-	bool next = true;
+	struct flv_headers *headers = get_headers(stream);
+	bool success;
 
-	if (!send_audio_header(stream, i++, &next, ts))
-		return false;
-	if (!send_video_header(stream, ts))
+	stream->sent_headers = true;
+	if (!headers)
 		return false;
 
-	return true;
+	success = send_audio_header(stream, headers, 0, ts) &&
+			send_video_header(stream, headers, ts);
+	flv_headers_release(headers);
+	return success;
 }
 
-/**< Bigend */
-static inline uint8_t *put_be32(uint8_t **output, uint32_t nVal)
+/**< Send annexB format as avcc format by the tag of the cache, the payload is
+ *   found once for all outputs of the stream */
+static inline bool send_packet(struct rtmp_stream *stream, struct encoder_packet *packet)
 {
-    (*output)[3] = nVal & 0xff;
-    (*output)[2] = nVal >> 8;
-    (*output)[1] = nVal >> 16;
-    (*output)[0] = nVal >> 24;
-    return (*output)+4;
+	struct flv_tag tag;
+
+	if (!packet->data || !packet->size)
+		return true;
+	if (!flv_cache_get_tag(stream->tag_cache, packet, &tag))
+		return true;
+
+	packet->data += tag.offset;
+	packet->size  = tag.size;
+	return send_packet_internal(stream, packet, NULL, packet->track_idx, &tag);
 }
 
-static bool send_key_frame(struct rtmp_stream *stream, struct encoder_packet *packet)
+static bool send_frame(struct rtmp_stream *stream, struct encoder_packet *packet)
 {
-	uint8_t *data = NULL;
-	size_t size = 0;
+	if (!stream->sent_headers ||
+		(FRAME_PRIORITY_LOW == packet->priority &&
+		 packet->keyframe && ENCODER_VIDEO == packet->type)) {
 
-	size = mgw_avc_get_keyframe((const uint8_t*)packet->data,
-										packet->size, &data);
-	if (size <= 0) {
-		blog(MGW_LOG_ERROR, "Couldn't find key frame!, size = %ld", size);
-		return true;
+		if (!send_headers(stream, stream->sent_headers?packet->pts:0))
+			return false;
 	}
 
-	packet->data = data - 4;
-	put_be32(&packet->data, size);
-	packet->size = size + 4;
-	return send_packet_internal(stream, packet, false, packet->track_idx);
+	return send_packet(stream, packet);
 }
 
-/**< Modify avcc format to annexB format */
-static inline bool send_packet(struct rtmp_stream *stream, struct encoder_packet *packet)
+static inline uint8_t *put_be24(uint8_t *p, uint32_t val)
 {
-	if (packet->type == ENCODER_AUDIO) {
-		if (!(packet->data[1] & 0x01)) {
-			int packet_len = ((packet->data[3]&0x03) << 11) + \
-							(packet->data[4] << 3) + ((packet->data[5] & 0xe0) >> 5);
-			if (packet->size == packet_len) {
-				packet->data += 9;
-				packet->size -= 9;
-			}
-		} else {
-			packet->data += 7;
-			packet->size -= 7;
-		}
-	} else if (packet->type == ENCODER_VIDEO) {
-		int start_code = mgw_avc_get_startcode_len(packet->data);
-		if (start_code == 3) {
-			packet->data -= 1;
-			put_be32(&packet->data, packet->size - 3);
-			packet->size += 1;
-		} else if (start_code == 4) {
-			put_be32(&packet->data, packet->size - 4);
-		} else if (start_code < 0) {
-			blog(MGW_LOG_ERROR, "Couldn't find the NALU start code, "
-						"data[0]:%02x, data[1]:%02x, data[2]:%02x, data[3]:%02x, data[3]:%02x",
-						packet->data[0], packet->data[1], packet->data[2],packet->data[3],packet->data[4]);
-			return true;
-		}
-	}
+	p[0] = val >> 16;
+	p[1] = val >> 8;
+	p[2] = val;
+	return p + 3;
+}
 
-	return send_packet_internal(stream, packet, false, packet->track_idx);
+/**< A tag small enough to share a chunk with others, not a key frame which may
+ *   come after the headers */
+static inline bool can_aggregate(struct rtmp_stream *stream,
+		const struct encoder_packet *packet)
+{
+	return stream->sent_headers && stream->start_dts_offset &&
+		packet->data && packet->size &&
+		!(packet->keyframe && ENCODER_VIDEO == packet->type) &&
+		packet->size + RTMP_AGGREGATE_HEAD <= stream->chunk_size;
 }
 
-static void *send_thread(void *data)
+/**< Send packets from "from" to "to" as one aggregate message, the FLV tags of
+ *   them one after another. Its timestamp is of the first tag, so the server
+ *   takes the timestamps of the tags as they are */
+static bool send_aggregate(struct rtmp_stream *stream, int from, int to)
 {
-	struct rtmp_stream *stream = data;
-	int ret = 0, sleep_freq = 6;
-	bool success = false;
-
-#define SET_DISCONNECT(stream) do { \
-		tlog(TLOG_ERROR, "error occur! will disconnect !\n"); \
-		os_atomic_set_bool(&stream->disconnected, true); \
-		goto error; \
-	} while (false)
-
-	os_set_thread_name("rtmp-stream: send_thread");
-	blog(MGW_LOG_INFO, "rtmp-stream thread running!");
-    while(active(stream)) {
-		if (stopping(stream))
-			break;
+	struct iovec *body = stream->agg_body + 3 * from;
+	RTMPPacket rtmp_packet;
+	uint32_t prev_size = 0, ts = 0, size = 0;
+	int bodycnt = 0;
+	uint8_t *p;
+
+	for (int i = from; i < to; i++) {
+		struct encoder_packet *packet = &stream->packets[i];
+		struct flv_tag tag;
+		uint32_t data_size, tick;
+
+		if (!flv_cache_get_tag(stream->tag_cache, packet, &tag))
+			continue;
+		rebase_packet(stream, packet, false);
+		tick = (uint32_t)packet->pts;
+		if (!bodycnt)
+			ts = tick;
+
+		p = stream->agg_heads[i];
+		if (bodycnt)
+			p = put_be32(&p, prev_size);
+		data_size = tag.header_size + tag.size;
+		*p++ = ENCODER_VIDEO == packet->type ?
+				RTMP_PACKET_TYPE_VIDEO : RTMP_PACKET_TYPE_AUDIO;
+		p = put_be24(p, data_size);
+		p = put_be24(p, tick);
+		*p++ = (tick >> 24) & 0x7f;
+		p = put_be24(p, 0);
+		memcpy(p, tag.header, tag.header_size);
+		p += tag.header_size;
+
+		body[bodycnt].iov_base = stream->agg_heads[i];
+		body[bodycnt++].iov_len = p - stream->agg_heads[i];
+		body[bodycnt].iov_base = packet->data + tag.offset;
+		body[bodycnt++].iov_len = tag.size;
+		size += (uint32_t)(p - stream->agg_heads[i]) + tag.size;
+		prev_size = 11 + data_size;
+		stream->last_dts = packet->dts;
+	}
+	if (!bodycnt)
+		return true;
 
-		struct encoder_packet packet = {};
-		packet.data = stream->frame_buffer + MGW_AVCC_HEADER_SIZE;
-		if (0 >= (ret = stream->output->get_encoder_packet(
-								stream->output, &packet))) {
-			usleep(1 * 1000);
-            continue;
-        }
+	p = stream->agg_tails[to - 1];
+	put_be32(&p, prev_size);
+	body[bodycnt].iov_base = stream->agg_tails[to - 1];
+	body[bodycnt++].iov_len = 4;
+	size += 4;
 
-		if (!stream->sent_headers ||
-			(FRAME_PRIORITY_LOW == packet.priority &&
-			 packet.keyframe && ENCODER_VIDEO == packet.type)) {
+	RTMP_InitFramePacket(&stream->rtmp, &rtmp_packet,
+			RTMP_PACKET_TYPE_FLASH_VIDEO, ts, size, 0);
+	stream->total_bytes_sent += size;
+	return queue_message(stream, &rtmp_packet, body, bodycnt, NULL);
+}
 
-			if (!send_headers(stream, stream->sent_headers?packet.pts:0))
-				SET_DISCONNECT(stream);
+/**< Send the packets read, runs of small tags are aggregated if enabled */
+static bool send_packets(struct rtmp_stream *stream)
+{
+	int i = 0, j;
+
+	while (i < stream->packet_num) {
+		size_t size = 0;
+		for (j = i; stream->aggregate && j < stream->packet_num &&
+				can_aggregate(stream, &stream->packets[j]); j++) {
+			size += stream->packets[j].size + RTMP_AGGREGATE_HEAD;
+			if (size > RTMP_AGGREGATE_MAX_SIZE)
+				break;
 		}
 
-		if (packet.keyframe && ENCODER_VIDEO == packet.type) {
-			if (!send_key_frame(stream, &packet))
-				SET_DISCONNECT(stream);
-		} else {
-			if (!send_packet(stream, &packet))
-				SET_DISCONNECT(stream);
+		if (j - i > 1) {
+			if (!send_aggregate(stream, i, j))
+				return false;
+			i = j;
+		} else if (!send_frame(stream, &stream->packets[i++])) {
+			return false;
 		}
+	}
+	return true;
+}
+
+/**< Read a packet, or the ones available at once if aggregate, return the count.
+ *   Copied to frame_buffer if copy, else zero copy and released after sent */
+static int read_packets(struct rtmp_stream *stream, bool copy)
+{
+	/**< Zero copy, frame_buffer is only for the frames wrapping in the ring buffer */
+	memset(&stream->packets[0], 0, sizeof(stream->packets[0]));
+	stream->packets[0].data = stream->frame_buffer + MGW_AVCC_HEADER_SIZE;
+	if (!stream->aggregate && !copy)
+		return stream->output->get_encoder_packet_ref(
+					stream->output, &stream->packets[0]) > 0 ? 1 : 0;
+
+	int num = stream->output->get_encoder_packets(stream->output, stream->packets,
+				stream->aggregate ? RTMP_AGGREGATE_FRAMES : 1,
+				stream->frame_buffer + MGW_AVCC_HEADER_SIZE, MGW_MAX_PACKET_SIZE, copy);
+	return num > 0 ? num : 0;
+}
 
-		stream->sent_frames++;
-		if (0 == (stream->sent_frames % sleep_freq))
-			usleep(10 *1000);
+static inline void disarm_notify(struct rtmp_stream *stream)
+{
+	if (stream->notify_armed) {
+		stream->output->disarm_packet_notify(stream->output);
+		stream->notify_armed = false;
 	}
-error:
-#undef SET_DISCONNECT
+}
+
+/**< Wait packets by the notify_fd of conn, return false if there are some now.
+ *   *due is when to look at the ring buffer again anyway */
+static bool arm_notify(struct rtmp_stream *stream, int64_t now, int64_t *due)
+{
+	int ret = EINVAL;
+
+	if (stream->output->arm_packet_notify && stream->conn.notify_fd >= 0)
+		ret = stream->output->arm_packet_notify(stream->output, stream->conn.notify_fd);
+	if (0 == ret)
+		return false;
+
+	stream->notify_armed = EAGAIN == ret;
+	*due = now + (stream->notify_armed ? RTMP_PACKET_WAIT_MS * 1000000LL :
+			RTMP_PACKET_POLL_NS);
+	return true;
+}
+
+/**< The stream has left the egress worker, stopped by the user or disconnected */
+static void finish_send(struct rtmp_stream *stream)
+{
+	int ret = 0;
+
+	/**< signal_stop of a disconnect comes back by rtmp_stream_stop */
+	if (!os_atomic_compare_swap_bool(&stream->finishing, false, true))
+		return;
+
+	drop_messages(stream);
+	disarm_notify(stream);
+	stream->pace_since = 0;
+	stream->release_pending = false;
+	stream->output->release_encoder_packet(stream->output);
 
 	if (disconnected(stream)) 
 		tlog(TLOG_INFO, "Disconnected from %s/%s\n", stream->path.array, stream->key.array);
@@ -555,8 +909,7 @@ error:
 	stream->output->last_error_status = stream->rtmp.last_error_code;
 	RTMP_Close(&stream->rtmp);
 	if (!stopping(stream) && disconnected(stream)) {
-		pthread_detach(stream->send_thread);
-		tlog(TLOG_INFO, "rtmp stream send_thread signal stop, ret:%d", MGW_DISCONNECTED);
+		tlog(TLOG_INFO, "rtmp stream egress signal stop, ret:%d", MGW_DISCONNECTED);
 		// stream->output->signal_stop(stream->output, MGW_OUTPUT_DISCONNECTED);
 		ret = MGW_DISCONNECTED;
 		call_params_t params = {.in = &ret};
@@ -565,16 +918,133 @@ error:
 
 	stream->sent_headers = false;
 	os_event_reset(stream->stop_event);
-	success = os_atomic_set_bool(&stream->active, false);
+	os_atomic_set_bool(&stream->active, false);
+}
+
+/**< Run by the egress worker, never blocks on a plain socket: the queued messages are
+ *   written until the socket is full, then packets are taken from the ring buffer as
+ *   the pacing allows */
+static int64_t rtmp_stream_run(struct egress_conn *conn, uint32_t events)
+{
+	struct rtmp_stream *stream = (struct rtmp_stream *)((uint8_t *)conn -
+					offsetof(struct rtmp_stream, conn));
+	int64_t now;
+	int ret;
+
+	if (stopping(stream) || !active(stream))
+		return EGRESS_DONE;
+
+	if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !stream->new_socket_loop &&
+		!discard_recv_data(stream))
+		goto disconnect;
+	disarm_notify(stream);
+
+	for (int i = 0; i < RTMP_EGRESS_BATCH; i++) {
+		if ((ret = send_messages(stream)) < 0)
+			goto disconnect;
+		if (ret > 0)
+			return EGRESS_WAIT_OUT;
+
+		/**< Paced before reading, the packets stay in the ring buffer unpinned while
+		 *   waiting, and a lagging reader sheds them by its lag policy */
+		now = (int64_t)os_gettime_ns();
+		uint64_t wait_ns = net_pacing_delay(&stream->pacing, conn->fd);
+		if (wait_ns) {
+			if (!stream->pace_since)
+				stream->pace_since = now;
+			if (now - stream->pace_since < RTMP_CONGESTED_WAIT_NS)
+				return now + (int64_t)wait_ns;
+		}
 
-	UNUSED_PARAMETER(success);
+		if (!(stream->packet_num = read_packets(stream, false))) {
+			int64_t due;
+			if (arm_notify(stream, now, &due))
+				return due;
+			continue;
+		}
+		stream->pace_since = 0;
+		for (int j = 0; j < stream->packet_num; j++) {
+			struct encoder_packet *packet = &stream->packets[j];
+			net_pacing_measure(&stream->pacing, packet->size, packet->pts);
+			net_pacing_take(&stream->pacing, packet->size);
+		}
+
+		stream->release_pending = true;
+		if (!send_packets(stream))
+			goto disconnect;
+		stream->sent_frames += stream->packet_num;
+	}
+	return (int64_t)os_gettime_ns();
+
+disconnect:
+	tlog(TLOG_ERROR, "error occur! will disconnect !\n");
+	os_atomic_set_bool(&stream->disconnected, true);
+	egress_remove(conn);
+	finish_send(stream);
+	return EGRESS_DONE;
+}
+
+/**< Sends a TLS or HTTP stream, librtmp writes it blocking. The packets are copied
+ *   out of the ring buffer, none is pinned while the socket drains */
+static void *send_thread(void *data)
+{
+	struct rtmp_stream *stream = data;
+	int64_t now;
+
+	os_set_thread_name("rtmp-stream: send thread");
+
+	while (active(stream) && !stopping(stream)) {
+		if (!stream->new_socket_loop && !discard_recv_data(stream))
+			goto disconnect;
+
+		now = (int64_t)os_gettime_ns();
+		uint64_t wait_ns = net_pacing_delay(&stream->pacing, stream->conn.fd);
+		if (wait_ns) {
+			if (!stream->pace_since)
+				stream->pace_since = now;
+			if (now - stream->pace_since < RTMP_CONGESTED_WAIT_NS) {
+				os_event_timedwait(stream->stop_event,
+						(unsigned long)(wait_ns / 1000000) + 1);
+				continue;
+			}
+		}
+
+		if (!(stream->packet_num = read_packets(stream, true))) {
+			stream->output->wait_encoder_packet(stream->output, RTMP_PACKET_WAIT_MS);
+			continue;
+		}
+		stream->pace_since = 0;
+		for (int j = 0; j < stream->packet_num; j++) {
+			struct encoder_packet *packet = &stream->packets[j];
+			net_pacing_measure(&stream->pacing, packet->size, packet->pts);
+			net_pacing_take(&stream->pacing, packet->size);
+		}
+
+		if (!send_packets(stream))
+			goto disconnect;
+		stream->sent_frames += stream->packet_num;
+	}
+
+	finish_send(stream);
+	return NULL;
+
+disconnect:
+	tlog(TLOG_ERROR, "error occur! will disconnect !\n");
+	os_atomic_set_bool(&stream->disconnected, true);
+	finish_send(stream);
 	return NULL;
 }
 
-static inline bool reset_semaphore(struct rtmp_stream *stream)
+/**< Take the stream off the egress worker, or wait its send thread out. The send
+ *   thread itself gets here by signal_stop of a disconnect and is joined later */
+static void stop_send(struct rtmp_stream *stream)
 {
-	os_sem_destroy(stream->send_sem);
-	return os_sem_init(&stream->send_sem, 0) == 0;
+	if (!stream->send_joinable) {
+		egress_remove(&stream->conn);
+	} else if (!pthread_equal(pthread_self(), stream->send_thread)) {
+		pthread_join(stream->send_thread, NULL);
+		stream->send_joinable = false;
+	}
 }
 
 static int init_send(struct rtmp_stream *stream)
@@ -585,25 +1055,45 @@ static int init_send(struct rtmp_stream *stream)
         return MGW_DISCONNECTED;
     }
 
-    reset_semaphore(stream);
+    /**< The send thread of the last connection may not be joined yet. Connected by
+     *   the egress worker, the stream stays on it and only its run is switched */
+    if (stream->send_joinable)
+        stop_send(stream);
+    os_atomic_set_bool(&stream->finishing, false);
+    stream->conn.fd = stream->rtmp.m_sb.sb_socket;
+    stream->conn.run = rtmp_stream_run;
+
     os_atomic_set_bool(&stream->active, true);
-    if (pthread_create(&stream->send_thread, NULL, send_thread, stream) != 0) {
-        RTMP_Close(&stream->rtmp);
-        blog(MGW_LOG_ERROR, "Failed to create send thread!");
-        os_atomic_set_bool(&stream->active, false);
-        return MGW_ERROR;
+    if (!RTMP_CanSendV(&stream->rtmp)) {
+        /**< TLS and HTTP are left blocking, librtmp writes them by send_thread. Off
+         *   the egress worker if connected by it, which run of conn may do itself */
+        egress_remove(&stream->conn);
+        if (pthread_create(&stream->send_thread, NULL, send_thread, stream) != 0) {
+            RTMP_Close(&stream->rtmp);
+            blog(MGW_LOG_ERROR, "Failed to create the rtmp send thread!");
+            os_atomic_set_bool(&stream->active, false);
+            return MGW_ERROR;
+        }
+        stream->send_joinable = true;
     } else {
-		call_params_t param = {};
-		do_output_proc_handler(stream, "signal_started", &param);
-	}
+        fcntl(stream->conn.fd, F_SETFL, fcntl(stream->conn.fd, F_GETFL) | O_NONBLOCK);
+        if (!stream->conn.worker && !egress_add(&stream->conn)) {
+            RTMP_Close(&stream->rtmp);
+            blog(MGW_LOG_ERROR, "Failed to add the stream to egress!");
+            os_atomic_set_bool(&stream->active, false);
+            return MGW_ERROR;
+        }
+    }
 
+    call_params_t param = {};
+    do_output_proc_handler(stream, "signal_started", &param);
     return MGW_SUCCESS;
 }
 
 static bool init_connect(struct rtmp_stream *stream)
 {
 	if (stopping(stream)) {
-		pthread_join(stream->send_thread, NULL);
+		stop_send(stream);
 	}
     os_atomic_set_bool(&stream->disconnected, false);
 
@@ -616,10 +1106,6 @@ static bool init_connect(struct rtmp_stream *stream)
 	const char *netif_type = mgw_data_get_string(output_settings, "netif_type");
 	const char *netif_name = mgw_data_get_string(output_settings, "netif_name");
 
-	call_params_t params = {};
-	if (0 != do_source_proc_handler(stream, "get_encoder_settings", &params))
-		tlog(TLOG_ERROR, "Couldn't get encoder settings!\n");
-
     if (path && key) {
         dstr_copy(&stream->path,        path);
 	    dstr_copy(&stream->key,         key);
@@ -650,15 +1136,39 @@ static bool init_connect(struct rtmp_stream *stream)
 	stream->max_shutdown_time_sec =
 		(int)mgw_data_get_int(output_settings, "max_shutdown_time_sec");
 
+	mgw_data_set_default_bool(output_settings, "pacing", true);
+	mgw_data_set_default_double(output_settings, "pacing_burst", PACING_BURST_DEF);
+	net_pacing_init(&stream->pacing, mgw_data_get_bool(output_settings, "pacing"),
+			mgw_data_get_double(output_settings, "pacing_burst"));
+
+	mgw_data_set_default_int(output_settings, "connect_timeout_ms", RTMP_CONNECT_TIMEOUT_DEF);
+	mgw_data_set_default_int(output_settings, "handshake_timeout_ms", RTMP_HANDSHAKE_TIMEOUT_DEF);
+	mgw_data_set_default_int(output_settings, "publish_timeout_ms", RTMP_PUBLISH_TIMEOUT_DEF);
+	stream->connect_timeout_ms =
+		(uint32_t)mgw_data_get_int(output_settings, "connect_timeout_ms");
+	stream->handshake_timeout_ms =
+		(uint32_t)mgw_data_get_int(output_settings, "handshake_timeout_ms");
+	stream->publish_timeout_ms =
+		(uint32_t)mgw_data_get_int(output_settings, "publish_timeout_ms");
+
+	mgw_data_set_default_int(output_settings, "chunk_size", RTMP_CHUNK_SIZE_DEF);
+	mgw_data_set_default_bool(output_settings, "aggregate", false);
+	int64_t chunk_size = mgw_data_get_int(output_settings, "chunk_size");
+	if (chunk_size < RTMP_DEFAULT_CHUNKSIZE)
+		chunk_size = RTMP_DEFAULT_CHUNKSIZE;
+	else if (chunk_size > RTMP_CHUNK_SIZE_MAX)
+		chunk_size = RTMP_CHUNK_SIZE_MAX;
+	stream->chunk_size = (uint32_t)chunk_size;
+	stream->aggregate = mgw_data_get_bool(output_settings, "aggregate");
+
     dstr_copy(&stream->encoder_name, "FMLE/3.0 (compatible; FMSc/1.0)");
 
 	mgw_data_release(output_settings);
-	if (params.out)
-		mgw_data_release((mgw_data_t *)params.out);
 	return true;
 }
 
-static int try_connect(struct rtmp_stream *stream)
+/**< Set up rtmp by the url and options before connecting */
+static int setup_connect(struct rtmp_stream *stream)
 {
     tlog(TLOG_INFO, "Connecting to rtmp url: %s  code: %s ...",
 				stream->path.array, stream->key.array);
@@ -699,10 +1209,15 @@ static int try_connect(struct rtmp_stream *stream)
 
     RTMP_AddStream(&stream->rtmp, stream->key.array);
 
-    stream->rtmp.m_outChunkSize        = 4096;
+    stream->rtmp.m_outChunkSize        = (int)stream->chunk_size;
     stream->rtmp.m_bSendChunkSizeInfo  = true;
     stream->rtmp.m_bUseNagle           = false;
+    return MGW_SUCCESS;
+}
 
+/**< Blocking connect of what the egress worker can not do, TLS, HTTP or SOCKS */
+static int try_connect(struct rtmp_stream *stream)
+{
     if (!RTMP_Connect(&stream->rtmp, NULL)) {
         stream->output->last_error_status = stream->rtmp.last_error_code;
         return MGW_CONNECT_FAILED;
@@ -722,16 +1237,6 @@ static void *connect_thread(void *data)
 
     os_set_thread_name("rtmp-stream: connect thread");
 
-    if (!init_connect(stream)) {
-		tlog(TLOG_INFO, "rtmp stream init_connect signal stop, ret:%d", MGW_BAD_PATH);
-		ret = MGW_BAD_PATH;
-		do_output_proc_handler(stream, "signal_stop", &params);
-        // stream->output->signal_stop(stream->output, MGW_OUTPUT_BAD_PATH);
-		pthread_detach(stream->connect_thread);
-        return NULL;
-    }
-
-	stream->connect_count++;
     if ((ret = try_connect(stream)) != MGW_SUCCESS) {
 		tlog(TLOG_ERROR, "Connect to %s failed: %d\n", stream->path.array, ret);
 		do_output_proc_handler(stream, "signal_stop", &params);
@@ -744,16 +1249,125 @@ static void *connect_thread(void *data)
 	return NULL;
 }
 
+static inline uint32_t phase_timeout_ms(struct rtmp_stream *stream, int phase)
+{
+	switch (phase) {
+	case RTMP_CONNECT_TCP:       return stream->connect_timeout_ms;
+	case RTMP_CONNECT_HANDSHAKE: return stream->handshake_timeout_ms;
+	default:                     return stream->publish_timeout_ms;
+	}
+}
+
+static inline int phase_error(int phase)
+{
+	return RTMP_CONNECT_PUBLISH == phase ? MGW_INVALID_STREAM : MGW_CONNECT_FAILED;
+}
+
+/**< Run by the egress worker while connecting, the socket is stepped through the TCP
+ *   connect, handshake and publish commands as it gets ready, each phase times out
+ *   by itself. An error before connecting is signaled from here too */
+static int64_t rtmp_stream_connect_run(struct egress_conn *conn, uint32_t events)
+{
+	struct rtmp_stream *stream = (struct rtmp_stream *)((uint8_t *)conn -
+					offsetof(struct rtmp_stream, conn));
+	int64_t now = (int64_t)os_gettime_ns();
+	int phase = stream->connect.phase;
+	int ret = stream->connect_error;
+	int wait;
+
+	if (MGW_SUCCESS != ret)
+		goto fail;
+
+	if ((wait = RTMP_ConnectStep(&stream->rtmp, &stream->connect)) < 0) {
+		stream->output->last_error_status = stream->rtmp.last_error_code;
+		ret = phase_error(stream->connect.phase);
+		goto fail;
+	}
+
+	if (RTMP_CONNECT_DONE == stream->connect.phase) {
+		tlog(TLOG_INFO, "Connecting rtmp stream success, tcp connect %d ms, total %"PRId64" ms",
+				stream->rtmp.connect_time_ms,
+				(now - (int64_t)stream->connect.connectStart) / 1000000);
+		if ((ret = init_send(stream)) != MGW_SUCCESS)
+			goto fail;
+		os_atomic_set_bool(&stream->connecting, false);
+		return now;
+	}
+
+	if (stream->connect.phase != phase)
+		stream->phase_since = now;
+	int64_t due = stream->phase_since +
+			(int64_t)phase_timeout_ms(stream, stream->connect.phase) * 1000000;
+	if (now >= due) {
+		tlog(TLOG_ERROR, "rtmp connect phase %d timed out after %u ms\n",
+				stream->connect.phase, phase_timeout_ms(stream, stream->connect.phase));
+		ret = phase_error(stream->connect.phase);
+		goto fail;
+	}
+
+	conn->want_out = RTMP_WAIT_WRITE == wait;
+	return due;
+
+fail:
+	tlog(TLOG_ERROR, "Connect to %s failed: %d\n", stream->path.array, ret);
+	egress_remove(conn);
+	RTMP_Close(&stream->rtmp);
+	call_params_t params = {.in = &ret};
+	do_output_proc_handler(stream, "signal_stop", &params);
+	os_atomic_set_bool(&stream->connecting, false);
+	return EGRESS_DONE;
+}
+
+/**< Stop connecting, after this the stream is either not connected or active */
+static void abort_connect(struct rtmp_stream *stream)
+{
+	if (!stream->connect_async) {
+		pthread_join(stream->connect_thread, NULL);
+		return;
+	}
+
+	egress_remove(&stream->conn);
+	if (connecting(stream)) {
+		RTMP_Close(&stream->rtmp);
+		os_atomic_set_bool(&stream->connecting, false);
+	}
+}
+
 static bool rtmp_stream_start(void *data)
 {
     struct rtmp_stream *stream = data;
+	int ret = MGW_BAD_PATH;
+
     if (!do_output_proc_handler(stream, "source_ready", NULL)) {
 		blog(MGW_LOG_ERROR, "source is not ready!");
 		return false;
     }
 
     os_atomic_set_bool(&stream->connecting, true);
-	return pthread_create(&stream->connect_thread, NULL, connect_thread, stream) == 0;
+	if (init_connect(stream)) {
+		stream->connect_count++;
+		ret = setup_connect(stream);
+	}
+
+	stream->connect_async = MGW_SUCCESS != ret || RTMP_CanConnectAsync(&stream->rtmp);
+	if (!stream->connect_async)
+		return pthread_create(&stream->connect_thread, NULL, connect_thread, stream) == 0;
+
+	/**< Only resolving the host blocks here, a failure is signaled by the worker */
+	if (MGW_SUCCESS == ret && !RTMP_ConnectStart(&stream->rtmp, &stream->connect)) {
+		stream->output->last_error_status = stream->rtmp.last_error_code;
+		ret = MGW_CONNECT_FAILED;
+	}
+	stream->connect_error = ret;
+	stream->conn.fd = MGW_SUCCESS == ret ? stream->rtmp.m_sb.sb_socket : -1;
+	stream->conn.run = rtmp_stream_connect_run;
+	stream->phase_since = (int64_t)os_gettime_ns();
+	if (!egress_add(&stream->conn)) {
+		RTMP_Close(&stream->rtmp);
+		os_atomic_set_bool(&stream->connecting, false);
+		return false;
+	}
+	return true;
 }
 
 static void rtmp_stream_stop(void *data)
@@ -770,15 +1384,15 @@ static void rtmp_stream_stop(void *data)
 		return;
 	
 	if (connecting(stream))
-		pthread_join(stream->connect_thread, NULL);
+		abort_connect(stream);
 
 	stream->stop_time = (uint64_t)os_gettime_ns();
 
 	if (active(stream)) {
 		os_event_signal(stream->stop_event);
-        pthread_join(stream->send_thread, NULL);
-		if (stream->stop_time == 0)
-			os_sem_post(stream->send_sem);
+		stream->output->cancel_wait_packet(stream->output);
+		stop_send(stream);
+		finish_send(stream);
 	} else {
 		tlog(TLOG_INFO, "rtmp stream stop signal stop, ret:%d\n", MGW_SUCCESS);
 		ret = MGW_SUCCESS;
@@ -22,6 +22,10 @@
 #define	SRT_DROP_THRESHOLD	3
 #define SRT_ERROR_THRESHOLD	100
 #define SRT_MAX_PACKET_SIZE	564000
+/**< Max time of send thread waiting for packet, stop will interrupt it */
+#define SRT_PACKET_WAIT_MS	100
+/**< Max packets got by one read of send thread */
+#define SRT_PACKET_BATCH	16
 
 struct srt_stream {
 	mgw_output_t			*output;
@@ -182,8 +186,10 @@ static void srt_stream_destroy(void *data)
 
 	blog(MGW_LOG_INFO, "Receive destroy srt stream message!");
 
-	if (active(stream) && !stopping(stream))
+	if (active(stream) && !stopping(stream)) {
 		os_event_signal(stream->stop_event);
+		stream->output->cancel_wait_packet(stream->output);
+	}
 
 	if (stopping(stream) && active(stream))
 		pthread_join(stream->send_thread, NULL);
@@ -322,11 +328,14 @@ static void *connect_and_send_thread(void *arg)
 		if (stopping(stream) || disconnected(stream))
 			break;
 
-		struct encoder_packet packet = {};
-		packet.data = stream->frame_buffer;
-		if (stream->output->get_encoder_packet(
-						stream->output, &packet) <= 0) {
-			usleep(5 *1000);
+		/**< Copy the packets available into frame_buffer, sending them may block and
+		 *   sleep, the frames of a zero copy read would stay pinned all that time */
+		struct encoder_packet packets[SRT_PACKET_BATCH] = {};
+		int count = stream->output->get_encoder_packets(stream->output, packets,
+						SRT_PACKET_BATCH, stream->frame_buffer, MGW_MAX_PACKET_SIZE, true);
+		if (count <= 0) {
+			stream->output->wait_encoder_packet(stream->output,
+							SRT_PACKET_WAIT_MS);
 			continue;
 		}
 
@@ -336,14 +345,17 @@ static void *connect_and_send_thread(void *arg)
 		// 				stream->last_dts, packet.pts, ts_gap);
 		// }
 
-		if ((ret = stream->mpegts_info->send_packet(stream->mpegts, &packet)) < 0) {
-			usleep(5*1000);
-			continue;
+		for (int i = 0; i < count && !stopping(stream); i++) {
+			ret = stream->mpegts_info->send_packet(stream->mpegts, &packets[i]);
+			if (ret < 0) {
+				usleep(5*1000);
+				continue;
+			}
+			stream->last_dts = packets[i].pts / 1000;
+			stream->total_sent_frames++;
+			if ((stream->total_sent_frames % 6) == 0)
+				usleep(10*1000);
 		}
-		stream->last_dts = packet.pts / 1000;
-		stream->total_sent_frames++;
-		if ((stream->total_sent_frames % 6) == 0)
-			usleep(10*1000);
 	}
 
 	if (disconnected(stream)) {
@@ -356,6 +368,7 @@ static void *connect_and_send_thread(void *arg)
 error:
 	stream->output->last_error_status = stream->last_error_code;
 	mgw_libsrt_close(&stream->srt_context);
+	stream->output->release_encoder_packet(stream->output);
 	/**< reconect srt need to recreate mpegts, here destroy it */
 	stream->mpegts_info->stop(stream->mpegts);
 	stream->mpegts_info->destroy(stream->mpegts);
@@ -393,9 +406,10 @@ static void srt_stream_stop(void *data)
 	if (!stream || stopping(stream))
 		return;
 
-	if (active(stream))
+	if (active(stream)) {
 		os_event_signal(stream->stop_event);
-	else {
+		stream->output->cancel_wait_packet(stream->output);
+	} else {
 		tlog(TLOG_INFO, "srt stream stop signal stop, ret:%d", MGW_SUCCESS);
 		int ret = MGW_SUCCESS;
 		call_params_t params = {.in = &ret};
@@ -0,0 +1,219 @@
+/**
+ * Stress test of the stream buffer: one writer puts frames at full rate,
+ * many readers read them by copy and by zero copy at the same time, every
+ * frame read is verified against the pattern it was written with.
+ *
+ * usage: stream-buff-stress [-r readers] [-t seconds] [-f frames] [-s size] [-m] [-M] [-H]
+ *        -m uses share memory instead of heap memory, -M mirrors the data region,
+ *        -H asks for huge pages
+ * Jumps of slow readers are logged only if the buffer is built with -DSTREAM_BUFF_VERBOSE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "buffer/stream_buff.h"
+
+#define STRESS_BUFF_NAME    "stream-buff-stress"
+#define STRESS_MAX_FRAME    (256 * 1024)
+#define STRESS_GOP          30
+
+struct reader_stats {
+    pthread_t           thread;
+    int                 id;
+    int                 zero_copy;
+    unsigned long long  frames;
+    unsigned long long  bytes;
+    unsigned long long  slow;
+    unsigned long long  covered;
+    unsigned long long  corrupt;
+};
+
+static volatile int stop;
+static int mem_type = MEM_DYNAMIC;
+static unsigned int buff_size = 10 * 1024 * 1024;
+static int buff_frames = 30;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Length and content of a frame only depend on its number (the timestamp) */
+static uint32_t frame_len(uint64_t n)
+{
+    return 64 + (uint32_t)((n * 7919) % (STRESS_MAX_FRAME - 64));
+}
+
+static inline uint8_t frame_byte(uint64_t n, uint32_t i)
+{
+    return (uint8_t)(n * 31 + i);
+}
+
+static void fill_frame(uint8_t *data, uint64_t n, uint32_t len)
+{
+    uint32_t i;
+    data[0] = 0; data[1] = 0; data[2] = 0; data[3] = 1;
+    for (i = 4; i < len; i++)
+        data[i] = frame_byte(n, i);
+}
+
+/** Verify a piece of frame 'n' starting at offset 'off' */
+static int check_piece(const uint8_t *data, uint32_t len, uint64_t n, uint32_t off)
+{
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        uint32_t pos = off + i;
+        uint8_t expect = pos < 3 ? 0 : (pos == 3 ? 1 : frame_byte(n, pos));
+        if (data[i] != expect)
+            return -1;
+    }
+    return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader_stats *st = arg;
+    char id[32];
+    uint8_t *buf = malloc(STRESS_MAX_FRAME);
+    snprintf(id, sizeof(id), "reader-%d", st->id);
+
+    BuffContext *ctx = CreateStreamBuff(buff_size, STRESS_BUFF_NAME, id,
+                            buff_frames, mem_type, IO_MODE_READ, 0, NULL);
+    if (!ctx) {
+        fprintf(stderr, "reader %d create buffer failed\n", st->id);
+        free(buf);
+        return NULL;
+    }
+
+    while (!stop) {
+        int ret;
+        uint64_t n;
+        if (st->zero_copy) {
+            SGetFrameInfo info = {0};
+            info.slot = -1;
+            ret = GetOneFrameRefFromBuff(ctx, &info);
+            if (ret > 0) {
+                n = info.timestamp;
+                int bad = ret != frame_len(n) ||
+                    check_piece((uint8_t *)info.faddr[0].pframe, info.faddr[0].len, n, 0) ||
+                    (info.addrnum == 2 && check_piece((uint8_t *)info.faddr[1].pframe,
+                                        info.faddr[1].len, n, info.faddr[0].len));
+                /** The writer takes over a pinned slot, the data is torn only then */
+                if (ReleaseOneFrameToBuff(ctx, &info) == -3)
+                    st->covered++;
+                else if (bad)
+                    st->corrupt++;
+            }
+        } else {
+            int64_t ts = 0;
+            frame_t type;
+            int priority;
+            ret = GetOneFrameFromBuff(ctx, &buf, STRESS_MAX_FRAME, &ts, &type, &priority);
+            if (ret > 0) {
+                n = ts;
+                if (ret != frame_len(n) || check_piece(buf, ret, n, 0))
+                    st->corrupt++;
+            }
+        }
+
+        if (ret > 0) {
+            st->frames++;
+            st->bytes += ret;
+        } else if (ret == FRAME_CONSUME_SLOW) {
+            st->slow++;
+        } else {
+            WaitFrameFromBuff(ctx, 10);
+        }
+    }
+
+    DeleteStreamBuff(ctx);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int readers = 8, seconds = 5, opt, i;
+    unsigned long long written = 0, written_bytes = 0;
+
+    while ((opt = getopt(argc, argv, "r:t:f:s:mMH")) != -1) {
+        switch (opt) {
+        case 'r': readers = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'f': buff_frames = atoi(optarg); break;
+        case 's': buff_size = strtoul(optarg, NULL, 0); break;
+        case 'm': mem_type = (mem_type & ~MEM_TYPE_MASK) | MEM_SHARED; break;
+        case 'M': mem_type |= MEM_FLAG_MIRROR; break;
+        case 'H': mem_type |= MEM_FLAG_HUGEPAGE; break;
+        default:
+            fprintf(stderr, "usage: %s [-r readers] [-t seconds] [-f frames] [-s size] [-m] [-M] [-H]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    BuffContext *wctx = CreateStreamBuff(buff_size, STRESS_BUFF_NAME, "writer",
+                            buff_frames, mem_type, IO_MODE_WRITE, 0, NULL);
+    if (!wctx) {
+        fprintf(stderr, "create writer buffer failed\n");
+        return -1;
+    }
+
+    struct reader_stats *stats = calloc(readers, sizeof(*stats));
+    for (i = 0; i < readers; i++) {
+        stats[i].id = i;
+        stats[i].zero_copy = i & 1;
+        pthread_create(&stats[i].thread, NULL, reader_thread, &stats[i]);
+    }
+
+    uint8_t *frame = malloc(STRESS_MAX_FRAME);
+    uint64_t start = now_ns(), end = start + (uint64_t)seconds * 1000000000ULL;
+    uint64_t n = 0;
+    uint32_t len = frame_len(n);
+    fill_frame(frame, n, len);
+    while (now_ns() < end) {
+        int ret = PutOneFrameToBuff(wctx, frame, len, n,
+                            n % STRESS_GOP ? FRAME_P : FRAME_I, FRAME_PRIORITY_LOW);
+        if (ret < 0) {
+            fprintf(stderr, "put frame %llu failed: %d\n", (unsigned long long)n, ret);
+            break;
+        }
+        written++;
+        written_bytes += len;
+        len = frame_len(++n);
+        fill_frame(frame, n, len);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    stop = 1;
+    unsigned long long read = 0, read_bytes = 0, slow = 0, covered = 0, corrupt = 0;
+    for (i = 0; i < readers; i++) {
+        pthread_join(stats[i].thread, NULL);
+        read += stats[i].frames;
+        read_bytes += stats[i].bytes;
+        slow += stats[i].slow;
+        covered += stats[i].covered;
+        corrupt += stats[i].corrupt;
+        fprintf(stderr, "reader %2d (%s): %llu frames, %llu slow, %llu covered, %llu corrupt\n", i,
+                stats[i].zero_copy ? "zero copy" : "copy",
+                stats[i].frames, stats[i].slow, stats[i].covered, stats[i].corrupt);
+    }
+    DeleteStreamBuff(wctx);
+
+    fprintf(stderr, "writer : %llu frames, %.0f frames/s, %.1f MB/s\n",
+            written, written / elapsed, written_bytes / elapsed / 1048576);
+    fprintf(stderr, "readers: %llu frames, %.0f frames/s, %.1f MB/s, %llu slow, %llu pinned frames covered\n",
+            read, read / elapsed, read_bytes / elapsed / 1048576, slow, covered);
+    fprintf(stderr, "corrupt: %llu\n", corrupt);
+
+    free(frame);
+    free(stats);
+    return corrupt ? 1 : 0;
+}